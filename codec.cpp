@@ -1,4 +1,8 @@
 #include "codec.h"
+#include "filecache.h"
+#include "image.h"
+#include "scratch.h"
+#include "threadpool.h"
 #include "util.h"
 
 #include <stdlib.h>
@@ -9,7 +13,7 @@ void CCodecs::registerCodec(const CCodecDesc& desc)
 	codecs.push_back(desc);
 }
 
-bool CCodecs::decode(const char *filename, CImage& img, const CCodecSettings& cfg)
+bool CCodecs::decode(const char *filename, CImage& img, const CCodecSettings& cfg, TCodecDecodeCtx *ctx)
 {
 	void *buf = NULL;
 	size_t size = 0;
@@ -21,13 +25,34 @@ bool CCodecs::decode(const char *filename, CImage& img, const CCodecSettings& cf
 		return false;
 	}
 
+	TCodecDecodeCtx defaultCtx;
+	if (!ctx) {
+		ctx = &defaultCtx;
+	}
+	/* read the file once, the header is sniffed from its contents and
+	 * the codecs decode it from memory. A thumbnail needs only the start
+	 * of the file, it is read from disk unless the file is cached anyway */
+	TFileBytes fileBytes;
+	if (fileCache && !ctx->fileData &&
+	    ((ctx->thumbnail) ? fileCache->peek(filename, fileBytes) : fileCache->load(filename, fileBytes))) {
+		ctx->fileData = fileBytes->data();
+		ctx->fileSize = fileBytes->size();
+		buf = (void*)ctx->fileData;
+		size = (ctx->fileSize < cfg.scanHeaderSize) ? ctx->fileSize : cfg.scanHeaderSize;
+		bufAllocTried = true;
+	}
+	CScratchScope scratch;
 	for (size_t i=0; i<codecs.size() && !success; i++) {
 		bool tryThis = false;
 		CCodecDesc& c = codecs[i];
+		if (ctx->cancel && ctx->cancel->isCancelled()) {
+			/* don't try the other codecs */
+			break;
+		}
 		if (c.supportsFormat) {
 			if (cfg.scanHeaderSize > 0 && !bufAllocTried) {
 				bufAllocTried = true;
-				buf = malloc(cfg.scanHeaderSize);
+				buf = scratch.getArena().allocate(cfg.scanHeaderSize);
 				if (buf) {
 					FILE *f = util::fopen_wrapper(filename, "rb");
 					if (f) {
@@ -64,16 +89,26 @@ bool CCodecs::decode(const char *filename, CImage& img, const CCodecSettings& cf
 			}
 		}
 		if (c.decode && tryThis) {
+			ctx->scaleShift = 0;
+			ctx->isThumbnail = false;
+			ctx->fullWidth = 0;
+			ctx->fullHeight = 0;
 			try {
-				success = c.decode(filename, img, cfg);
+				success = c.decode(filename, img, cfg, *ctx);
 			} catch(...) {
 				success = false;
 			}
+			if (success && !ctx->fullWidth) {
+				/* the codec decoded the full image */
+				ctx->fullWidth = img.getInfo().width;
+				ctx->fullHeight = img.getInfo().height;
+			}
 		}
 	}
-
-	if (buf) {
-		free(buf);
+	if (fileBytes) {
+		/* only valid as long as fileBytes is */
+		ctx->fileData = NULL;
+		ctx->fileSize = 0;
 	}
 
 	return success;
@@ -2,9 +2,12 @@
 #define FASTCROP_CODEC_H
 
 //#include <unistd.h>
+#include <stddef.h>
 #include <vector>
 
 class CImage; // forward image.h
+class CCancelToken; // forward threadpool.h
+class CFileCache; // forward filecache.h
 
 typedef enum {
 	JPEG_SUBSAMPLING_444 = 0,
@@ -19,6 +22,7 @@ struct CCodecSettings {
 	size_t scanHeaderSize;
 
 	bool  autoRotate;
+	bool  planarYCbCr; /* decoders may return FC_LAYOUT_YCBCR_PLANAR images */
 	const char *forceCodecName;
 	const char *forceExt;
 
@@ -28,6 +32,7 @@ struct CCodecSettings {
 		jpegSubsamplingMode(JPEG_SUBSAMPLING_420),
 		scanHeaderSize(1024),
 		autoRotate(true),
+		planarYCbCr(false),
 		forceCodecName(NULL),
 		forceExt(NULL)
 	{}
@@ -35,7 +40,38 @@ struct CCodecSettings {
 
 typedef bool (*TPtrSupportsName)(const char *filename, const char *ext, const CCodecSettings& cfg);
 typedef bool (*TPtrSupportsFormat)(const void *header, size_t size, const CCodecSettings& cfg);
-typedef bool (*TPtrDecode)(const char *filename, CImage& img, const CCodecSettings& cfg);
+/* parameters and results of a single decode, all dimensions are after the
+ * EXIF orientation is applied */
+struct TCodecDecodeCtx {
+	const CCancelToken *cancel;	/* fail early when this is cancelled, may be NULL */
+	unsigned int maxScaleShift;	/* the decoder may reduce the image by up to 2^maxScaleShift */
+	size_t fitWidth;		/* ... but not below the size it has when fitted */
+	size_t fitHeight;		/* into fitWidth x fitHeight (0: no limit) */
+	bool thumbnail;			/* an embedded thumbnail is good enough */
+	const unsigned char *fileData;	/* the file is already in memory, NULL: read it */
+	size_t fileSize;
+
+	unsigned int scaleShift;	/* out: the reduction the decoder applied */
+	bool isThumbnail;		/* out: the embedded thumbnail was decoded */
+	size_t fullWidth;		/* out: size of the full resolution image */
+	size_t fullHeight;
+
+	TCodecDecodeCtx() noexcept :
+		cancel(NULL),
+		maxScaleShift(0),
+		fitWidth(0),
+		fitHeight(0),
+		thumbnail(false),
+		fileData(NULL),
+		fileSize(0),
+		scaleShift(0),
+		isThumbnail(false),
+		fullWidth(0),
+		fullHeight(0)
+	{}
+};
+
+typedef bool (*TPtrDecode)(const char *filename, CImage& img, const CCodecSettings& cfg, TCodecDecodeCtx& ctx);
 typedef bool (*TPtrEncode)(const char *filename, const CImage& img, const CCodecSettings& cfg);
 
 struct CCodecDesc {
@@ -58,11 +94,17 @@ struct CCodecDesc {
 class CCodecs {
 	private:
 		std::vector<CCodecDesc> codecs;
+		CFileCache *fileCache;
 	
 	public:
+		CCodecs() : fileCache(NULL) {}
+
 		void registerCodec(const CCodecDesc& desc);
+		/* decode from the file contents kept in this cache (NULL: read
+		 * the files directly), set before any decode is started */
+		void setFileCache(CFileCache *cache) {fileCache = cache;}
 
-		bool decode(const char *filename, CImage& img, const CCodecSettings& cfg);
+		bool decode(const char *filename, CImage& img, const CCodecSettings& cfg, TCodecDecodeCtx *ctx = NULL);
 		bool encode(const char *filename, const CImage& img, const CCodecSettings& cfg);
 };
 
@@ -3,6 +3,8 @@
 #include "codec_libjpeg.h"
 
 #include "image.h"
+#include "scratch.h"
+#include "threadpool.h"
 #include "util.h"
 
 #include <jpeglib.h>
@@ -10,6 +12,10 @@
 #include <string.h>
 #include <setjmp.h>
 
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+#define FC_HAVE_JPEG_MEM_SRC
+#endif
+
 static bool supportsName(const char *filename, const char *ext, const CCodecSettings& cfg)
 {
 	(void)cfg;
@@ -40,6 +46,7 @@ static bool supportsFormat(const void *header, size_t size, const CCodecSettings
 struct fc_error_mgr {
   struct jpeg_error_mgr pub;
   jmp_buf setjmp_buffer;
+  bool cancelled;
 };
 
 void my_error_exit(j_common_ptr cinfo)
@@ -48,19 +55,327 @@ void my_error_exit(j_common_ptr cinfo)
   err->pub.output_message(cinfo);
   longjmp(err->setjmp_buffer, 1);
 }
-static bool decode(const char *filename, CImage& img, const CCodecSettings& cfg)
+
+/* libjpeg calls this once per scanline or iMCU row: a cancelled decode
+ * leaves through the error handler's jump */
+struct fc_progress_mgr {
+  struct jpeg_progress_mgr pub;
+  const CCancelToken *cancel;
+};
+
+static void my_progress_monitor(j_common_ptr cinfo)
+{
+  struct fc_progress_mgr* progress = (struct fc_progress_mgr*)cinfo->progress;
+  if (progress->cancel->isCancelled()) {
+    struct fc_error_mgr* err = (struct fc_error_mgr*)cinfo->err;
+    err->cancelled = true;
+    longjmp(err->setjmp_buffer, 1);
+  }
+}
+/* Set up the mapping of decoded pixels to the EXIF orientation: pixel x of
+ * a decoded row goes to pos[x*pixel_offset], and pos advances by row_offset
+ * per decoded row. w and h are the dimensions of the oriented output,
+ * n the number of bytes per pixel. */
+static unsigned char* getOrientationMapping(uint16_t orientation, unsigned char *data, ptrdiff_t w, ptrdiff_t h, ptrdiff_t n, ptrdiff_t& pixel_offset, ptrdiff_t& row_offset)
+{
+	unsigned char *pos;
+	switch(orientation) {
+		case 2:
+			row_offset = w * n;
+			pos = data + row_offset- n;
+			pixel_offset = -n;
+			break;
+		case 3:
+			row_offset = w * n;
+			pos = data + h * row_offset - n;
+			row_offset = -row_offset;
+			pixel_offset = -n;
+			break;
+		case 4:
+			row_offset = w * n;
+			pos = data + (h-1) * row_offset;
+			row_offset = -row_offset;
+			pixel_offset = n;
+			break;
+		case 5:
+			pixel_offset = w * n;
+			pos = data + h * pixel_offset - n;
+			row_offset = -n;
+			pixel_offset = -pixel_offset;
+			break;
+		case 6:
+			pixel_offset = w * n;
+			row_offset = -n;
+			pos = data + (w-1) * n;
+			break;
+		case 7:
+			pos = data;
+			pixel_offset = w * n;
+			row_offset = n;
+			break;
+		case 8:
+			pixel_offset = w * n;
+			pos = data + pixel_offset * (h-1);
+			pixel_offset = - pixel_offset;
+			row_offset = n;
+			break;
+		default:
+			pos = data;
+			pixel_offset = n;
+			row_offset = w * n;
+	}
+	return pos;
+}
+
+static bool getSampShift(int factor, size_t& shift)
+{
+	switch (factor) {
+		case 1:
+			shift = 0;
+			break;
+		case 2:
+			shift = 1;
+			break;
+		case 4:
+			shift = 2;
+			break;
+		default:
+			return false;
+	}
+	return true;
+}
+
+/* we can keep the YCbCr planes if the chroma is subsampled by powers of two,
+ * and the orientation does not mirror partially covered chroma blocks */
+static bool canDecodeRaw(const struct jpeg_decompress_struct& cinfo, uint16_t orientation, size_t shift[2])
+{
+	if (cinfo.num_components != 3 || cinfo.jpeg_color_space != JCS_YCbCr) {
+		return false;
+	}
+	for (int c=1; c<3; c++) {
+		if (cinfo.comp_info[c].h_samp_factor != 1 || cinfo.comp_info[c].v_samp_factor != 1) {
+			return false;
+		}
+	}
+	if (!getSampShift(cinfo.comp_info[0].h_samp_factor, shift[0]) ||
+	    !getSampShift(cinfo.comp_info[0].v_samp_factor, shift[1])) {
+		return false;
+	}
+	if (orientation > 1) {
+		if ((cinfo.image_width & ((1U << shift[0]) - 1)) || (cinfo.image_height & ((1U << shift[1]) - 1))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* decode into the planes of a FC_LAYOUT_YCBCR_PLANAR image via raw_data_out:
+ * no upsampling and no color conversion on the CPU */
+static bool decodeRaw(struct jpeg_decompress_struct& cinfo, CImage& img, uint16_t orientation, CScratchArena& arena)
+{
+	const TImageInfo& info = img.getInfo();
+	JSAMPARRAY rows[3];
+	unsigned char *pos[3];
+	ptrdiff_t pixel_offset[3];
+	ptrdiff_t row_offset[3];
+	JDIMENSION compRow[3];
+#if JPEG_LIB_VERSION >= 70
+	int blockRows = cinfo.min_DCT_v_scaled_size;
+	int blockCols = cinfo.min_DCT_h_scaled_size;
+#else
+	int blockRows = DCTSIZE;
+	int blockCols = DCTSIZE;
+#endif
+
+	cinfo.raw_data_out = TRUE;
+	jpeg_start_decompress(&cinfo);
+
+	for (int c=0; c<3; c++) {
+		jpeg_component_info *comp = &cinfo.comp_info[c];
+		size_t w, h;
+		info.getPlaneDims((size_t)c, w, h);
+		if (orientation > 4) {
+			if (w != (size_t)comp->downsampled_height || h != (size_t)comp->downsampled_width) {
+				return false;
+			}
+		} else {
+			if (w != (size_t)comp->downsampled_width || h != (size_t)comp->downsampled_height) {
+				return false;
+			}
+		}
+		int cnt = comp->v_samp_factor * blockRows;
+		size_t rowSize = (size_t)comp->width_in_blocks * (size_t)blockCols;
+		rows[c] = (JSAMPARRAY)arena.allocate(sizeof(JSAMPROW) * (size_t)cnt);
+		unsigned char *buf = (unsigned char*)arena.allocate(rowSize * (size_t)cnt);
+		if (!rows[c] || !buf) {
+			return false;
+		}
+		for (int r=0; r<cnt; r++) {
+			rows[c][r] = buf + (size_t)r * rowSize;
+		}
+		pos[c] = getOrientationMapping(orientation, (unsigned char*)img.getPlane((size_t)c), (ptrdiff_t)w, (ptrdiff_t)h, 1, pixel_offset[c], row_offset[c]);
+		compRow[c] = 0;
+	}
+
+	JDIMENSION lines = (JDIMENSION)(cinfo.max_v_samp_factor * blockRows);
+	while (cinfo.output_scanline < cinfo.output_height) {
+		if (!jpeg_read_raw_data(&cinfo, rows, lines)) {
+			return false;
+		}
+		for (int c=0; c<3; c++) {
+			jpeg_component_info *comp = &cinfo.comp_info[c];
+			int cnt = comp->v_samp_factor * blockRows;
+			ptrdiff_t w = (ptrdiff_t)comp->downsampled_width;
+			for (int r=0; r<cnt && compRow[c] < comp->downsampled_height; r++) {
+				const unsigned char *s = rows[c][r];
+				unsigned char *d = pos[c];
+				ptrdiff_t po = pixel_offset[c];
+				if (po == 1) {
+					memcpy(d, s, (size_t)w);
+				} else {
+					for (ptrdiff_t x=0; x<w; x++) {
+						d[x*po] = s[x];
+					}
+				}
+				pos[c] += row_offset[c];
+				compRow[c]++;
+			}
+		}
+	}
+	return true;
+}
+
+/* decode into an interleaved image created for the oriented output */
+static bool decodeInterleaved(struct jpeg_decompress_struct& cinfo, CImage& img, uint16_t orientation, CScratchArena& arena)
+{
+	const TImageInfo& info = img.getInfo();
+	unsigned char *data = (unsigned char*)img.getData();
+	if (!data) {
+		return false;
+	}
+	size_t offset = (size_t)cinfo.output_width *  (size_t)cinfo.output_components;
+	jpeg_start_decompress(&cinfo);
+	if (orientation <= 1) {
+		while (cinfo.output_scanline < cinfo.output_height) {
+			JSAMPROW line = data + offset * (size_t)cinfo.output_scanline;
+			jpeg_read_scanlines(&cinfo, &line, 1);
+		}
+		return true;
+	}
+	unsigned char *scanline = (unsigned char*)arena.allocate(offset);
+	if (!scanline) {
+		return false;
+	}
+	ptrdiff_t pixel_offset;
+	ptrdiff_t row_offset;
+	ptrdiff_t w = (ptrdiff_t)cinfo.output_width;
+	ptrdiff_t n = (ptrdiff_t)cinfo.output_components;
+	unsigned char *pos = getOrientationMapping(orientation, data, (ptrdiff_t)info.width, (ptrdiff_t)info.height, n, pixel_offset, row_offset);
+	JSAMPROW line = scanline;
+	while (cinfo.output_scanline < cinfo.output_height) {
+		ptrdiff_t x,c;
+		jpeg_read_scanlines(&cinfo, &line, 1);
+		for (x=0; x<w; x++) {
+			for (c=0; c<n; c++) {
+				pos[x*pixel_offset+c] = scanline[x*n+c];
+			}
+		}
+		pos += row_offset;
+	}
+	return true;
+}
+
+/* the largest reduction allowed by ctx: the reduced image must not be
+ * smaller than the full one fitted into the fit box */
+static unsigned int getScaleShift(const TCodecDecodeCtx& ctx, size_t fullWidth, size_t fullHeight)
+{
+	unsigned int shift = (ctx.maxScaleShift < 3) ? ctx.maxScaleShift : 3;
+	while (shift > 0) {
+		if ((ctx.fitWidth << shift) <= fullWidth || (ctx.fitHeight << shift) <= fullHeight) {
+			break;
+		}
+		shift--;
+	}
+	return shift;
+}
+
+/* decode the JPEG thumbnail embedded in the EXIF data, it is only used
+ * if it shows the same area as the full image: some cameras pad it to 4:3 */
+static bool decodeThumbnail(const unsigned char *jpeg, size_t size, CImage& img, uint16_t orientation, size_t fullWidth, size_t fullHeight, CScratchArena& arena)
+{
+#ifdef FC_HAVE_JPEG_MEM_SRC
+	struct jpeg_decompress_struct cinfo;
+	struct fc_error_mgr jerr;
+	bool success = false;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = my_error_exit;
+	jerr.cancelled = false;
+	if (setjmp(jerr.setjmp_buffer)) {
+		debug("libjpeg: EXIF thumbnail not usable");
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char*)jpeg, (unsigned long)size);
+	jpeg_read_header(&cinfo, 1);
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.do_fancy_upsampling = FALSE;
+	jpeg_calc_output_dimensions(&cinfo);
+
+	TImageInfo info;
+	if (orientation > 4) {
+		info.width = (size_t)cinfo.output_height;
+		info.height = (size_t)cinfo.output_width;
+	} else {
+		info.width = (size_t)cinfo.output_width;
+		info.height = (size_t)cinfo.output_height;
+	}
+	info.channels = (size_t)cinfo.output_components;
+	info.bytesPerChannel = 1;
+
+	double thumbAspect = (double)info.width / (double)info.height;
+	double fullAspect = (double)fullWidth / (double)fullHeight;
+	if (info.width < fullWidth && thumbAspect > fullAspect * 0.98 && thumbAspect < fullAspect * 1.02) {
+		if (img.create(info)) {
+			success = decodeInterleaved(cinfo, img, orientation, arena);
+		}
+	}
+	if (success) {
+		jpeg_finish_decompress(&cinfo);
+	}
+	jpeg_destroy_decompress(&cinfo);
+	return success;
+#else
+	(void)jpeg;
+	(void)size;
+	(void)img;
+	(void)orientation;
+	(void)fullWidth;
+	(void)fullHeight;
+	(void)arena;
+	return false;
+#endif
+}
+
+static bool decode(const char *filename, CImage& img, const CCodecSettings& cfg, TCodecDecodeCtx& ctx)
 {
 	(void)cfg;
 	if (!filename) {
 		return false;
 	}
+	CScratchScope scratch;
 	struct jpeg_decompress_struct cinfo;
 	struct fc_error_mgr jerr;
+	struct fc_progress_mgr progress;
 	jpeg_saved_marker_ptr marker;
+	jpeg_saved_marker_ptr exifMarker = NULL;
 	FILE* infile = NULL;
-	unsigned char *scanline = NULL;
 
-	if (filename) {
+#ifdef FC_HAVE_JPEG_MEM_SRC
+	if (!ctx.fileData)
+#endif
+	{
 		infile = util::fopen_wrapper(filename, "rb");
 		if (!infile) {
 			return false;
@@ -72,8 +387,12 @@ static bool decode(const char *filename, CImage& img, const CCodecSettings& cfg)
 
 	cinfo.err = jpeg_std_error(&jerr.pub);
 	jerr.pub.error_exit = my_error_exit;
+	jerr.cancelled = false;
 	if (setjmp(jerr.setjmp_buffer)) {
-		if (success) {
+		if (jerr.cancelled) {
+			debug("libjpeg decode of '%s' cancelled", filename);
+			success = false;
+		} else if (success) {
 			util::warn("libjpeg decode error [ignored]");
 		} else {
 			util::warn("libjpeg decode failed");
@@ -82,15 +401,24 @@ static bool decode(const char *filename, CImage& img, const CCodecSettings& cfg)
 		if (infile) {
 			fclose(infile);
 		}
-		if (scanline) {
-			free(scanline);
-		}
 		return success;
 	}
 	
 	jpeg_create_decompress(&cinfo);
+	if (ctx.cancel) {
+		progress.pub.progress_monitor = my_progress_monitor;
+		progress.cancel = ctx.cancel;
+		cinfo.progress = &progress.pub;
+	}
 	jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xffff); /* EXIF, Thumbnail */
-	jpeg_stdio_src(&cinfo, infile);
+#ifdef FC_HAVE_JPEG_MEM_SRC
+	if (!infile) {
+		jpeg_mem_src(&cinfo, (unsigned char*)ctx.fileData, (unsigned long)ctx.fileSize);
+	} else
+#endif
+	{
+		jpeg_stdio_src(&cinfo, infile);
+	}
   	jpeg_read_header(&cinfo, 1);
 
 	for (marker = cinfo.marker_list; marker; marker = marker->next) {
@@ -102,6 +430,9 @@ static bool decode(const char *filename, CImage& img, const CCodecSettings& cfg)
 					size_t exifSize = (size_t)(marker->data_length);
 					EXIFParse(img.getExif(), exif, exifSize);
 					haveExif = img.getExif().parsed;
+					if (haveExif) {
+						exifMarker = marker;
+					}
 				}
 			}
 		}
@@ -115,111 +446,157 @@ static bool decode(const char *filename, CImage& img, const CCodecSettings& cfg)
 		orientation = 1;
 	}
 
+	if (orientation > 4) {
+		ctx.fullWidth = (size_t)cinfo.image_height;
+		ctx.fullHeight = (size_t)cinfo.image_width;
+	} else {
+		ctx.fullWidth = (size_t)cinfo.image_width;
+		ctx.fullHeight = (size_t)cinfo.image_height;
+	}
+
+	if (ctx.thumbnail && exifMarker && img.getExif().thumbnailSize) {
+		const TExifData& exif = img.getExif();
+		if (decodeThumbnail(exifMarker->data + exif.thumbnailOffset, exif.thumbnailSize, img, orientation, ctx.fullWidth, ctx.fullHeight, scratch.getArena())) {
+			img.getExif().parsed = haveExif;
+			ctx.isThumbnail = true;
+			jpeg_destroy_decompress(&cinfo);
+			if (infile) {
+				fclose(infile);
+			}
+			return true;
+		}
+	}
+
+	/* DCT scaling: the IDCT directly produces the reduced image, which
+	 * is much cheaper than a full decode. Such images are only looked at
+	 * briefly, so use the fast paths as well */
+	ctx.scaleShift = getScaleShift(ctx, ctx.fullWidth, ctx.fullHeight);
+	if (ctx.scaleShift) {
+		cinfo.scale_num = 1;
+		cinfo.scale_denom = 1U << ctx.scaleShift;
+		cinfo.dct_method = JDCT_IFAST;
+		cinfo.do_fancy_upsampling = FALSE;
+	}
+	jpeg_calc_output_dimensions(&cinfo);
+
+	size_t shift[2];
+	bool raw = cfg.planarYCbCr && !ctx.scaleShift && canDecodeRaw(cinfo, orientation, shift);
+
 	TImageInfo info;
 	if (orientation > 4) {
-		info.width = (size_t)cinfo.image_height;
-		info.height = (size_t)cinfo.image_width;
+		info.width = (size_t)cinfo.output_height;
+		info.height = (size_t)cinfo.output_width;
 	} else {
-		info.width = (size_t)cinfo.image_width;
-		info.height = (size_t)cinfo.image_height;
+		info.width = (size_t)cinfo.output_width;
+		info.height = (size_t)cinfo.output_height;
+	}
+	if (raw) {
+		if (orientation > 4) {
+			info.setYCbCrPlanar(shift[1], shift[0]);
+		} else {
+			info.setYCbCrPlanar(shift[0], shift[1]);
+		}
+	} else {
+		info.channels = (size_t)cinfo.output_components;
+		info.bytesPerChannel = 1;
 	}
-	info.channels = (size_t)cinfo.num_components;
-	info.bytesPerChannel = 1;
 
 	if (img.create(info)) {
 		unsigned char *data = (unsigned char*)img.getData();
+		if (data && raw) {
+			success = decodeRaw(cinfo, img, orientation, scratch.getArena());
+		} else if (data) {
+			success = decodeInterleaved(cinfo, img, orientation, scratch.getArena());
+		}
 		if (data) {
-			size_t offset = (size_t)cinfo.image_width *  (size_t)cinfo.num_components;
-			jpeg_start_decompress(&cinfo);
-			if (orientation <= 1) {
-				while (cinfo.output_scanline < cinfo.output_height) {
-					JSAMPROW line = data + offset * (size_t)cinfo.output_scanline;
-					jpeg_read_scanlines(&cinfo, &line, 1);
-				}
-				success = true;
+			img.getExif().parsed = haveExif;
+			if (success) {
+				jpeg_finish_decompress(&cinfo);
 			} else {
-				scanline = (unsigned char*)malloc(offset);
-				if (scanline) {
-					unsigned char *pos;
-					ptrdiff_t pixel_offset;
-					ptrdiff_t row_offset;
-					ptrdiff_t w = (ptrdiff_t)cinfo.image_width;
-					ptrdiff_t n = (ptrdiff_t)cinfo.num_components;
-					switch(orientation) {
-						case 2:
-							row_offset = (ptrdiff_t)info.width * n;
-							pos = data + row_offset- n;
-							pixel_offset = -n;
-							break;
-						case 3:
-							row_offset = (ptrdiff_t)info.width * n;
-							pos = data + (ptrdiff_t)info.height * row_offset - n;
-							row_offset = -row_offset;
-							pixel_offset = -n;
-							break;
-						case 4:
-							row_offset = (ptrdiff_t)info.width * n;
-							pos = data + (ptrdiff_t)(info.height-1) * row_offset;
-							row_offset = -row_offset;
-							pixel_offset = n;
-							break;
-						case 5:
-							pixel_offset = (ptrdiff_t)info.width * n;
-							pos = data + (ptrdiff_t)info.height * pixel_offset - n;
-							row_offset = -n;
-							pixel_offset = -pixel_offset;
-							break;
-						case 6:
-							pixel_offset = (ptrdiff_t)info.width * n;
-							row_offset = -n;
-							pos = data + (ptrdiff_t)(info.width-1) * n;
-							break;
-						case 7:
-							pos = data;
-							pixel_offset = (ptrdiff_t)info.width * n;
-							row_offset = n;
-							break;
-						case 8:
-							pixel_offset = (ptrdiff_t)info.width * n;
-							pos = data + pixel_offset * (ptrdiff_t)(info.height-1);
-							pixel_offset = - pixel_offset;
-							row_offset = n;
-							break;
-						default:
-							pos = data;
-							pixel_offset = n;
-							row_offset = (ptrdiff_t)offset;
-					}
-					JSAMPROW line = scanline;
-					while (cinfo.output_scanline < cinfo.output_height) {
-						ptrdiff_t x,c;
-						jpeg_read_scanlines(&cinfo, &line, 1);
-						for (x=0; x<w; x++) {
-							for (c=0; c<n; c++) {
-								pos[x*pixel_offset+c] = scanline[x*n+c];
-							}
-						}
-						pos += row_offset;
-
-					}
-					free(scanline);
-					scanline = NULL;
-					success = true;
-				}
+				jpeg_abort_decompress(&cinfo);
 			}
-			img.getExif().parsed = haveExif;
-			jpeg_finish_decompress(&cinfo);
 		}
 	}
 	jpeg_destroy_decompress(&cinfo);
-	fclose(infile);
+	if (infile) {
+		fclose(infile);
+	}
 	return success;
 }
 
-static bool encode(const char *filename, const CImage& img, const CCodecSettings& cfg)
+/* can the planes of a planar YCbCr image be written as they are? */
+static bool canEncodeRaw(const TImageInfo& info, TJpegSubsamlpingMode mode)
+{
+	if (info.layout != FC_LAYOUT_YCBCR_PLANAR) {
+		return false;
+	}
+	switch (mode) {
+		case JPEG_SUBSAMPLING_444:
+			return (info.chromaShift[0] == 0 && info.chromaShift[1] == 0);
+		case JPEG_SUBSAMPLING_422:
+			return (info.chromaShift[0] == 1 && info.chromaShift[1] == 0);
+		case JPEG_SUBSAMPLING_420:
+			return (info.chromaShift[0] == 1 && info.chromaShift[1] == 1);
+		default:
+			return false;
+	}
+}
+
+/* feed the planes via raw_data_in: libjpeg wants complete iMCU rows, the
+ * edges are padded by replicating the last column and row */
+static bool encodeRaw(struct jpeg_compress_struct& cinfo, const CImage& img, CScratchArena& arena)
+{
+	const TImageInfo& info = img.getInfo();
+	JSAMPARRAY rows[3];
+	const unsigned char *planes[3];
+	size_t planeW[3], planeH[3], rowSize[3];
+	int cnt[3];
+	size_t mcuCols = (info.width + (size_t)(cinfo.max_h_samp_factor * DCTSIZE) - 1) / (size_t)(cinfo.max_h_samp_factor * DCTSIZE);
+
+	for (int c=0; c<3; c++) {
+		jpeg_component_info *comp = &cinfo.comp_info[c];
+		info.getPlaneDims((size_t)c, planeW[c], planeH[c]);
+		planes[c] = (const unsigned char*)img.getPlane((size_t)c);
+		cnt[c] = comp->v_samp_factor * DCTSIZE;
+		rowSize[c] = mcuCols * (size_t)comp->h_samp_factor * DCTSIZE;
+		rows[c] = (JSAMPARRAY)arena.allocate(sizeof(JSAMPROW) * (size_t)cnt[c]);
+		unsigned char *buf = (unsigned char*)arena.allocate(rowSize[c] * (size_t)cnt[c]);
+		if (!rows[c] || !buf) {
+			return false;
+		}
+		for (int r=0; r<cnt[c]; r++) {
+			rows[c][r] = buf + (size_t)r * rowSize[c];
+		}
+	}
+
+	size_t srcRow[3] = {0, 0, 0};
+	JDIMENSION lines = (JDIMENSION)(cinfo.max_v_samp_factor * DCTSIZE);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		for (int c=0; c<3; c++) {
+			for (int r=0; r<cnt[c]; r++) {
+				size_t y = (srcRow[c] < planeH[c]) ? srcRow[c] : (planeH[c] - 1);
+				unsigned char *d = rows[c][r];
+				memcpy(d, planes[c] + y * planeW[c], planeW[c]);
+				memset(d + planeW[c], d[planeW[c] - 1], rowSize[c] - planeW[c]);
+				srcRow[c]++;
+			}
+		}
+		jpeg_write_raw_data(&cinfo, rows, lines);
+	}
+	return true;
+}
+
+static bool encode(const char *filename, const CImage& srcImg, const CCodecSettings& cfg)
 {
-	/* TODO: subsampling, progressive, etc... */
+	/* TODO: progressive, etc... */
 
+	CScratchScope scratch;
+	CImage rgb;
+	bool raw = canEncodeRaw(srcImg.getInfo(), cfg.jpegSubsamplingMode);
+	if (!raw && !srcImg.convertToInterleaved(rgb)) {
+		return false;
+	}
+	const CImage& img = (raw) ? srcImg : rgb;
 	const TImageInfo& info = img.getInfo();
 	if (!img.hasData()) {
 		return false;
@@ -251,7 +628,7 @@ static bool encode(const char *filename, const CImage& img, const CCodecSettings
 			num_components = 2;
 			break;
 		case 3:
-			in_color_space = JCS_RGB;
+			in_color_space = (raw) ? JCS_YCbCr : JCS_RGB;
 			set_color_space = JCS_YCbCr;
 			num_components = 3;
 			break;
@@ -298,6 +675,7 @@ static bool encode(const char *filename, const CImage& img, const CCodecSettings
 
 	jpeg_set_defaults(&cinfo);
 	jpeg_set_colorspace(&cinfo, set_color_space);
+	cinfo.raw_data_in = (raw) ? TRUE : FALSE;
 	jpeg_set_quality(&cinfo, quality, TRUE);
 	jpeg_simple_progression(&cinfo);
 	cinfo.dct_method = JDCT_ISLOW;
@@ -339,14 +717,22 @@ static bool encode(const char *filename, const CImage& img, const CCodecSettings
 		jpeg_write_marker(&cinfo, JPEG_COM, (unsigned const char*)comment, strlen(comment));
 	}
 	*/
-	size_t stride = info.width * info.channels * info.bytesPerChannel;
-	while (cinfo.next_scanline < cinfo.image_height) {
-		jpeg_write_scanlines(&cinfo, (JSAMPARRAY)&ptr, 1);
-		ptr += stride;
+	bool success = true;
+	if (raw) {
+		success = encodeRaw(cinfo, img, scratch.getArena());
+	} else {
+		size_t stride = info.width * info.channels * info.bytesPerChannel;
+		while (cinfo.next_scanline < cinfo.image_height) {
+			jpeg_write_scanlines(&cinfo, (JSAMPARRAY)&ptr, 1);
+			ptr += stride;
+		}
+	}
+	if (success) {
+		jpeg_finish_compress(&cinfo);
+	} else {
+		jpeg_abort_compress(&cinfo);
 	}
-	jpeg_finish_compress(&cinfo);
 	jpeg_destroy_compress(&cinfo);
-	bool success = true;
 	if (outfile) {
 		if (ferror(outfile)) {
 			success = false;
@@ -1,16 +1,25 @@
 #include "codec_stb_image.h"
+#include "scratch.h"
 
+#define STBI_MALLOC(sz)                   scratchMalloc(sz)
+#define STBI_REALLOC_SIZED(p,oldsz,newsz) scratchRealloc(p,oldsz,newsz)
+#define STBI_FREE(p)                      scratchFree(p)
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_WINDOWS_UTF8
 #include "stb/stb_image.h"
 
+#define STBIW_MALLOC(sz)                   scratchMalloc(sz)
+#define STBIW_REALLOC_SIZED(p,oldsz,newsz) scratchRealloc(p,oldsz,newsz)
+#define STBIW_FREE(p)                      scratchFree(p)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #define STBIW_WINDOWS_UTF8
 #include "stb/stb_image_write.h"
 
 #include "image.h"
+#include "threadpool.h"
 #include "util.h"
 
+#include <stdio.h>
 #include <string.h>
 
 static bool supportsName(const char *filename, const char *ext, const CCodecSettings& cfg)
@@ -45,18 +54,121 @@ static bool supportsName(const char *filename, const char *ext, const CCodecSett
 	return false;
 }
 
-static bool decode(const char *filename, CImage& img, const CCodecSettings& cfg)
+/* stb_image has no way to abort a decode (nor to scale it), but it reads through these
+ * callbacks in small chunks: a cancelled decode sees the end of the file
+ * and fails on the truncated data */
+struct TSTBReader {
+	FILE *file;
+	const CCancelToken *cancel;
+};
+
+static int readCallback(void *user, char *data, int size)
+{
+	TSTBReader *r = (TSTBReader*)user;
+	if (r->cancel && r->cancel->isCancelled()) {
+		return 0;
+	}
+	return (int)fread(data, 1, (size_t)size, r->file);
+}
+
+static void skipCallback(void *user, int n)
+{
+	TSTBReader *r = (TSTBReader*)user;
+	fseek(r->file, n, SEEK_CUR);
+}
+
+static int eofCallback(void *user)
+{
+	TSTBReader *r = (TSTBReader*)user;
+	if (r->cancel && r->cancel->isCancelled()) {
+		return 1;
+	}
+	return feof(r->file) || ferror(r->file);
+}
+
+/* the same for the contents of the file cache */
+struct TSTBMemReader {
+	const unsigned char *data;
+	size_t size;
+	size_t pos;
+	const CCancelToken *cancel;
+};
+
+static int memReadCallback(void *user, char *data, int size)
+{
+	TSTBMemReader *r = (TSTBMemReader*)user;
+	if ((r->cancel && r->cancel->isCancelled()) || size <= 0) {
+		return 0;
+	}
+	size_t n = r->size - r->pos;
+	if (n > (size_t)size) {
+		n = (size_t)size;
+	}
+	memcpy(data, r->data + r->pos, n);
+	r->pos += n;
+	return (int)n;
+}
+
+static void memSkipCallback(void *user, int n)
 {
+	TSTBMemReader *r = (TSTBMemReader*)user;
+	if (n < 0) {
+		r->pos = ((size_t)-n > r->pos) ? 0 : r->pos - (size_t)-n;
+	} else {
+		r->pos = ((size_t)n > r->size - r->pos) ? r->size : r->pos + (size_t)n;
+	}
+}
+
+static int memEofCallback(void *user)
+{
+	TSTBMemReader *r = (TSTBMemReader*)user;
+	if (r->cancel && r->cancel->isCancelled()) {
+		return 1;
+	}
+	return r->pos >= r->size;
+}
+
+static bool decode(const char *filename, CImage& img, const CCodecSettings& cfg, TCodecDecodeCtx& ctx)
+{
+	const CCancelToken *cancel = ctx.cancel;
 	(void)cfg;
 	if (!filename) {
 		return false;
 	}
+	CScratchScope scratch;
 	int w=0, h=0, c=0;
-	unsigned char *data = stbi_load(filename, &w, &h, &c, 0);
+	unsigned char *data = NULL;
+	if (ctx.fileData) {
+		TSTBMemReader reader;
+		reader.data = ctx.fileData;
+		reader.size = ctx.fileSize;
+		reader.pos = 0;
+		reader.cancel = cancel;
+		const stbi_io_callbacks callbacks = {memReadCallback, memSkipCallback, memEofCallback};
+		data = stbi_load_from_callbacks(&callbacks, &reader, &w, &h, &c, 0);
+	} else {
+		TSTBReader reader;
+		reader.file = util::fopen_wrapper(filename, "rb");
+		reader.cancel = cancel;
+		if (!reader.file) {
+			return false;
+		}
+		const stbi_io_callbacks callbacks = {readCallback, skipCallback, eofCallback};
+		data = stbi_load_from_callbacks(&callbacks, &reader, &w, &h, &c, 0);
+		fclose(reader.file);
+	}
+	if (data && cancel && cancel->isCancelled()) {
+		/* whatever was decoded after the cancellation is garbage */
+		STBI_FREE(data);
+		data = NULL;
+	}
 	if (!data) {
 		return false;
 	}
-	if (img.adopt(TImageInfo((size_t)w,(size_t)h,(size_t)c,1), data)) {
+	TImageInfo info((size_t)w,(size_t)h,(size_t)c,1);
+	/* small results may live in the scratch arena */
+	data = (unsigned char*)scratchDetach(data, info.getDataSize());
+	if (img.adopt(info, data)) {
 		data = NULL;
 	}
 	if (data) {
@@ -91,7 +203,7 @@ static bool supportsNameEncode(const char *filename, const char *ext, const CCod
 	return false;
 }
 
-static bool encode(const char *filename, const CImage& img, const CCodecSettings& cfg)
+static bool encode(const char *filename, const CImage& srcImg, const CCodecSettings& cfg)
 {
 	const char *ext = (cfg.forceExt)? cfg.forceExt : (util::getExt(filename));
 	if (!ext) {
@@ -100,7 +212,8 @@ static bool encode(const char *filename, const CImage& img, const CCodecSettings
 	if (!ext || !ext[0]) {
 		return false;
 	}
-	if (!img.hasData()) {
+	CImage img;
+	if (!srcImg.convertToInterleaved(img)) {
 		return false;
 	}
 	const TImageInfo& info = img.getInfo();
@@ -108,6 +221,7 @@ static bool encode(const char *filename, const CImage& img, const CCodecSettings
 		return false;
 	}
 
+	CScratchScope scratch;
 	bool success;
 	const void *data = img.getData();
 
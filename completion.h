@@ -0,0 +1,95 @@
+#ifndef FASTCROP_COMPLETION_H
+#define FASTCROP_COMPLETION_H
+
+#include <atomic>
+#include <new>
+#include <utility>
+
+/* Lock-free queue handing results from worker threads to a single
+ * consumer. Producers push onto an atomic stack with compare-and-swap, so
+ * they never wait for each other or for the consumer. The consumer takes
+ * over the whole stack with a single exchange and reverses it, so the
+ * items come out in the order they were pushed.
+ * push() may be called from any thread, pop(), isEmpty() and clear() only
+ * from the consumer thread. T must be default constructible and movable
+ * without exceptions. */
+
+template <class T> class CCompletionQueue {
+	private:
+		struct TNode {
+			T value;
+			TNode *next;
+		};
+
+		std::atomic<TNode*> head;	/* pushed, newest first */
+		TNode *pending;			/* taken over by the consumer, oldest first */
+
+		void takeOver() noexcept
+		{
+			TNode *n = head.exchange(NULL, std::memory_order_acquire);
+			while (n) {
+				TNode *next = n->next;
+				n->next = pending;
+				pending = n;
+				n = next;
+			}
+		}
+
+	public:
+		CCompletionQueue() noexcept :
+			head(NULL),
+			pending(NULL)
+		{}
+
+		~CCompletionQueue() noexcept
+		{
+			clear();
+		}
+
+		CCompletionQueue(const CCompletionQueue& other) = delete;
+		CCompletionQueue(CCompletionQueue&& other) = delete;
+		CCompletionQueue& operator=(const CCompletionQueue& other) = delete;
+		CCompletionQueue& operator=(CCompletionQueue&& other) = delete;
+
+		bool push(T&& value) noexcept
+		{
+			TNode *n = new(std::nothrow) TNode;
+			if (!n) {
+				return false;
+			}
+			n->value = std::move(value);
+			n->next = head.load(std::memory_order_relaxed);
+			while (!head.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed)) {
+			}
+			return true;
+		}
+
+		bool pop(T& value) noexcept
+		{
+			if (!pending) {
+				takeOver();
+				if (!pending) {
+					return false;
+				}
+			}
+			TNode *n = pending;
+			pending = n->next;
+			value = std::move(n->value);
+			delete n;
+			return true;
+		}
+
+		bool isEmpty() const noexcept
+		{
+			return !pending && !head.load(std::memory_order_acquire);
+		}
+
+		void clear() noexcept
+		{
+			T value;
+			while (pop(value)) {
+			}
+		}
+};
+
+#endif /* !FASTCROP_COMPLETION_H */
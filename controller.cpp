@@ -1,15 +1,72 @@
 #include "controller.h"
 
 #include "codec.h"
+#include "gltimer.h"
+#include "glworker.h"
+#include "prefetch.h"
+#include "scratch.h"
 #include "util.h"
 
+#include <GLFW/glfw3.h>
+
+#include <string.h>
+
 #include <ctgmath>
+#include <utility>
+
+/* size of the persistently mapped texture upload buffer */
+static const size_t glUploadRingSize = 64U * 1024U * 1024U;
+
+/* images on each side of the current one which are kept loaded, so their
+ * GL images can be uploaded in the background */
+static const size_t neighbourCount = 1;
+
+/* the tier of an image the codec delivered, it may not support the
+ * reduction which was asked for */
+static TFCDecodeTier getResultTier(const TCodecDecodeCtx& ctx)
+{
+	if (ctx.isThumbnail) {
+		return FC_DECODE_THUMB;
+	}
+	if (!ctx.scaleShift) {
+		return FC_DECODE_FULL;
+	}
+	return (ctx.fitWidth || ctx.fitHeight) ? FC_DECODE_PREVIEW : FC_DECODE_SKIM;
+}
+
+static const char *getTierName(TFCDecodeTier tier)
+{
+	switch (tier) {
+		case FC_DECODE_THUMB:
+			return "thumb";
+		case FC_DECODE_SKIM:
+			return "skim";
+		case FC_DECODE_PREVIEW:
+			return "preview";
+		case FC_DECODE_FULL:
+			return "full";
+		default:
+			return "unknown";
+	}
+}
 
 CController::CController(CCodecs& c, const CCodecSettings& ds, const CCodecSettings& es) :
 	codecs(c),
 	decodeSettings(ds),
 	encodeSettings(es),
+	glMaxSize(0),
+	uploadWorker(NULL),
+	timers(NULL),
+	prefetcher(NULL),
+	pool(NULL),
+	nextProxyTicket(1),
+	proxyResultLost(false),
+	lastDisplayed(NULL),
+	skimming(false),
 	currentEntity(0),
+	windowFirst(0),
+	windowLast(0),
+	windowDirty(true),
 	inDragCrop(0)
 {
 	// TODO: only for testing
@@ -20,50 +77,618 @@ CController::CController(CCodecs& c, const CCodecSettings& ds, const CCodecSetti
 
 CController::~CController()
 {
+	setPrefetchManager(NULL);
+	setThreadPool(NULL);
 	dropGL();
 }
 
+/* The coarsest power of two reduction of the image which still has at
+ * least as many pixels as the image covers in the window. Proxies which
+ * would exceed the texture size limit are not used: the full resolution
+ * image is tiled anyway, and only the visible tiles are resident. */
+unsigned int CController::getDisplayLevel(const CImageEntity& e) const
+{
+	if (!(e.flags & FLAG_ENTITY_IMAGE)) {
+		return 0;
+	}
+	const TImageInfo& info = e.image.getInfo();
+	double s[2], o[2];
+	getDisplayTransform(e, s, o, false);
+	double onScreen[2];
+	onScreen[0] = s[0] * (double)windowState.dims[0];
+	onScreen[1] = s[1] * (double)windowState.dims[1];
+
+	unsigned int level = 0;
+	while (level < 16) {
+		size_t w = info.width >> (level + 1);
+		size_t h = info.height >> (level + 1);
+		if (!w || !h || (double)w < onScreen[0] || (double)h < onScreen[1]) {
+			break;
+		}
+		level++;
+	}
+	if (level && glMaxSize > 0 &&
+	    ((info.width >> level) > (size_t)glMaxSize || (info.height >> level) > (size_t)glMaxSize)) {
+		level = 0;
+	}
+	return level;
+}
+
+/* the tier the current image should have: the full resolution only if
+ * it is zoomed beyond the preview */
+TFCDecodeTier CController::getWantedTier(const CImageEntity& e) const
+{
+	if (skimming) {
+		return FC_DECODE_SKIM;
+	}
+	if ((e.flags & FLAG_ENTITY_IMAGE) && e.imageTier >= FC_DECODE_PREVIEW) {
+		const TImageInfo& info = e.image.getInfo();
+		double s[2], o[2];
+		getDisplayTransform(e, s, o, false);
+		if (s[0] * (double)windowState.dims[0] > (double)info.width ||
+		    s[1] * (double)windowState.dims[1] > (double)info.height) {
+			return FC_DECODE_FULL;
+		}
+	}
+	return FC_DECODE_PREVIEW;
+}
+
 bool CController::uploadGLImage(CImageEntity& e)
 {
-	bool success;
-	if (e.flags & FLAG_ENTITY_GLIMAGE) {
-		success = true;
+	unsigned int level = getDisplayLevel(e);
+	if (e.glUploadTicket) {
+		/* already on its way */
+		if (level >= e.glUploadLevel && level <= e.glUploadLevel + 1) {
+			return true;
+		}
+		cancelGLImageUpload(e);
+	}
+	if ((e.flags & FLAG_ENTITY_GLIMAGE) && !(e.flags & FLAG_ENTITY_GLIMAGE_STALE)) {
+		/* more detail is needed now, or much less (saves memory) */
+		if (level >= e.glImageLevel && level <= e.glImageLevel + 1) {
+			return true;
+		}
+	}
+
+	const CImage *img = &e.image;
+	if (level) {
+		const TImageInfo& info = e.image.getInfo();
+		size_t w = info.width >> level;
+		size_t h = info.height >> level;
+		const TImageInfo& pinfo = e.proxy.getInfo();
+		if (!e.proxy.hasData() || pinfo.width != w || pinfo.height != h) {
+			if (pool) {
+				/* the old GL image stays until the proxy arrives */
+				return requestProxy(e, level);
+			}
+			if (!e.image.resizeTo(e.proxy, cfg.resizeCtx, w, h)) {
+				util::warn("failed to create %ux%u display proxy", (unsigned)w, (unsigned)h);
+				return false;
+			}
+			debug("display proxy %ux%u (1/%u)", (unsigned)w, (unsigned)h, 1U<<level);
+		}
+		img = &e.proxy;
 	} else {
-		success = e.glImage.create(e.image);
-		if (success) {
-			e.flags |= FLAG_ENTITY_GLIMAGE;
+		cancelProxy(e);
+		e.proxy.reset();
+	}
+
+	/* tiled images are uploaded piecewise on this thread anyway */
+	const TImageInfo& info = img->getInfo();
+	if (uploadWorker && (glMaxSize < 1 || (info.width <= (size_t)glMaxSize && info.height <= (size_t)glMaxSize))) {
+		e.glUploadTicket = uploadWorker->submit(*img, glMaxSize, &e);
+		if (e.glUploadTicket) {
+			e.glUploadLevel = level;
+			return true;
 		}
 	}
+
+	retireGLImage(e);
+	bool success = e.glImage.create(*img, glMaxSize, &uploadRing);
+	if (success) {
+		e.flags |= FLAG_ENTITY_GLIMAGE | FLAG_ENTITY_GLIMAGE_PENDING;
+		e.glImageLevel = level;
+	}
 	return success;
 }
 
+bool CController::requestProxy(CImageEntity& e, unsigned int level)
+{
+	if (e.proxyTicket) {
+		if (e.proxyLevel == level) {
+			return true;
+		}
+		cancelProxy(e);
+	}
+	if (!e.proxyToken.reset()) {
+		return false;
+	}
+
+	const TImageInfo& info = e.image.getInfo();
+	size_t w = info.width >> level;
+	size_t h = info.height >> level;
+	unsigned int ticket = nextProxyTicket++;
+	if (!nextProxyTicket) {
+		nextProxyTicket = 1;
+	}
+	TFCTaskPriority prio = (&e == &getCurrentInternal()) ? FC_TASK_INTERACTIVE : FC_TASK_PREFETCH;
+	CImageEntity *entity = &e;
+	CImage src(e.image); /* shares the pixel data */
+	TImageResizeCtx ctx = cfg.resizeCtx;
+	CCompletionQueue<TProxyResult> *results = &proxyResults;
+	std::atomic<bool> *lost = &proxyResultLost;
+	bool queued = false;
+	try {
+		queued = pool->submit(prio, [entity, ticket, src, ctx, w, h, results, lost](const CCancelToken&) {
+			TProxyResult r;
+			r.entity = entity;
+			r.ticket = ticket;
+			r.success = src.resizeTo(r.proxy, ctx, w, h);
+			if (!results->push(std::move(r))) {
+				/* the owner has to request it again */
+				lost->store(true);
+			}
+			glfwPostEmptyEvent();
+		}, e.proxyToken);
+	} catch (...) {
+		queued = false;
+	}
+	if (!queued) {
+		util::warn("failed to queue %ux%u display proxy", (unsigned)w, (unsigned)h);
+		return false;
+	}
+	e.proxyTicket = ticket;
+	e.proxyLevel = level;
+	return true;
+}
+
+void CController::cancelProxy(CImageEntity& e)
+{
+	if (e.proxyTicket) {
+		e.proxyToken.cancel();
+		e.proxyTicket = 0;
+	}
+}
+
+/* take over the proxies the thread pool created, their GL images are
+ * created by the next uploadGLImage() */
+void CController::collectProxies()
+{
+	TProxyResult r;
+	if (proxyResultLost.exchange(false)) {
+		/* which one is unknown: give up all pending proxies, the next
+		 * uploadGLImage() requests the ones still needed again */
+		util::warn("lost a display proxy, requesting them again");
+		for (size_t i = 0; i < entities.getSlotCount(); i++) {
+			cancelProxy(entities.getSlot(i));
+		}
+	}
+	while (proxyResults.pop(r)) {
+		CImageEntity *e = r.entity;
+		if (!e || e->proxyTicket != r.ticket) {
+			continue;
+		}
+		e->proxyTicket = 0;
+		if (r.success) {
+			e->proxy = std::move(r.proxy);
+			debug("display proxy %ux%u (1/%u)", (unsigned)e->proxy.getInfo().width, (unsigned)e->proxy.getInfo().height,
+				1U<<e->proxyLevel);
+		} else {
+			util::warn("failed to create display proxy for '%s'", getFilename(*e));
+		}
+	}
+}
+
+/* make room for a new GL image: the old one is drawn until the new one is
+ * uploaded, unless it is incomplete itself and an older one is still there */
+void CController::retireGLImage(CImageEntity& e)
+{
+	if (!(e.flags & FLAG_ENTITY_GLIMAGE)) {
+		return;
+	}
+	if ((e.flags & FLAG_ENTITY_GLIMAGE_PENDING) && (e.flags & FLAG_ENTITY_GLIMAGE_PREV)) {
+		e.glImage.drop();
+	} else {
+		e.glImagePrev = std::move(e.glImage);
+		e.flags |= FLAG_ENTITY_GLIMAGE_PREV;
+	}
+	e.flags &= ~ (FLAG_ENTITY_GLIMAGE | FLAG_ENTITY_GLIMAGE_PENDING | FLAG_ENTITY_GLIMAGE_STALE);
+}
+
 void CController::dropGLImage(CImageEntity& e)
 {
 	if (e.flags & FLAG_ENTITY_GLIMAGE) {
 		e.glImage.drop();
-		e.flags &= ~ FLAG_ENTITY_GLIMAGE;
+		e.flags &= ~ (FLAG_ENTITY_GLIMAGE | FLAG_ENTITY_GLIMAGE_PENDING | FLAG_ENTITY_GLIMAGE_STALE);
+	}
+	if (e.flags & FLAG_ENTITY_GLIMAGE_PREV) {
+		e.glImagePrev.drop();
+		e.flags &= ~FLAG_ENTITY_GLIMAGE_PREV;
 	}
 }
 
-bool CController::prepareImageEntity(CImageEntity& e)
+/* tiled images: only the tiles inside the window need to be resident */
+void CController::updateGLImageResidency(CImageEntity& e)
 {
-	if (!(e.flags & FLAG_ENTITY_IMAGE)) {
-		if (codecs.decode(e.filename.c_str(), e.image, decodeSettings)) {
-			//e.image.transpose(true); // XXX
-			e.flags |= FLAG_ENTITY_IMAGE;
+	if (!(e.flags & FLAG_ENTITY_GLIMAGE)) {
+		return;
+	}
+	double s[2], o[2];
+	double w = (double)e.glImage.getWidth();
+	double h = (double)e.glImage.getHeight();
+	getDisplayTransform(e, s, o, false);
+	/* the normalized window coordinates 0 and 1 in the image,
+	 * image rows go top to bottom */
+	double region[4];
+	region[0] = ((0.0 - o[0]) / s[0]) * w;
+	region[2] = ((1.0 - o[0]) / s[0]) * w;
+	region[1] = (1.0 - (1.0 - o[1]) / s[1]) * h;
+	region[3] = (1.0 - (0.0 - o[1]) / s[1]) * h;
+	e.glImage.updateResidency(region);
+	/* tiles which became visible need their data */
+	if (e.glImage.isUploadPending()) {
+		e.flags |= FLAG_ENTITY_GLIMAGE_PENDING;
+	}
+}
+
+void CController::continueGLImageUpload(CImageEntity& e, TGLUploadBudget& budget)
+{
+	if (e.flags & FLAG_ENTITY_GLIMAGE_PENDING) {
+		if (timers) {
+			timers->begin(GL_TIMER_UPLOAD);
 		}
+		e.glImage.upload(budget);
+		if (timers) {
+			timers->end(GL_TIMER_UPLOAD);
+		}
+		/* stays pending until the fences signaled, so that we
+		 * draw another frame when the tiles are ready */
+		if (!e.glImage.isUploadPending()) {
+			e.flags &= ~FLAG_ENTITY_GLIMAGE_PENDING;
+		}
+	}
+	if ((e.flags & FLAG_ENTITY_GLIMAGE_PREV) && (e.flags & FLAG_ENTITY_GLIMAGE) && !(e.flags & FLAG_ENTITY_GLIMAGE_PENDING)) {
+		/* the new GL image can be drawn now */
+		e.glImagePrev.drop();
+		e.flags &= ~FLAG_ENTITY_GLIMAGE_PREV;
 	}
-	return uploadGLImage(e);
 }
 
-bool CController::initGL()
+void CController::cancelGLImageUpload(CImageEntity& e)
 {
+	if (e.glUploadTicket) {
+		if (uploadWorker) {
+			uploadWorker->cancel(e.glUploadTicket);
+		}
+		e.glUploadTicket = 0;
+	}
+}
+
+/* take over the GL images the upload worker finished */
+void CController::collectGLImages()
+{
+	TGLWorkerResult r;
+	while (uploadWorker && uploadWorker->fetch(r)) {
+		CImageEntity *e = (CImageEntity*)r.user;
+		if (!e || e->glUploadTicket != r.ticket) {
+			/* outdated */
+			r.glImage.drop();
+			continue;
+		}
+		e->glUploadTicket = 0;
+		if (!r.success) {
+			util::warn("failed to create GL image for '%s'", getFilename(*e));
+			continue;
+		}
+		retireGLImage(*e);
+		e->glImage = std::move(r.glImage);
+		e->glImage.setUploadRing(&uploadRing);
+		e->glImageLevel = e->glUploadLevel;
+		e->flags |= FLAG_ENTITY_GLIMAGE;
+		if (e->glImage.isUploadPending()) {
+			e->flags |= FLAG_ENTITY_GLIMAGE_PENDING;
+		}
+	}
+}
+
+/* what the decoder is asked for to get a tier */
+void CController::getDecodeRequest(TFCDecodeTier tier, TCodecDecodeCtx& ctx) const
+{
+	ctx = TCodecDecodeCtx();
+	switch (tier) {
+		case FC_DECODE_THUMB:
+			/* the 1/8 image if there is no thumbnail */
+			ctx.thumbnail = true;
+			ctx.maxScaleShift = 3;
+			break;
+		case FC_DECODE_SKIM:
+			ctx.maxScaleShift = 3;
+			break;
+		case FC_DECODE_PREVIEW:
+			ctx.maxScaleShift = 3;
+			ctx.fitWidth = (size_t)windowState.dims[0];
+			ctx.fitHeight = (size_t)windowState.dims[1];
+			break;
+		default:
+			(void)0;
+	}
+}
+
+void CController::requestDecode(CImageEntity& e, TFCTaskPriority priority, TFCDecodeTier tier)
+{
+	if (!prefetcher || (entities.getFlags(e.index) & FLAG_ENTITY_FAILED)) {
+		return;
+	}
+	restoreCachedImage(e);
+	if ((e.flags & FLAG_ENTITY_IMAGE) && e.imageTier >= tier) {
+		return;
+	}
+	/* if it is already queued, this just updates the priority and tier */
+	TCodecDecodeCtx request;
+	getDecodeRequest(tier, request);
+	unsigned int ticket = prefetcher->submit(getFilename(e), priority, request, &e);
+	if (ticket) {
+		if (!(e.flags & (FLAG_ENTITY_IMAGE | FLAG_ENTITY_IMAGE_PENDING))) {
+			/* not when the request is only updated or refined */
+			imageCache.noteMiss();
+		}
+		e.decodeTicket = ticket;
+		e.flags |= FLAG_ENTITY_IMAGE_PENDING;
+	}
+}
+
+void CController::cancelDecode(CImageEntity& e)
+{
+	if (e.decodeTicket) {
+		if (prefetcher) {
+			prefetcher->cancel(e.decodeTicket);
+		}
+		e.decodeTicket = 0;
+	}
+	e.flags &= ~FLAG_ENTITY_IMAGE_PENDING;
+}
+
+/* load the image from the cache if it was decoded before */
+bool CController::restoreCachedImage(CImageEntity& e)
+{
+	if (e.flags & FLAG_ENTITY_IMAGE) {
+		return true;
+	}
+	if ((e.flags & FLAG_ENTITY_IMAGE_PENDING) || (entities.getFlags(e.index) & FLAG_ENTITY_FAILED)) {
+		/* the cache was checked when the decode was requested */
+		return false;
+	}
+	unsigned int tier;
+	if (!imageCache.take(getFilename(e), e.image, tier, e.fullInfo)) {
+		return false;
+	}
+	e.imageTier = (TFCDecodeTier)tier;
+	e.flags |= FLAG_ENTITY_IMAGE;
+	return true;
+}
+
+/* take over a decoded image, which may replace a coarser one */
+void CController::setImage(CImageEntity& e, CImage& img, TFCDecodeTier tier, const TCodecDecodeCtx& ctx)
+{
+	if (e.flags & FLAG_ENTITY_IMAGE) {
+		/* the proxy and the GL image belong to the coarse image,
+		 * the latter is shown until its replacement is ready */
+		cancelProxy(e);
+		e.proxy.reset();
+		cancelGLImageUpload(e);
+		if (e.flags & FLAG_ENTITY_GLIMAGE) {
+			e.flags |= FLAG_ENTITY_GLIMAGE_STALE;
+		}
+	}
+	e.image = std::move(img);
+	e.imageTier = tier;
+	e.fullInfo = e.image.getInfo();
+	if (ctx.fullWidth && ctx.fullHeight) {
+		e.fullInfo.width = ctx.fullWidth;
+		e.fullInfo.height = ctx.fullHeight;
+	}
+	e.flags |= FLAG_ENTITY_IMAGE;
+	prefetchStats.decoded[tier]++;
+}
+
+void CController::applyDecodeResult(CImageEntity& e, TPrefetchResult& r)
+{
+	e.decodeTicket = 0;
+	e.flags &= ~FLAG_ENTITY_IMAGE_PENDING;
+	if (r.success) {
+		TFCDecodeTier tier = getResultTier(r.ctx);
+		if ((e.flags & FLAG_ENTITY_IMAGE) && tier <= e.imageTier) {
+			debug("dropped the %s image of '%s', already have %s", getTierName(tier), getFilename(e), getTierName(e.imageTier));
+			return;
+		}
+		setImage(e, r.image, tier, r.ctx);
+		if (tier < FC_DECODE_PREVIEW) {
+			/* the user might have stopped meanwhile */
+			windowDirty = true;
+		}
+	} else {
+		/* a coarse image is kept */
+		util::warn("failed to decode '%s'", getFilename(e));
+		entities.getFlags(e.index) |= FLAG_ENTITY_FAILED;
+	}
+}
+
+/* take over the images the prefetch manager decoded */
+void CController::collectDecodedImages()
+{
+	TPrefetchResult r;
+	while (prefetcher && prefetcher->fetch(r)) {
+		CImageEntity *e = (CImageEntity*)r.user;
+		if (e && e->decodeTicket == r.ticket) {
+			applyDecodeResult(*e, r);
+		}
+	}
+}
+
+/* make sure the full image is decoded, decodes it on this thread if it
+ * is not */
+bool CController::decodeImage(CImageEntity& e)
+{
+	bool full = (e.flags & FLAG_ENTITY_IMAGE) && e.imageTier == FC_DECODE_FULL;
+	if (full || (entities.getFlags(e.index) & FLAG_ENTITY_FAILED)) {
+		return full;
+	}
+	/* a pending decode counted its miss already */
+	bool pending = (e.flags & FLAG_ENTITY_IMAGE_PENDING);
+	cancelDecode(e);
+	if (restoreCachedImage(e) && e.imageTier == FC_DECODE_FULL) {
+		return true;
+	}
+	if (!pending && !(e.flags & FLAG_ENTITY_IMAGE)) {
+		imageCache.noteMiss();
+	}
+	CImage img;
+	TCodecDecodeCtx ctx;
+	if (codecs.decode(getFilename(e), img, decodeSettings, &ctx)) {
+		//img.transpose(true); // XXX
+		setImage(e, img, FC_DECODE_FULL, ctx);
+		return true;
+	}
+	util::warn("failed to decode '%s'", getFilename(e));
+	entities.getFlags(e.index) |= FLAG_ENTITY_FAILED;
+	return false;
+}
+
+/* decode the images around the current one in the background, nearest
+ * first, and unload the ones which are not in that window any more */
+void CController::updatePrefetch()
+{
+	size_t cnt = entities.size();
+	windowDirty = false;
+	if (cnt < 1) {
+		return;
+	}
+
+	/* while skimming, far ahead but coarse */
+	double now = util::getTime();
+	bool wasSkimming = skimming;
+	skimming = nav.isSkimming(now);
+	TFCDecodeTier tier = (skimming) ? FC_DECODE_THUMB : FC_DECODE_PREVIEW;
+	size_t baseAhead = (cfg.prefetchAhead > neighbourCount) ? cfg.prefetchAhead : neighbourCount;
+	size_t baseBehind = (cfg.prefetchBehind > neighbourCount) ? cfg.prefetchBehind : neighbourCount;
+	size_t ahead, behind;
+	nav.getWindow(now, baseAhead, baseBehind, ahead, behind);
+	if (skimming != wasSkimming) {
+		debug("navigation: %s, window %u ahead, %u behind, dwell %.0fms", (skimming) ? "skimming" : "stopped",
+			(unsigned)ahead, (unsigned)behind, 1000.0 * nav.getAverageDwell());
+	}
+	size_t first = (currentEntity > behind) ? currentEntity - behind : 0;
+	size_t last = currentEntity + ahead;
+	if (last >= cnt) {
+		last = cnt - 1;
+	}
+
+	releaseEntities(first, last);
+	windowFirst = first;
+	windowLast = last;
+
+	/* the pool runs the tasks of a class in order: nearest first,
+	 * the next image before the previous one (in the direction of
+	 * travel, see getWindow()) */
+	for (size_t d = 1; currentEntity + d <= last || currentEntity >= first + d; d++) {
+		CImageEntity *e;
+		if (currentEntity + d <= last && (e = entities.acquire(currentEntity + d))) {
+			requestDecode(*e, FC_TASK_PREFETCH, tier);
+		}
+		if (currentEntity >= first + d && (e = entities.acquire(currentEntity - d))) {
+			requestDecode(*e, FC_TASK_PREFETCH, tier);
+		}
+	}
+}
+
+/* unload the entities outside of first...last, and hand them back to the
+ * table, this also aborts their decodes which are already running */
+void CController::releaseEntities(size_t first, size_t last)
+{
+	size_t cnt = entities.size();
+	unsigned int cancelled = 0;
+	for (size_t i = 0; i < entities.getSlotCount(); i++) {
+		CImageEntity& e = entities.getSlot(i);
+		if (e.index >= cnt || (e.index >= first && e.index <= last)) {
+			/* free or still in the window */
+			continue;
+		}
+		if (e.decodeTicket || e.proxyTicket) {
+			cancelled++;
+		}
+		unloadEntity(e);
+		if (lastDisplayed == &e) {
+			lastDisplayed = NULL;
+		}
+		entities.release(e);
+	}
+	if (cancelled) {
+		debug("prefetch: cancelled the work for %u images", cancelled);
+	}
+}
+
+bool CController::prepareImageEntity(CImageEntity& e, TGLUploadBudget& budget)
+{
+	if (!restoreCachedImage(e)) {
+		if (prefetcher) {
+			/* never decode on the render thread, the image comes
+			 * with one of the next frames, cheapest first */
+			if (!(entities.getFlags(e.index) & FLAG_ENTITY_FAILED)) {
+				requestDecode(e, FC_TASK_INTERACTIVE, FC_DECODE_THUMB);
+			}
+			return false;
+		}
+		if (!decodeImage(e)) {
+			return false;
+		}
+	} else if (e.imageTier < getWantedTier(e)) {
+		/* one tier at a time, the coarse image is shown until the
+		 * refinement arrives */
+		requestDecode(e, FC_TASK_INTERACTIVE, (TFCDecodeTier)(e.imageTier + 1));
+	}
+	bool success = uploadGLImage(e);
+	updateGLImageResidency(e);
+	continueGLImageUpload(e, budget);
+	return success;
+}
+
+void CController::unloadEntity(CImageEntity& e)
+{
+	if (e.decodeTicket) {
+		prefetchStats.cancelled++;
+	}
+	if ((e.flags & FLAG_ENTITY_IMAGE) && !(e.flags & FLAG_ENTITY_SHOWN)) {
+		prefetchStats.wasted[e.imageTier]++;
+	}
+	e.flags &= ~FLAG_ENTITY_SHOWN;
+	cancelDecode(e);
+	cancelProxy(e);
+	cancelGLImageUpload(e);
+	dropGLImage(e);
+	if (e.flags & FLAG_ENTITY_IMAGE) {
+		/* the budget may have been changed via the config */
+		imageCache.setBudget(cfg.imageCacheSize);
+		if (!imageCache.insert(getFilename(e), e.image, (unsigned int)e.imageTier, e.fullInfo)) {
+			e.image.reset();
+		}
+		e.proxy.reset();
+		e.flags &= ~FLAG_ENTITY_IMAGE;
+	}
+}
+
+bool CController::initGL(GLint maxSize)
+{
+	glMaxSize = maxSize;
+	uploadRing.initGL(glUploadRingSize);
 	dummy.image.makeChecker(TImageInfo(16,16,1));
+	dummy.fullInfo = dummy.image.getInfo();
 	dummy.flags |= FLAG_ENTITY_IMAGE;
 
 	bool success = uploadGLImage(dummy);
 
 	if (success) {
+		TGLUploadBudget unlimited;
+		continueGLImageUpload(dummy, unlimited);
 		glBindTexture(GL_TEXTURE_2D, dummy.glImage.getTex());
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -75,12 +700,39 @@ bool CController::initGL()
 
 void CController::dropGL()
 {
-	for(size_t i=0; i<entities.size(); i++) {
-		if (entities[i]) {
-			dropGLImage(*entities[i]);
-		}
+	for(size_t i=0; i<entities.getSlotCount(); i++) {
+		cancelGLImageUpload(entities.getSlot(i));
+		dropGLImage(entities.getSlot(i));
 	}
 	dropGLImage(dummy);
+	uploadRing.dropGL();
+}
+
+void CController::setUploadWorker(CGLUploadWorker *worker)
+{
+	for(size_t i=0; i<entities.getSlotCount(); i++) {
+		cancelGLImageUpload(entities.getSlot(i));
+	}
+	uploadWorker = worker;
+}
+
+void CController::setPrefetchManager(CPrefetchManager *manager)
+{
+	for(size_t i=0; i<entities.getSlotCount(); i++) {
+		cancelDecode(entities.getSlot(i));
+	}
+	prefetcher = manager;
+	windowDirty = true;
+}
+
+void CController::setThreadPool(CThreadPool *threadPool)
+{
+	for(size_t i=0; i<entities.getSlotCount(); i++) {
+		cancelProxy(entities.getSlot(i));
+	}
+	proxyResults.clear();
+	pool = threadPool;
+	imageCache.setThreadPool(threadPool);
 }
 
 void CController::setWindowSize(int w, int h) noexcept
@@ -96,33 +748,139 @@ const TWindowState& CController::getWindowState() const noexcept
 
 CImageEntity& CController::getCurrentInternal()
 {
-	CImageEntity *e = NULL;
-	if (currentEntity < entities.size()) {
-		e = entities[currentEntity];
-	}
+	CImageEntity *e = entities.acquire(currentEntity);
 	if (!e) {
 		e = &dummy;
 	}
 	return *e;
 }
 
-const CImageEntity& CController::getCurrent()
+const CImageEntity& CController::getCurrent(TGLUploadBudget& budget)
 {
+	collectGLImages();
+	collectDecodedImages();
+	collectProxies();
+	if (skimming && !nav.isSkimming(util::getTime())) {
+		/* the user stopped: refine the images around the current one */
+		windowDirty = true;
+	}
+	/* before the current image, so the neighbours are decoded in
+	 * parallel if that still has to be decoded */
+	if (windowDirty) {
+		updatePrefetch();
+	}
 	CImageEntity& e = getCurrentInternal();
-	prepareImageEntity(e);
-	return e;
+	e.flags |= FLAG_ENTITY_SHOWN;
+	prepareImageEntity(e, budget);
+	if (e.flags & (FLAG_ENTITY_GLIMAGE | FLAG_ENTITY_GLIMAGE_PREV)) {
+		lastDisplayed = &e;
+		return e;
+	}
+
+	/* not ready yet: keep showing the last image as long as it is loaded,
+	 * otherwise show the placeholder */
+	if (lastDisplayed && !(entities.getFlags(e.index) & FLAG_ENTITY_FAILED) && (lastDisplayed->flags & (FLAG_ENTITY_GLIMAGE | FLAG_ENTITY_GLIMAGE_PREV))) {
+		updateGLImageResidency(*lastDisplayed);
+		continueGLImageUpload(*lastDisplayed, budget);
+		return *lastDisplayed;
+	}
+	return dummy;
+}
+
+void CController::uploadNeighbours(TGLUploadBudget& budget)
+{
+	size_t cnt = entities.size();
+	for (size_t d = 1; d <= neighbourCount; d++) {
+		size_t idx[2];
+		idx[0] = currentEntity + d;
+		idx[1] = (currentEntity >= d) ? currentEntity - d : cnt;
+		for (int i=0; i<2; i++) {
+			if (budget.isExhausted()) {
+				return;
+			}
+			CImageEntity *e = (idx[i] < cnt) ? entities.getResident(idx[i]) : NULL;
+			if (e && (e->flags & FLAG_ENTITY_IMAGE) && uploadGLImage(*e)) {
+				updateGLImageResidency(*e);
+				continueGLImageUpload(*e, budget);
+			}
+		}
+	}
+}
+
+bool CController::isUpdatePending()
+{
+	if (windowDirty || (uploadWorker && uploadWorker->hasResults()) || (prefetcher && prefetcher->hasResults()) || !proxyResults.isEmpty() || proxyResultLost.load()) {
+		return true;
+	}
+	if (skimming && !nav.isSkimming(util::getTime())) {
+		return true;
+	}
+	size_t cnt = entities.size();
+	size_t first = (currentEntity > neighbourCount) ? currentEntity - neighbourCount : 0;
+	for (size_t i = first; i < cnt && i <= currentEntity + neighbourCount; i++) {
+		CImageEntity *e = entities.getResident(i);
+		if (e && (e->flags & FLAG_ENTITY_GLIMAGE_PENDING)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool CController::isWorkQueued() const
+{
+	if (skimming) {
+		/* the coarse images are refined when the user stops */
+		return true;
+	}
+	size_t cnt = entities.size();
+	for (size_t i = windowFirst; i < cnt && i <= windowLast; i++) {
+		CImageEntity *e = entities.getResident(i);
+		if (e && (e->glUploadTicket || e->decodeTicket || e->proxyTicket)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+double CController::getIdleTimeout(double maxTimeout) const
+{
+	if (skimming) {
+		double t = nav.getSkimEnd() - util::getTime();
+		if (t < maxTimeout) {
+			return (t > 0.0) ? t : 0.0;
+		}
+	}
+	return maxTimeout;
+}
+
+void CController::logPrefetchStats() const
+{
+	const TPrefetchStats& s = prefetchStats;
+	if (!s.switches) {
+		return;
+	}
+	util::info("prefetch: %u switches, %u hits (%.1f%%), %u pending, %u misses",
+		(unsigned)s.switches, (unsigned)s.hits, 100.0 * (double)s.hits / (double)s.switches,
+		(unsigned)s.pending, (unsigned)s.misses);
+	for (int i = 0; i < (int)FC_DECODE_TIER_COUNT; i++) {
+		if (s.decoded[i]) {
+			util::info("prefetch: %s: decoded %u, wasted %u", getTierName((TFCDecodeTier)i),
+				(unsigned)s.decoded[i], (unsigned)s.wasted[i]);
+		}
+	}
+	util::info("prefetch: %u cancelled", (unsigned)s.cancelled);
 }
 
 const TDisplayState& CController::getDisplayState(const CImageEntity& e) const
 {
-	return e.display;
+	return entities.getDisplay(e.index);
 }
 
 TCropState& CController::getCropStateInternal(CImageEntity& e, bool& croppingEnabled)
 {
-	if (e.flags & FLAG_ENTITY_CROPPED) {
+	if (entities.getFlags(e.index) & FLAG_ENTITY_CROPPED) {
 		croppingEnabled = true;
-		return e.crop;
+		return entities.getCrop(e.index);
 	}
 	croppingEnabled = true; // TODO: switchable mode
 	return currentCropSate;
@@ -130,9 +888,9 @@ TCropState& CController::getCropStateInternal(CImageEntity& e, bool& croppingEna
 
 const TCropState& CController::getCropState(const CImageEntity& e, bool& croppingEnabled) const
 {
-	if (e.flags & FLAG_ENTITY_CROPPED) {
+	if (entities.getFlags(e.index) & FLAG_ENTITY_CROPPED) {
 		croppingEnabled = true;
-		return e.crop;
+		return entities.getCrop(e.index);
 	}
 	croppingEnabled = true; // TODO: switchable mode
 	return currentCropSate;
@@ -213,14 +971,14 @@ void CController::reconstructCropping(const TImageInfo& info, TCropState& cs, co
 
 void CController::adjustZoom(float factor)
 {
-	CImageEntity& e = getCurrentInternal();
-	e.display.zoom *= factor;
-	if (e.display.zoom < 1.0e-6f) {
-		e.display.zoom = 1.0e-6f;
+	TDisplayState& display = entities.getDisplay(getCurrentInternal().index);
+	display.zoom *= factor;
+	if (display.zoom < 1.0e-6f) {
+		display.zoom = 1.0e-6f;
 	}
-	float delta = 1.0f - e.display.zoom;
+	float delta = 1.0f - display.zoom;
 	if (delta > 1.0e-3f &&  delta < 1.0e-3f) {
-		e.display.zoom = 1.0f;
+		display.zoom = 1.0f;
 	}
 	// TODO: snap in to pixel scales???
 }
@@ -231,27 +989,27 @@ void CController::setZoom(float factor, bool relativeToPixels)
 	if (relativeToPixels) {
 		// TODO
 	}
-	CImageEntity& e = getCurrentInternal();
-	e.display.zoom = baseFactor * factor;
+	TDisplayState& display = entities.getDisplay(getCurrentInternal().index);
+	display.zoom = baseFactor * factor;
 }
 
 void CController::resetDisplayState()
 {
-	CImageEntity& e = getCurrentInternal();
-	e.display = TDisplayState();
+	entities.getDisplay(getCurrentInternal().index) = TDisplayState();
 }
 
 void CController::getDisplayTransform(const CImageEntity& e, double scale[2], double offset[2], bool minusOneToOne) const
 {
 	double winAspect = (double)windowState.dims[0] / (double)windowState.dims[1];
 	double imgAspect;
+	const TDisplayState& display = entities.getDisplay(e.index);
 	if (e.flags & FLAG_ENTITY_IMAGE) {
-		const TImageInfo& info = e.image.getInfo();
-		imgAspect = ((double)info.width / (double)info.height) * e.display.aspectCorrection;
+		const TImageInfo& info = e.fullInfo;
+		imgAspect = ((double)info.width / (double)info.height) * display.aspectCorrection;
 	} else {
-		imgAspect = e.display.aspectCorrection;
+		imgAspect = display.aspectCorrection;
 	}
-	double s = e.display.zoom;
+	double s = display.zoom;
 	if (minusOneToOne) {
 		s *= 2.0;
 	}
@@ -321,7 +1079,7 @@ void CController::imageToCropNC(const CImageEntity& e, const double imgPos[2], d
 	double o[2];
 	bool enabled;
 	const TCropState& cs = getCropState(e, enabled);
-	getCropSizeNC(e.image.getInfo(), cs, s);
+	getCropSizeNC(e.fullInfo, cs, s);
 	o[0] = cs.posCenter[0] - 0.5 * s[0];
 	o[1] = cs.posCenter[1] - 0.5 * s[1];
 	cropPosNC[0] = (imgPos[0] - o[0])/s[0];
@@ -335,7 +1093,7 @@ void CController::cropNCToImage(const CImageEntity& e, const double cropPosNC[2]
 	double o[2];
 	bool enabled;
 	const TCropState& cs = getCropState(e, enabled);
-	getCropSizeNC(e.image.getInfo(), cs, s);
+	getCropSizeNC(e.fullInfo, cs, s);
 	o[0] = cs.posCenter[0] - 0.5 * s[0];
 	o[1] = cs.posCenter[1] - 0.5 * s[1];
 	imgPos[0] = cropPosNC[0] * s[0] + o[0];
@@ -345,7 +1103,7 @@ void CController::cropNCToImage(const CImageEntity& e, const double cropPosNC[2]
 void CController::clampCrop(const CImageEntity& e, TCropState& cs)
 {
 	double s[2];
-	getCropSizeNC(e.image.getInfo(), cs, s);
+	getCropSizeNC(e.fullInfo, cs, s);
 	for (int i=0; i<2; i++) {
 		if (cs.posCenter[i] - 0.5 * s[i] < 0.0) {
 			cs.posCenter[i] = (float)( 0.5 * s[i] );
@@ -419,7 +1177,7 @@ void CController::adjustCropScale(float factor)
 		if (cs.scale < 1.0e-6f) {
 			cs.scale = 1.0e-6f;
 		}
-		float delta = 1.0f - e.crop.scale;
+		float delta = 1.0f - entities.getCrop(e.index).scale;
 		if (delta > 1.0e-3f &&  delta < 1.0e-3f) {
 			cs.scale = 1.0f;
 		}
@@ -473,39 +1231,98 @@ void CController::resetCropState(bool includeAspect)
 	}
 }
 
-bool CController::processImage(const char *suffix)
+bool CController::processImage(const char *suffix, bool async)
 {
-	CImage *img;
-	CImage cropped;
-	CImage resized;
 	CImageEntity& e = getCurrentInternal();
-	const char *srcName = e.filename.c_str();
+	CScratchScope scratch;
+	CScratchArena& arena = scratch.getArena();
+	const char *srcName = getFilename(e);
 	const char *baseName = cfg.outputDir.empty()?srcName:util::getBasename(srcName);
 	const char *ext = util::getExt(baseName);
-	std::string filename;
 	if (!srcName || !baseName) {
 		util::warn("no valid file name");
 		return false;
 	}
-	if (ext == baseName) {
-		filename = baseName;
-	} else {
-		filename = std::string(baseName, ext - baseName - 1);
+	size_t stemLen = (ext == baseName) ? strlen(baseName) : (size_t)(ext - baseName - 1);
+	size_t len = cfg.outputDir.size() + stemLen + strlen(suffix) + cfg.outputType.size() + 3;
+	char *filename = (char*)arena.allocate(len, 1);
+	if (!filename) {
+		util::warn("failed to allocate file name");
+		return false;
 	}
+	mysnprintf(filename, len, "%s%s%.*s%s.%s", cfg.outputDir.c_str(), (cfg.outputDir.empty())?"":"/",
+			(int)stemLen, baseName, suffix, cfg.outputType.c_str());
+	util::info("processing '%s' to '%s'", srcName, filename);
 
-	if (!cfg.outputDir.empty()) {
-		filename = cfg.outputDir + "/" + filename;
+	TExportJob job;
+	try {
+		job.srcName = srcName;
+		job.filename = filename;
+		job.cfg = cfg;
+	} catch (...) {
+		util::warn("failed to set up the export of '%s'", srcName);
+		return false;
 	}
-	filename = filename + std::string(suffix) + "." + cfg.outputType;
-	util::info("processing '%s' to '%s'", srcName, filename.c_str());
+	job.crop = getCropStateInternal(e, job.cropEnabled);
 
-	bool enabled;
-	TCropState& cs = getCropStateInternal(e, enabled);
-	img = &e.image;
-	if (enabled) {
+	if (async && pool) {
+		/* a snapshot of the image and the settings, the task decodes
+		 * the image itself if it is not loaded yet */
+		if ((e.flags & FLAG_ENTITY_IMAGE) && e.imageTier == FC_DECODE_FULL) {
+			job.image = e.image;
+		}
+		bool queued = false;
+		try {
+			queued = pool->submit(FC_TASK_EXPORT, [this, job](const CCancelToken&) mutable {exportImage(job);});
+		} catch (...) {
+			queued = false;
+		}
+		if (!queued) {
+			util::warn("failed to queue the export of '%s'", srcName);
+		}
+		return queued;
+	}
+
+	if (!decodeImage(e)) {
+		return false;
+	}
+	job.image = e.image;
+	return exportImage(job);
+}
+
+/* convert, crop, resize and encode, may run on a pool thread:
+ * only uses the job and the codecs */
+bool CController::exportImage(TExportJob& job) const
+{
+	const CImage *img;
+	CImage converted;
+	CImage cropped;
+	CImage resized;
+	CScratchScope scratch;
+#ifndef NDEBUG
+	TScratchStats scratchBefore = scratch.getArena().getStats();
+#endif
+	const char *srcName = job.srcName.c_str();
+	const char *filename = job.filename.c_str();
+	const TConfig& c = job.cfg;
+
+	if (!job.image.hasData() && !codecs.decode(srcName, job.image, decodeSettings)) {
+		util::warn("failed to decode '%s'", srcName);
+		return false;
+	}
+
+	img = &job.image;
+	if (!c.keepYCbCr && img->getInfo().isPlanar()) {
+		if (!img->convertToInterleaved(converted)) {
+			util::warn("failed to convert image '%s' to RGB", srcName);
+			return false;
+		}
+		img = &converted;
+	}
+	if (job.cropEnabled) {
 		int32_t pos[2], size[2];
 		const TImageInfo& info = img->getInfo();
-		applyCropping(info, cs, pos, size);
+		applyCropping(info, job.crop, pos, size);
 		pos[1] = (int32_t)info.height - size[1] - pos[1];
 		util::info("  cropping to %d,%d %dx%d", pos[0],pos[1],size[0],size[1]);
 		if (!img->cropTo(cropped, pos, size)) {
@@ -515,27 +1332,36 @@ bool CController::processImage(const char *suffix)
 		img = &cropped;
 	}
 
-	if (!img->resizeToLimits(resized, cfg.resizeCtx, cfg.maxSize, cfg.maxWidth, cfg.maxHeight, cfg.minSize, cfg.minWidth, cfg.minHeight)) {
+	if (!img->resizeToLimits(resized, c.resizeCtx, c.maxSize, c.maxWidth, c.maxHeight, c.minSize, c.minWidth, c.minHeight)) {
 		util::warn("failed to resize image '%s'", srcName);
 		return false;
 	}
 	img = &resized;
+	converted.reset();
 	cropped.reset();
 	util::info("  resized to %ux%u", (unsigned)img->getInfo().width, (unsigned)img->getInfo().height);
 
-	const char *fname = filename.c_str();
-	if (!codecs.encode(fname, *img, encodeSettings)) {
-		util::warn("failed to save image as %s", fname);
+	if (!codecs.encode(filename, *img, encodeSettings)) {
+		util::warn("failed to save image as %s", filename);
 		return false;
 	}
+#ifndef NDEBUG
+	const TScratchStats& scratchAfter = scratch.getArena().getStats();
+	debug("  scratch: %u block/fallback allocations, %u arena allocations, %u KiB high water",
+		(unsigned)(scratchAfter.fallbackAllocs - scratchBefore.fallbackAllocs),
+		(unsigned)(scratchAfter.arenaAllocs - scratchBefore.arenaAllocs),
+		(unsigned)(scratchAfter.highWater / 1024U));
+#endif
 	return true;
 }
 
 void CController::addFile(const char *name)
 {
-	CImageEntity *e = new CImageEntity();
-	e->filename = std::string(name);
-	entities.push_back(e);
+	if (!entities.add(name)) {
+		util::warn("failed to add '%s'", name);
+		return;
+	}
+	windowDirty = true;
 }
 
 void CController::switchTo(size_t idx)
@@ -551,20 +1377,22 @@ void CController::switchTo(size_t idx)
 	if (currentEntity == idx) {
 		return;
 	}
-  	CImageEntity& e = getCurrentInternal();
-	if (&e != &dummy) {
-		if (e.flags & FLAG_ENTITY_GLIMAGE) {
-			e.glImage.drop();
-			e.flags &= ~FLAG_ENTITY_GLIMAGE;
-		}
-		// TODO: for now, also unload it, in the future, use manager thread 
-		if (e.flags & FLAG_ENTITY_IMAGE) {
-			e.image.reset();
-			e.flags &= ~FLAG_ENTITY_IMAGE;
+	currentEntity = idx;
+	CImageEntity *e = entities.acquire(idx);
+	if (e) {
+		restoreCachedImage(*e);
+		prefetchStats.switches++;
+		if (e->flags & FLAG_ENTITY_IMAGE) {
+			prefetchStats.hits++;
+		} else if (e->flags & FLAG_ENTITY_IMAGE_PENDING) {
+			prefetchStats.pending++;
+		} else {
+			prefetchStats.misses++;
 		}
 	}
-
-	currentEntity = idx;
+	/* the images which left the prefetch window are unloaded with
+	 * the next frame */
+	windowDirty = true;
 }
 
 void CController::switchDelta(int delta)
@@ -581,5 +1409,6 @@ void CController::switchDelta(int delta)
 		diff = (size_t) delta;
 		idx = currentEntity + diff;
 	}
+	nav.onSwitch(delta, util::getTime());
 	switchTo(idx);
 }
@@ -3,12 +3,24 @@
 
 #include "image.h"
 #include "glimage.h"
-
+#include "glupload.h"
+#include "completion.h"
+#include "entity.h"
+#include "imagecache.h"
+#include "navigation.h"
+#include "threadpool.h"
+
+#include <atomic>
 #include <string>
 #include <vector>
 
 class CCodecs; // forward codec.h
 struct CCodecSettings; // forward codec.h
+struct TCodecDecodeCtx; // forward codec.h
+class CGLUploadWorker; // forward glworker.h
+class CGLTimers; // forward gltimer.h
+class CPrefetchManager; // forward prefetch.h
+struct TPrefetchResult; // forward prefetch.h
 
 struct TWindowState {
 	int dims[2];
@@ -18,50 +30,6 @@ struct TWindowState {
 	{}
 };
 
-struct TDisplayState {
-	float zoom;
-	float aspectCorrection;
-
-	TDisplayState() noexcept :
-		zoom(1.0f),
-		aspectCorrection(1.0f)
-	{}
-};
-
-
-struct TCropState {
-	float posCenter[2];
-	float aspectRatio[2];
-	float scale;
-
-	TCropState() noexcept :
-		posCenter{0.5f, 0.5f},
-		aspectRatio{1.0f, 1.0f},
-		scale(1.0f)
-	{}
-};
-
-const unsigned int FLAG_ENTITY_IMAGE = 0x1;
-const unsigned int FLAG_ENTITY_IMAGE_PENDING = 0x2;
-const unsigned int FLAG_ENTITY_GLIMAGE = 0x4;
-const unsigned int FLAG_ENTITY_GLIMAGE_PENDING = 0x8;
-const unsigned int FLAG_ENTITY_CROPPED = 0x10;
-
-struct CImageEntity {
-	std::string filename;
-	CImage image;
-	CGLImage glImage;
-
-	TDisplayState display;
-	TCropState crop;
-
-	unsigned int flags;
-
-	CImageEntity() :
-		flags(0)
-	{}
-};
-
 struct TConfig {
 	size_t maxSize;
 	size_t maxWidth;
@@ -73,6 +41,10 @@ struct TConfig {
 	std::string outputType;
 	std::string postprocessCommand;
 	TImageResizeCtx resizeCtx;
+	bool keepYCbCr; /* crop and resize planar YCbCr images without converting to RGB */
+	size_t prefetchAhead; /* images after the current one which are decoded in the background */
+	size_t prefetchBehind; /* images before the current one which are kept decoded */
+	size_t imageCacheSize; /* bytes of decoded images kept after they left the window, 0: none */
 
 	TConfig() :
 		maxSize(1344),
@@ -83,10 +55,51 @@ struct TConfig {
 		minHeight(0),
 		outputDir("/home/mh/tmp/DONTBACKUP/photos-staging/sel/c"),
 		outputType("png"),
-		postprocessCommand()
+		postprocessCommand(),
+		keepYCbCr(true),
+		prefetchAhead(2),
+		prefetchBehind(1),
+		imageCacheSize(CImageCache::getDefaultBudget())
 	{}
 };
 
+/* how well the prefetching predicted the navigation */
+struct TPrefetchStats {
+	size_t switches;	/* images switched to */
+	size_t hits;		/* ... which were decoded already */
+	size_t pending;		/* ... which were still being decoded */
+	size_t misses;		/* ... which were not requested yet */
+	size_t decoded[FC_DECODE_TIER_COUNT];
+	size_t wasted[FC_DECODE_TIER_COUNT];	/* decoded, but unloaded without being shown */
+	size_t cancelled;	/* decodes of images which left the window */
+
+	TPrefetchStats() noexcept :
+		switches(0),
+		hits(0),
+		pending(0),
+		misses(0),
+		cancelled(0)
+	{
+		for (int i = 0; i < (int)FC_DECODE_TIER_COUNT; i++) {
+			decoded[i] = 0;
+			wasted[i] = 0;
+		}
+	}
+};
+
+/* a display proxy created by the thread pool */
+struct TProxyResult {
+	CImageEntity *entity;
+	unsigned int ticket;
+	CImage proxy;
+	bool success;
+
+	TProxyResult() noexcept :
+		entity(NULL),
+		ticket(0),
+		success(false)
+	{}
+};
 
 class CController {
 	private:
@@ -95,11 +108,28 @@ class CController {
 		const CCodecSettings& encodeSettings;
 		TConfig cfg;
 		TWindowState windowState;
-
-		std::vector<CImageEntity*> entities;
-		CImageEntity dummy;
+		GLint glMaxSize;
+		CGLUploadRing uploadRing;
+		CGLUploadWorker *uploadWorker;
+		CGLTimers *timers;
+		CPrefetchManager *prefetcher;
+		CThreadPool *pool;
+		CCompletionQueue<TProxyResult> proxyResults;
+		unsigned int nextProxyTicket;
+		std::atomic<bool> proxyResultLost; /* a task could not queue its result */
+		CImageEntity *lastDisplayed; /* shown while the current image is not ready */
+		CNavigationModel nav;
+		bool skimming; /* the state of nav the prefetch window was set up for */
+		TPrefetchStats prefetchStats;
+		CImageCache imageCache; /* decoded images outside of the window */
+
+		CEntityTable entities;
+		CImageEntity dummy; /* the placeholder, not in the table */
 
 		size_t currentEntity;
+		size_t windowFirst; /* range of the entities which may be loaded */
+		size_t windowLast;
+		bool windowDirty;
 		TCropState currentCropSate;
 
 		int inDragCrop;
@@ -107,10 +137,44 @@ class CController {
 		double dragCropNCBegin[2];
 
 		bool uploadGLImage(CImageEntity& e);
+		void retireGLImage(CImageEntity& e);
 		void dropGLImage(CImageEntity& e);
-		bool prepareImageEntity(CImageEntity& e);
+		void updateGLImageResidency(CImageEntity& e);
+		void continueGLImageUpload(CImageEntity& e, TGLUploadBudget& budget);
+		void cancelGLImageUpload(CImageEntity& e);
+		void collectGLImages();
+		bool requestProxy(CImageEntity& e, unsigned int level);
+		void cancelProxy(CImageEntity& e);
+		void collectProxies();
+		unsigned int getDisplayLevel(const CImageEntity& e) const;
+		TFCDecodeTier getWantedTier(const CImageEntity& e) const;
+		bool prepareImageEntity(CImageEntity& e, TGLUploadBudget& budget);
+		void unloadEntity(CImageEntity& e);
+
+		void getDecodeRequest(TFCDecodeTier tier, TCodecDecodeCtx& ctx) const;
+		void requestDecode(CImageEntity& e, TFCTaskPriority priority, TFCDecodeTier tier);
+		void cancelDecode(CImageEntity& e);
+		bool restoreCachedImage(CImageEntity& e);
+		void setImage(CImageEntity& e, CImage& img, TFCDecodeTier tier, const TCodecDecodeCtx& ctx);
+		void applyDecodeResult(CImageEntity& e, TPrefetchResult& r);
+		void collectDecodedImages();
+		bool decodeImage(CImageEntity& e);
+		void updatePrefetch();
 
 		CImageEntity& getCurrentInternal();
+		const char *getFilename(const CImageEntity& e) const {return entities.getFilename(e.index);}
+		void releaseEntities(size_t first, size_t last);
+
+		/* everything an export needs, independent of the entity */
+		struct TExportJob {
+			std::string srcName;
+			std::string filename;
+			CImage image; /* not decoded yet: empty */
+			TCropState crop;
+			bool cropEnabled;
+			TConfig cfg;
+		};
+		bool exportImage(TExportJob& job) const;
 
 		void winToNC(const double winPos[2], double nc[2]) const;
 		void NCtoWin(const double nc[2], double winPos[2]) const;
@@ -134,8 +198,18 @@ class CController {
 		CController& operator=(const CController& other) = delete;
 		CController& operator=(CController&& other) = delete;
 
-		bool initGL();
+		bool initGL(GLint maxSize);
 		void dropGL();
+		/* create the GL images on this worker (NULL: on the render thread) */
+		void setUploadWorker(CGLUploadWorker *worker);
+		/* decode the images around the current one on these threads
+		 * (NULL: only decode the current image, on the render thread) */
+		void setPrefetchManager(CPrefetchManager *manager);
+		/* create the display proxies and export images in this pool
+		 * (NULL: on the render thread) */
+		void setThreadPool(CThreadPool *threadPool);
+		/* measure the GPU time of the uploads (NULL: no measurement) */
+		void setTimers(CGLTimers *t) noexcept {timers = t;}
 
 		void setWindowSize(int w, int h) noexcept;
 		const TWindowState& getWindowState() const noexcept;
@@ -143,7 +217,24 @@ class CController {
 		TConfig& getConfig() noexcept {return cfg;}
 		const TConfig& getConfig() const noexcept {return cfg;}
 
-		const CImageEntity& getCurrent();
+		/* prepare the current image for drawing, uploads within the budget,
+		 * never blocks: returns the last image or a placeholder while the
+		 * current one is not ready */
+		const CImageEntity& getCurrent(TGLUploadBudget& budget);
+		/* spend what is left of the budget on the GL images of the
+		 * neighbouring images which are already decoded */
+		void uploadNeighbours(TGLUploadBudget& budget);
+		/* true if more frames are needed to finish pending uploads or
+		 * to take over the results of the upload worker */
+		bool isUpdatePending();
+		/* true while the upload worker, the prefetch manager or the thread
+		 * pool still work on one of the loaded images */
+		bool isWorkQueued() const;
+		/* how long the main loop may wait for events, at most maxTimeout:
+		 * the end of skimming needs a frame even without an event */
+		double getIdleTimeout(double maxTimeout) const;
+		void logPrefetchStats() const;
+		void logCacheStats() const {imageCache.logStats();}
 		const TDisplayState& getDisplayState(const CImageEntity& e) const;
 		const TCropState& getCropState(const CImageEntity& e, bool& croppingEnabled) const;
 		void applyCropping(const TImageInfo& img, const TCropState& cs, int32_t pos[2], int32_t size[2]) const;
@@ -154,6 +245,8 @@ class CController {
 		void setZoom(float factor, bool relativeToPixels = false);
 		void resetDisplayState();
 
+		/* room for count more files, with nameBytes of names in total */
+		void reserveFiles(size_t count, size_t nameBytes) noexcept {entities.reserve(count, nameBytes);}
 		void addFile(const char *name);
 		void switchTo(size_t idx);
 		void switchDelta(int delta);
@@ -167,7 +260,9 @@ class CController {
 		void setCropAspect(float a, float b);
 		void resetCropState(bool includeAspect);
 
-		bool processImage(const char *suffix);
+		/* export the current image, with a thread pool in the background
+		 * unless async is false */
+		bool processImage(const char *suffix, bool async = true);
 };
 
 #endif /* !FASTCROP_CONTROLLER_H*/
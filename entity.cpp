@@ -0,0 +1,121 @@
+#include "entity.h"
+
+#include <string.h>
+
+void CImageEntity::reset() noexcept
+{
+	index = CEntityTable::npos;
+	image.reset();
+	fullInfo.reset();
+	proxy.reset();
+	glImageLevel = 0;
+	glUploadTicket = 0;
+	glUploadLevel = 0;
+	decodeTicket = 0;
+	imageTier = FC_DECODE_FULL;
+	proxyTicket = 0;
+	proxyLevel = 0;
+	proxyToken = CCancelToken(); /* no flag shared with the last owner */
+	flags = 0;
+}
+
+CEntityTable::CEntityTable() noexcept :
+	noFlags(0)
+{
+}
+
+CEntityTable::~CEntityTable() noexcept
+{
+	for (size_t i = 0; i < slots.size(); i++) {
+		delete slots[i];
+	}
+}
+
+void CEntityTable::reserve(size_t count, size_t nameBytes) noexcept
+{
+	try {
+		names.reserve(names.size() + nameBytes);
+		nameOffsets.reserve(nameOffsets.size() + count);
+		flags.reserve(flags.size() + count);
+		displays.reserve(displays.size() + count);
+		crops.reserve(crops.size() + count);
+		resident.reserve(resident.size() + count);
+	} catch (...) {
+		/* add() grows them on demand */
+	}
+}
+
+bool CEntityTable::add(const char *filename) noexcept
+{
+	size_t cnt = nameOffsets.size();
+	size_t offset = names.size();
+	try {
+		names.insert(names.end(), filename, filename + strlen(filename) + 1);
+		nameOffsets.push_back(offset);
+		flags.push_back(0);
+		displays.push_back(TDisplayState());
+		crops.push_back(TCropState());
+		resident.push_back(NULL);
+	} catch (...) {
+		names.resize(offset);
+		nameOffsets.resize(cnt);
+		flags.resize(cnt);
+		displays.resize(cnt);
+		crops.resize(cnt);
+		resident.resize(cnt);
+		return false;
+	}
+	return true;
+}
+
+CImageEntity *CEntityTable::acquire(size_t idx) noexcept
+{
+	if (idx >= resident.size()) {
+		return NULL;
+	}
+	if (resident[idx]) {
+		return resident[idx];
+	}
+
+	CImageEntity *e = NULL;
+	if (freeSlots.empty()) {
+		try {
+			e = new CImageEntity();
+			slots.push_back(e);
+			freeSlots.reserve(slots.size());
+		} catch (...) {
+			if (e && !slots.empty() && slots.back() == e) {
+				slots.pop_back();
+			}
+			delete e;
+			return NULL;
+		}
+	} else {
+		e = freeSlots.back();
+		freeSlots.pop_back();
+	}
+	e->index = idx;
+	resident[idx] = e;
+	return e;
+}
+
+void CEntityTable::release(CImageEntity& e) noexcept
+{
+	if (e.index >= resident.size() || resident[e.index] != &e) {
+		return;
+	}
+	resident[e.index] = NULL;
+	e.reset();
+	freeSlots.push_back(&e);
+}
+
+size_t CEntityTable::getMemoryUsage() const noexcept
+{
+	return names.capacity() +
+		nameOffsets.capacity() * sizeof(size_t) +
+		flags.capacity() * sizeof(unsigned int) +
+		displays.capacity() * sizeof(TDisplayState) +
+		crops.capacity() * sizeof(TCropState) +
+		resident.capacity() * sizeof(CImageEntity*) +
+		slots.size() * sizeof(CImageEntity);
+}
@@ -0,0 +1,180 @@
+#ifndef FASTCROP_ENTITY_H
+#define FASTCROP_ENTITY_H
+
+#include "image.h"
+#include "glimage.h"
+#include "threadpool.h"
+
+#include <stddef.h>
+
+#include <vector>
+
+struct TDisplayState {
+	float zoom;
+	float aspectCorrection;
+
+	TDisplayState() noexcept :
+		zoom(1.0f),
+		aspectCorrection(1.0f)
+	{}
+};
+
+
+struct TCropState {
+	float posCenter[2];
+	float aspectRatio[2];
+	float scale;
+
+	TCropState() noexcept :
+		posCenter{0.5f, 0.5f},
+		aspectRatio{1.0f, 1.0f},
+		scale(1.0f)
+	{}
+};
+
+const unsigned int FLAG_ENTITY_IMAGE = 0x1;
+const unsigned int FLAG_ENTITY_IMAGE_PENDING = 0x2;
+const unsigned int FLAG_ENTITY_GLIMAGE = 0x4;
+const unsigned int FLAG_ENTITY_GLIMAGE_PENDING = 0x8;
+const unsigned int FLAG_ENTITY_CROPPED = 0x10;
+const unsigned int FLAG_ENTITY_FAILED = 0x20;
+const unsigned int FLAG_ENTITY_SHOWN = 0x40;
+const unsigned int FLAG_ENTITY_GLIMAGE_STALE = 0x80;
+const unsigned int FLAG_ENTITY_GLIMAGE_PREV = 0x100;
+/* kept by the entity table while the entity is not loaded */
+const unsigned int FLAG_ENTITY_PERSISTENT = FLAG_ENTITY_CROPPED | FLAG_ENTITY_FAILED;
+
+/* how much of an image is decoded, coarsest first */
+enum TFCDecodeTier {
+	FC_DECODE_THUMB = 0,	/* the thumbnail embedded in the EXIF data */
+	FC_DECODE_SKIM,		/* reduced to 1/8 where the codec can (libjpeg DCT scaling) */
+	FC_DECODE_PREVIEW,	/* reduced, but at least as large as the window */
+	FC_DECODE_FULL,		/* full resolution */
+	FC_DECODE_TIER_COUNT // end marker
+};
+
+/* The full resolution image is kept for export. For display, a proxy
+ * reduced by a power of two is used as long as it still has more pixels
+ * than the image covers on screen.
+ * FLAG_ENTITY_GLIMAGE_PENDING is set while the GL image still has data
+ * to upload or is not ready for drawing, the upload continues over several
+ * frames.
+ * With an upload worker, the GL image is created on the worker thread, the
+ * old one (if any) is shown until the new one arrives.
+ * FLAG_ENTITY_IMAGE_PENDING is set while the image is decoded by the
+ * prefetch manager, FLAG_ENTITY_FAILED (in the entity table) if decoding
+ * failed, it is not tried again. The current image is refined one tier at a time, from the
+ * EXIF thumbnail up to the preview, and to full resolution when it is
+ * zoomed beyond that. While the user skims, the other images are only
+ * decoded at FC_DECODE_THUMB. A finer image flags the GL image of the
+ * coarse one FLAG_ENTITY_GLIMAGE_STALE. When the replacement is created,
+ * the old GL image moves to glImagePrev (FLAG_ENTITY_GLIMAGE_PREV) and is
+ * drawn until the new one is uploaded. All geometry (display and crop
+ * state) refers to fullInfo, so it does not change with the tier.
+ * FLAG_ENTITY_SHOWN is set once the entity became the current one after
+ * it was loaded.
+ * With a thread pool, the proxy is created by a task, the GL image is
+ * (re)created when it arrives.
+ * Only the entities around the current one are loaded: the entity table
+ * hands out these objects and reuses them, the file name, the display and
+ * crop state and the persistent flags are kept by the table. */
+struct CImageEntity {
+	size_t index; /* in the entity table, CEntityTable::npos: none */
+	CImage image;
+	TImageInfo fullInfo; /* of the full resolution image, valid with FLAG_ENTITY_IMAGE */
+	CImage proxy;
+	CGLImage glImage;
+	CGLImage glImagePrev; /* drawn while glImage is uploaded */
+	unsigned int glImageLevel; /* reduction of the GL image: 2^level */
+	unsigned int glUploadTicket; /* job of the upload worker, 0: none */
+	unsigned int glUploadLevel; /* reduction of the image the worker creates */
+	unsigned int decodeTicket; /* job of the prefetch manager, 0: none */
+	TFCDecodeTier imageTier; /* of the decoded image */
+	unsigned int proxyTicket; /* proxy resize task, 0: none */
+	unsigned int proxyLevel; /* reduction of the proxy the task creates */
+	CCancelToken proxyToken;
+
+	unsigned int flags; /* without FLAG_ENTITY_PERSISTENT */
+
+	CImageEntity() :
+		index((size_t)-1),
+		glImageLevel(0),
+		glUploadTicket(0),
+		glUploadLevel(0),
+		decodeTicket(0),
+		imageTier(FC_DECODE_FULL),
+		proxyTicket(0),
+		proxyLevel(0),
+		flags(0)
+	{}
+
+	/* back to the unloaded state, the GL images have to be dropped */
+	void reset() noexcept;
+};
+
+/* All the files of a session, as a structure of arrays: the file names
+ * back to back in one buffer, the state every entity has (persistent
+ * flags, display and crop state) in one array each. The heavy part, the
+ * CImageEntity with the images, exists only for the loaded entities. Those
+ * objects are never freed before the table, acquire() reuses the released
+ * ones, so pointers to them stay valid (results of the workers are matched
+ * by their tickets, not by the pointer alone).
+ * The placeholder, which has no index, gets a state of its own.
+ * Only for the thread which owns the controller. */
+class CEntityTable {
+	private:
+		std::vector<char> names;		/* NUL-terminated */
+		std::vector<size_t> nameOffsets;
+		std::vector<unsigned int> flags;	/* FLAG_ENTITY_PERSISTENT */
+		std::vector<TDisplayState> displays;
+		std::vector<TCropState> crops;
+		std::vector<CImageEntity*> resident;	/* NULL: not loaded */
+		std::vector<CImageEntity*> slots;	/* owned, resident or free */
+		std::vector<CImageEntity*> freeSlots;	/* capacity of slots, release() never allocates */
+
+		unsigned int noFlags;
+		TDisplayState noDisplay;
+		TCropState noCrop;
+
+	public:
+		static const size_t npos = (size_t)-1;
+
+		CEntityTable() noexcept;
+		~CEntityTable() noexcept;
+
+		CEntityTable(const CEntityTable& other) = delete;
+		CEntityTable(CEntityTable&& other) = delete;
+		CEntityTable& operator=(const CEntityTable& other) = delete;
+		CEntityTable& operator=(CEntityTable&& other) = delete;
+
+		/* room for count more files with nameBytes of names in total */
+		void reserve(size_t count, size_t nameBytes) noexcept;
+		bool add(const char *filename) noexcept;
+		size_t size() const noexcept {return nameOffsets.size();}
+
+		/* "" for npos, invalidated by add() */
+		const char *getFilename(size_t idx) const noexcept {return (idx < nameOffsets.size()) ? &names[nameOffsets[idx]] : "";}
+		unsigned int& getFlags(size_t idx) noexcept {return (idx < flags.size()) ? flags[idx] : noFlags;}
+		unsigned int getFlags(size_t idx) const noexcept {return (idx < flags.size()) ? flags[idx] : noFlags;}
+		TDisplayState& getDisplay(size_t idx) noexcept {return (idx < displays.size()) ? displays[idx] : noDisplay;}
+		const TDisplayState& getDisplay(size_t idx) const noexcept {return (idx < displays.size()) ? displays[idx] : noDisplay;}
+		TCropState& getCrop(size_t idx) noexcept {return (idx < crops.size()) ? crops[idx] : noCrop;}
+		const TCropState& getCrop(size_t idx) const noexcept {return (idx < crops.size()) ? crops[idx] : noCrop;}
+
+		/* the loaded entity, NULL if there is none */
+		CImageEntity *getResident(size_t idx) const noexcept {return (idx < resident.size()) ? resident[idx] : NULL;}
+		/* the loaded entity, gets a free one if there is none,
+		 * NULL on failure */
+		CImageEntity *acquire(size_t idx) noexcept;
+		/* hand back an entity which was unloaded */
+		void release(CImageEntity& e) noexcept;
+
+		/* all the entity objects, including the free ones */
+		size_t getSlotCount() const noexcept {return slots.size();}
+		CImageEntity& getSlot(size_t i) noexcept {return *slots[i];}
+
+		/* bytes used by the table itself */
+		size_t getMemoryUsage() const noexcept;
+};
+
+#endif /* !FASTCROP_ENTITY_H */
@@ -896,6 +896,15 @@ static unsigned int handleEntryParse(fc_tiff_decoder_t * td, const fc_tiff_ifd_e
 					fc_tiff_get_u4(td, val, (TMetaDType)e->type, 1, offset);
 					data->orientation = (uint16_t)val[0];
 				}
+			} else if (st == FC_META_ST_IFD && idx == 1) {
+				/* relative to the TIFF header for now */
+				if (e->tag == FC_TIFF_EXIF_JPEG_OFFSET) {
+					fc_tiff_get_u4(td, val, (TMetaDType)e->type, 1, offset);
+					data->thumbnailOffset = val[0];
+				} else if (e->tag == FC_TIFF_EXIF_JPEG_SIZE) {
+					fc_tiff_get_u4(td, val, (TMetaDType)e->type, 1, offset);
+					data->thumbnailSize = val[0];
+				}
 			}
 		}
 	}
@@ -954,6 +963,8 @@ extern size_t EXIFFindBegin(const void* data, size_t maxSize)
 extern bool EXIFParse(TExifData& info, const void* data, size_t size)
 {
 	info.parsed = false;
+	info.thumbnailOffset = 0;
+	info.thumbnailSize = 0;
 	TExifParseCtx ctx;
 	ctx.depth = 0;
 	ctx.data = &info;
@@ -966,6 +977,16 @@ extern bool EXIFParse(TExifData& info, const void* data, size_t size)
 	if (fc_tiff_decode_memory(&td, (const uint8_t*)data, size, FC_META_TAG_EXIF, true)) {
 		return false;
 	}
+	if (info.thumbnailSize) {
+		/* the decoder skipped the Exif header */
+		size_t begin = (size_t)(td.data - (const uint8_t*)data) + info.thumbnailOffset;
+		if (begin + info.thumbnailSize > size) {
+			info.thumbnailOffset = 0;
+			info.thumbnailSize = 0;
+		} else {
+			info.thumbnailOffset = (uint32_t)begin;
+		}
+	}
 	info.parsed = true;
 	return true;
 }
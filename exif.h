@@ -10,10 +10,14 @@ extern size_t EXIFFindBegin(const void* data, size_t maxSize);
 struct TExifData {
 	bool     parsed;
 	uint16_t orientation;
+	uint32_t thumbnailOffset; /* JPEG thumbnail (IFD1), relative to the parsed data */
+	uint32_t thumbnailSize;   /* 0: none */
 
 	TExifData() noexcept :
 		parsed(false),
-		orientation(0)
+		orientation(0),
+		thumbnailOffset(0),
+		thumbnailSize(0)
 	{
 	}
 };
@@ -0,0 +1,201 @@
+#include "filecache.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <utility>
+
+/* if the size of the physical memory is unknown */
+static const size_t defaultBudget = 256U * 1024U * 1024U;
+
+/* read the whole file at once */
+static bool readFile(const char *filename, TFileBytes& bytes)
+{
+	FILE *f = util::fopen_wrapper(filename, "rb");
+	if (!f) {
+		return false;
+	}
+	bool success = false;
+	long size = -1;
+	if (!fseek(f, 0, SEEK_END)) {
+		size = ftell(f);
+	}
+	if (size > 0 && !fseek(f, 0, SEEK_SET)) {
+		try {
+			std::shared_ptr<std::vector<unsigned char>> data = std::make_shared<std::vector<unsigned char>>((size_t)size);
+			if (fread(data->data(), 1, (size_t)size, f) == (size_t)size) {
+				bytes = std::move(data);
+				success = true;
+			}
+		} catch (...) {
+			success = false;
+		}
+	}
+	fclose(f);
+	return success;
+}
+
+size_t CFileCache::getDefaultBudget() noexcept
+{
+	size_t mem = util::getPhysicalMemory();
+	return (mem) ? mem / 16 : defaultBudget;
+}
+
+CFileCache::CFileCache() noexcept :
+	budget(getDefaultBudget()),
+	useCounter(0)
+{
+}
+
+size_t CFileCache::find(const char *filename) const noexcept
+{
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (!strcmp(entries[i].filename.c_str(), filename)) {
+			return i;
+		}
+	}
+	return entries.size();
+}
+
+void CFileCache::remove(size_t idx) noexcept
+{
+	stats.residentBytes -= entries[idx].bytes->size();
+	if (idx + 1 < entries.size()) {
+		entries[idx] = std::move(entries.back());
+	}
+	entries.pop_back();
+	stats.entries = entries.size();
+}
+
+/* drop the least recently used files until required bytes are free */
+bool CFileCache::evict(size_t required) noexcept
+{
+	if (required > budget) {
+		return false;
+	}
+	size_t evicted = 0;
+	while (!entries.empty() && stats.residentBytes + required > budget) {
+		size_t oldest = 0;
+		for (size_t i = 1; i < entries.size(); i++) {
+			if (entries[i].lastUse < entries[oldest].lastUse) {
+				oldest = i;
+			}
+		}
+		remove(oldest);
+		evicted++;
+	}
+	stats.evicted += evicted;
+	return true;
+}
+
+void CFileCache::insert(const char *filename, const TFileBytes& bytes) noexcept
+{
+	size_t idx = find(filename);
+	if (idx < entries.size()) {
+		/* another thread read it meanwhile */
+		entries[idx].lastUse = ++useCounter;
+		return;
+	}
+	if (!evict(bytes->size())) {
+		return;
+	}
+	try {
+		TEntry e;
+		e.filename = filename;
+		e.bytes = bytes;
+		e.lastUse = ++useCounter;
+		entries.push_back(std::move(e));
+	} catch (...) {
+		return;
+	}
+	stats.entries = entries.size();
+	stats.residentBytes += bytes->size();
+	if (stats.residentBytes > stats.peakBytes) {
+		stats.peakBytes = stats.residentBytes;
+	}
+}
+
+void CFileCache::setBudget(size_t bytes) noexcept
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	budget = bytes;
+	evict(0);
+}
+
+size_t CFileCache::getBudget() const noexcept
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return budget;
+}
+
+bool CFileCache::load(const char *filename, TFileBytes& bytes) noexcept
+{
+	if (!filename) {
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t idx = find(filename);
+		if (idx < entries.size()) {
+			entries[idx].lastUse = ++useCounter;
+			bytes = entries[idx].bytes;
+			stats.hits++;
+			return true;
+		}
+	}
+
+	/* not while holding the lock, this may take a while */
+	if (!readFile(filename, bytes)) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	stats.misses++;
+	stats.readBytes += bytes->size();
+	insert(filename, bytes);
+	return true;
+}
+
+bool CFileCache::peek(const char *filename, TFileBytes& bytes) noexcept
+{
+	if (!filename) {
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t idx = find(filename);
+	if (idx >= entries.size()) {
+		return false;
+	}
+	entries[idx].lastUse = ++useCounter;
+	bytes = entries[idx].bytes;
+	stats.hits++;
+	return true;
+}
+
+void CFileCache::clear() noexcept
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	entries.clear();
+	stats.entries = 0;
+	stats.residentBytes = 0;
+}
+
+void CFileCache::getStats(TFileCacheStats& s) const noexcept
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	s = stats;
+}
+
+void CFileCache::logStats() const noexcept
+{
+	TFileCacheStats s;
+	getStats(s);
+	if (!s.hits && !s.misses) {
+		return;
+	}
+	util::info("file cache: %u hits, %u misses (%u MiB read), %u evicted, %u files resident, %u/%u MiB (peak %u MiB)",
+		(unsigned)s.hits, (unsigned)s.misses, (unsigned)(s.readBytes / (1024U * 1024U)), (unsigned)s.evicted,
+		(unsigned)s.entries, (unsigned)(s.residentBytes / (1024U * 1024U)), (unsigned)(getBudget() / (1024U * 1024U)),
+		(unsigned)(s.peakBytes / (1024U * 1024U)));
+}
@@ -0,0 +1,90 @@
+#ifndef FASTCROP_FILECACHE_H
+#define FASTCROP_FILECACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Keeps the contents of recently decoded files, so decoding an image
+ * again (after it was evicted from the image cache, or for an export) does
+ * not touch the disk. The compressed data is about a tenth of the decoded
+ * pixels, so this tier holds many more images than the image cache, which
+ * matters with high latency network shares. Bounded by its own byte
+ * budget, least recently used files are evicted first. The files are
+ * identified by name only: changes on disk are not noticed while they are
+ * cached.
+ * May be used from any thread, the contents are shared with the decoders
+ * still using them when they are evicted. */
+
+typedef std::shared_ptr<const std::vector<unsigned char>> TFileBytes;
+
+struct TFileCacheStats {
+	size_t hits;
+	size_t misses;		/* the file was read */
+	size_t evicted;
+	size_t entries;
+	size_t residentBytes;
+	size_t peakBytes;
+	size_t readBytes;	/* read from disk in total */
+
+	TFileCacheStats() noexcept :
+		hits(0),
+		misses(0),
+		evicted(0),
+		entries(0),
+		residentBytes(0),
+		peakBytes(0),
+		readBytes(0)
+	{}
+};
+
+class CFileCache {
+	private:
+		struct TEntry {
+			std::string filename;
+			TFileBytes bytes;
+			uint64_t lastUse;
+		};
+
+		mutable std::mutex mutex;
+		std::vector<TEntry> entries;
+		size_t budget;
+		uint64_t useCounter;
+		TFileCacheStats stats;
+
+		/* all called with the mutex held */
+		size_t find(const char *filename) const noexcept;
+		void remove(size_t idx) noexcept;
+		bool evict(size_t required) noexcept;
+		void insert(const char *filename, const TFileBytes& bytes) noexcept;
+
+	public:
+		/* a sixteenth of the physical memory */
+		static size_t getDefaultBudget() noexcept;
+
+		CFileCache() noexcept;
+
+		CFileCache(const CFileCache& other) = delete;
+		CFileCache(CFileCache&& other) = delete;
+		CFileCache& operator=(const CFileCache& other) = delete;
+		CFileCache& operator=(CFileCache&& other) = delete;
+
+		/* 0 disables the cache */
+		void setBudget(size_t bytes) noexcept;
+		size_t getBudget() const noexcept;
+
+		/* get the contents of the file, reads it if it is not cached */
+		bool load(const char *filename, TFileBytes& bytes) noexcept;
+		/* get the contents only if the file is cached, never reads it */
+		bool peek(const char *filename, TFileBytes& bytes) noexcept;
+		void clear() noexcept;
+
+		void getStats(TFileCacheStats& s) const noexcept;
+		void logStats() const noexcept;
+};
+
+#endif /* !FASTCROP_FILECACHE_H */
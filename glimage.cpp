@@ -1,15 +1,47 @@
 #include "glimage.h"
+#include "glupload.h"
 #include "image.h"
+#include "util.h"
 
+#include <stdint.h>
+#include <stdlib.h>
 #include <utility>
 
+/* size of the tiles for images exceeding the texture size limit, and the
+ * border around each tile (a multiple of the largest chroma subsampling
+ * factor, so that the chroma textures stay aligned) */
+static const GLsizei glImageTileSize = 2048;
+static const GLsizei glImageTileBorder = 4;
+
+/* maximum size of a single band, so the budget is checked regularly */
+static const size_t glImageUploadBand = 4U * 1024U * 1024U;
+
+/* no tile has its mip chain prepared */
+static const size_t glImageNoTile = (size_t)-1;
+
+TGLUploadBudget::TGLUploadBudget(size_t maxBytes, double maxSeconds) noexcept :
+	bytes((maxBytes > 0) ? maxBytes : (size_t)-1),
+	deadline((maxSeconds > 0.0) ? util::getTime() + maxSeconds : 0.0)
+{
+}
+
+bool TGLUploadBudget::isExhausted() const noexcept
+{
+	return (!bytes || (deadline > 0.0 && util::getTime() >= deadline));
+}
+
 CGLImage::CGLImage() noexcept :
-	tex(0)
+	ring(NULL),
+	mipMem(NULL),
+	mipTile(glImageNoTile)
 {
 	reset();
 }
 
-CGLImage::CGLImage(CGLImage&& other) noexcept
+CGLImage::CGLImage(CGLImage&& other) noexcept :
+	ring(NULL),
+	mipMem(NULL),
+	mipTile(glImageNoTile)
 {
 	*this = std::move(other);
 }
@@ -24,8 +56,16 @@ CGLImage& CGLImage::operator=(CGLImage&& other) noexcept
 	width = other.width;
 	height = other.height;
 	internalFormat = other.internalFormat;
-	tex = other.tex;
-	other.tex = 0;
+	format = other.format;
+	dataType = other.dataType;
+	layout = other.layout;
+	tiled = other.tiled;
+	tiles = std::move(other.tiles);
+	source = std::move(other.source);
+	ring = other.ring;
+	other.tiles.clear();
+	/* the mip chain is regenerated on demand */
+	other.freeMips();
 
 	return *this;
 }
@@ -35,27 +75,277 @@ CGLImage::~CGLImage() noexcept
 	drop();
 }
 
-void CGLImage::createTex(GLsizei w, GLsizei h, GLsizei ifmt) noexcept
+static GLint getMipLevels(GLsizei w, GLsizei h) noexcept
 {
-	drop();
-	glGenTextures(1, &tex);
-	glBindTexture(GL_TEXTURE_2D, tex);
-	glTexStorage2D(GL_TEXTURE_2D, 1, ifmt, w, h);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	GLint levels = 1;
+	GLsizei s = (w > h) ? w : h;
+	while (s > 1) {
+		s >>= 1;
+		levels++;
+	}
+	return levels;
+}
+
+/* 2x2 box filter to the next mip level. The level sizes are rounded down
+ * as GL does, an odd last row or column is dropped. */
+template<typename T> static void downsampleBox(const T *src, size_t sw, size_t sh, size_t stride, T *dst, size_t dw, size_t dh, size_t n) noexcept
+{
+	size_t dx = (sw > 1) ? n : 0;
+	for (size_t y = 0; y < dh; y++) {
+		const T *a = src + (2 * y) * stride;
+		const T *b = (2 * y + 1 < sh) ? a + stride : a;
+		T *d = dst + y * dw * n;
+		for (size_t x = 0; x < dw * n; x += n) {
+			const T *pa = a + 2 * x;
+			const T *pb = b + 2 * x;
+			for (size_t i = 0; i < n; i++) {
+				d[x + i] = (T)(((uint32_t)pa[i] + pa[i + dx] + pb[i] + pb[i + dx] + 2) >> 2);
+			}
+		}
+	}
+}
+
+GLuint CGLImage::createTex(GLsizei w, GLsizei h, GLsizei ifmt, GLint levels) noexcept
+{
+	GLuint t = 0;
+	glGenTextures(1, &t);
+	glBindTexture(GL_TEXTURE_2D, t);
+	glTexStorage2D(GL_TEXTURE_2D, levels, ifmt, w, h);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, levels - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (levels > 1) ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	width = w;
-	height = h;
-	internalFormat = ifmt;
+	return t;
+}
+
+/* the rectangle x0, y0, x1, y1 of the tile textures in plane p */
+bool CGLImage::getPlaneRect(const TGLImageTile& t, size_t p, size_t rect[4]) const noexcept
+{
+	const TImageInfo& info = source.getInfo();
+	size_t pw, ph;
+	size_t shift[2] = {0, 0};
+	info.getPlaneDims(p, pw, ph);
+	if (p) {
+		shift[0] = info.chromaShift[0];
+		shift[1] = info.chromaShift[1];
+	}
+	rect[0] = (size_t)t.texPos[0] >> shift[0];
+	rect[1] = (size_t)t.texPos[1] >> shift[1];
+	rect[2] = ((size_t)(t.texPos[0] + t.texSize[0]) + ((size_t)1 << shift[0]) - 1) >> shift[0];
+	rect[3] = ((size_t)(t.texPos[1] + t.texSize[1]) + ((size_t)1 << shift[1]) - 1) >> shift[1];
+	if (rect[2] > pw) {
+		rect[2] = pw;
+	}
+	if (rect[3] > ph) {
+		rect[3] = ph;
+	}
+	return (rect[0] < rect[2] && rect[1] < rect[3]);
+}
+
+/* allocate the textures of a tile, the data is uploaded by continueTile() */
+bool CGLImage::createTile(TGLImageTile& t) noexcept
+{
+	const CImage& img = source; /* const access, don't unshare the data */
+	const TImageInfo& info = img.getInfo();
+	size_t planes = info.getPlaneCount();
+
+	dropTile(t);
+	for (size_t p = 0; p < planes; p++) {
+		size_t rect[4];
+		if (!img.getPlane(p) || !getPlaneRect(t, p, rect)) {
+			dropTile(t);
+			return false;
+		}
+		if (p == 1) {
+			t.chromaScale[0] = (float)t.texSize[0] / (float)((rect[2] - rect[0]) << info.chromaShift[0]);
+			t.chromaScale[1] = (float)t.texSize[1] / (float)((rect[3] - rect[1]) << info.chromaShift[1]);
+		}
+		GLsizei w = (GLsizei)(rect[2] - rect[0]);
+		GLsizei h = (GLsizei)(rect[3] - rect[1]);
+		t.levels[p] = getMipLevels(w, h);
+		t.tex[p] = createTex(w, h, internalFormat, t.levels[p]);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	t.baseLevel = t.levels[0];
+	return true;
+}
+
+/* generate the mip chains of all planes of a tile */
+bool CGLImage::prepareMips(size_t idx) noexcept
+{
+	if (mipTile == idx) {
+		return true;
+	}
+	freeMips();
+
+	const TGLImageTile& t = tiles[idx];
+	const CImage& img = source;
+	const TImageInfo& info = img.getInfo();
+	size_t planes = info.getPlaneCount();
+	size_t ps = info.getPlanePixelSize();
+	size_t n = ps / ((dataType == GL_UNSIGNED_SHORT) ? 2 : 1);
+	size_t total = 0;
+
+	for (size_t p = 0; p < planes; p++) {
+		size_t rect[4];
+		size_t pw, ph;
+		if (!getPlaneRect(t, p, rect) || t.levels[p] > maxLevels) {
+			return false;
+		}
+		info.getPlaneDims(p, pw, ph);
+		TMipLevel *m = mips[p];
+		m[0].data = (const unsigned char*)img.getPlane(p) + (rect[1] * pw + rect[0]) * ps;
+		m[0].w = (GLsizei)(rect[2] - rect[0]);
+		m[0].h = (GLsizei)(rect[3] - rect[1]);
+		m[0].stride = pw * ps;
+		for (GLint l = 1; l < t.levels[p]; l++) {
+			m[l].w = (m[l-1].w > 1) ? (m[l-1].w >> 1) : 1;
+			m[l].h = (m[l-1].h > 1) ? (m[l-1].h >> 1) : 1;
+			m[l].stride = (size_t)m[l].w * ps;
+			total += m[l].stride * (size_t)m[l].h;
+		}
+	}
+
+	if (total) {
+		mipMem = (unsigned char*)malloc(total);
+		if (!mipMem) {
+			util::warn("failed to allocate %u KiB for mip levels", (unsigned)(total / 1024U));
+			return false;
+		}
+	}
+	unsigned char *d = mipMem;
+	for (size_t p = 0; p < planes; p++) {
+		TMipLevel *m = mips[p];
+		for (GLint l = 1; l < t.levels[p]; l++) {
+			if (dataType == GL_UNSIGNED_SHORT) {
+				downsampleBox((const uint16_t*)m[l-1].data, (size_t)m[l-1].w, (size_t)m[l-1].h, m[l-1].stride / 2,
+					      (uint16_t*)d, (size_t)m[l].w, (size_t)m[l].h, n);
+			} else {
+				downsampleBox(m[l-1].data, (size_t)m[l-1].w, (size_t)m[l-1].h, m[l-1].stride,
+					      d, (size_t)m[l].w, (size_t)m[l].h, n);
+			}
+			m[l].data = d;
+			d += m[l].stride * (size_t)m[l].h;
+		}
+	}
+	mipTile = idx;
+	return true;
+}
+
+void CGLImage::freeMips() noexcept
+{
+	free(mipMem);
+	mipMem = NULL;
+	mipTile = glImageNoTile;
+}
+
+/* Upload the next bands of a tile, coarse levels first: first the coarsest
+ * level of every plane, then the next finer one, and so on. */
+bool CGLImage::continueTile(size_t idx, TGLUploadBudget& budget) noexcept
+{
+	TGLImageTile& t = tiles[idx];
+	if (!prepareMips(idx)) {
+		return false;
+	}
+
+	size_t planes = source.getInfo().getPlaneCount();
+	size_t ps = source.getInfo().getPlanePixelSize();
+	bool streamed = false;
+	bool first = true;
+	while (!t.isComplete() && (first || !budget.isExhausted())) {
+		GLint level = t.levels[t.plane] - 1 - t.rank;
+		if (level >= 0) {
+			const TMipLevel& m = mips[t.plane][level];
+			size_t rowBytes = (size_t)m.w * ps;
+			size_t maxBytes = (budget.bytes < glImageUploadBand) ? budget.bytes : glImageUploadBand;
+			GLsizei rows = m.h - t.row;
+			if ((size_t)rows * rowBytes > maxBytes) {
+				rows = (GLsizei)(maxBytes / rowBytes);
+				if (rows < 1) {
+					rows = 1;
+				}
+			}
+			const unsigned char *src = m.data + (size_t)t.row * m.stride;
+			glBindTexture(GL_TEXTURE_2D, t.tex[t.plane]);
+			if (ring && ring->upload(level, 0, t.row, m.w, rows, format, dataType, src, m.stride, ps)) {
+				streamed = true;
+			} else {
+				glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint)(m.stride / ps));
+				glTexSubImage2D(GL_TEXTURE_2D, level, 0, t.row, m.w, rows, format, dataType, src);
+				glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+			}
+			budget.consume((size_t)rows * rowBytes);
+			first = false;
+			t.row += rows;
+			if (t.row < m.h) {
+				continue;
+			}
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+			if (!t.plane) {
+				t.baseLevel = level;
+			}
+		}
+		t.row = 0;
+		if (++t.plane >= planes) {
+			t.plane = 0;
+			t.rank++;
+		}
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	if (streamed) {
+		/* the newest fence covers all earlier uploads */
+		if (t.fence) {
+			glDeleteSync(t.fence);
+		}
+		t.fence = ring->fence();
+	}
+	if (t.isComplete()) {
+		freeMips();
+	}
+	pollTile(t);
+	return true;
+}
+
+/* once the coarsest levels arrived, the tile can be drawn while the finer
+ * levels are still on their way */
+void CGLImage::pollTile(TGLImageTile& t) noexcept
+{
+	if (glFenceSignaled(t.fence) && t.rank > 0) {
+		t.ready = true;
+	}
+}
+
+void CGLImage::dropTile(TGLImageTile& t) noexcept
+{
+	for (int i=0; i<3; i++) {
+		if (t.tex[i]) {
+			glDeleteTextures(1, &t.tex[i]);
+			t.tex[i] = 0;
+		}
+	}
+	if (t.fence) {
+		glDeleteSync(t.fence);
+		t.fence = NULL;
+	}
+	t.levels[0] = t.levels[1] = t.levels[2] = 0;
+	t.baseLevel = 0;
+	t.rank = 0;
+	t.row = 0;
+	t.plane = 0;
+	t.ready = false;
 }
 
 void CGLImage::drop() noexcept
 {
-	if (tex) {
-		glDeleteTextures(1, &tex);
-		tex = 0;
+	for (size_t i=0; i<tiles.size(); i++) {
+		dropTile(tiles[i]);
 	}
+	tiles.clear();
+	freeMips();
+	source.reset();
 }
 
 void CGLImage::reset() noexcept
@@ -64,20 +354,30 @@ void CGLImage::reset() noexcept
 	width = 0;
 	height = 0;
 	internalFormat = GL_NONE;
+	format = GL_NONE;
+	dataType = GL_NONE;
+	layout = FC_LAYOUT_INTERLEAVED;
+	tiled = false;
+	ring = NULL;
 }
 
-bool CGLImage::create(const CImage& img) noexcept
+bool CGLImage::create(const CImage& img, GLsizei maxSize, CGLUploadRing *uploadRing) noexcept
 {
-	const void *data;
 	GLenum ifmt,fmt,dtype;
 
-	drop();
-	data = img.getData();
+	reset();
 	const TImageInfo& info = img.getInfo();
 	ifmt = GL_NONE;
 	fmt = GL_NONE;
 	dtype = GL_NONE;
-	if (info.bytesPerChannel == 1) {
+	if (info.isPlanar()) {
+		if (info.layout == FC_LAYOUT_YCBCR_PLANAR) {
+			/* each plane goes to its own texture */
+			dtype = GL_UNSIGNED_BYTE;
+			ifmt = GL_R8;
+			fmt = GL_RED;
+		}
+	} else if (info.bytesPerChannel == 1) {
 		dtype = GL_UNSIGNED_BYTE;
 		switch(info.channels) {
 			case 1:
@@ -119,13 +419,142 @@ bool CGLImage::create(const CImage& img) noexcept
 		}
 	}
 
-	if (!data || ifmt == GL_NONE) {
+	if (!img.hasData() || ifmt == GL_NONE) {
 		reset();
 		return false;
 	}
 
-	createTex((GLsizei)info.width,(GLsizei)info.height, ifmt);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, fmt, dtype, data);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	width = (GLsizei)info.width;
+	height = (GLsizei)info.height;
+	internalFormat = ifmt;
+	format = fmt;
+	dataType = dtype;
+	layout = info.layout;
+	if (uploadRing && uploadRing->isValid()) {
+		ring = uploadRing;
+	}
+	/* shares the pixel data, the uploads are done later */
+	source = img;
+
+	if (maxSize < 1 || (width <= maxSize && height <= maxSize)) {
+		TGLImageTile t;
+		t.size[0] = t.texSize[0] = width;
+		t.size[1] = t.texSize[1] = height;
+		try {
+			tiles.push_back(t);
+		} catch (...) {
+			reset();
+			return false;
+		}
+		if (!createTile(tiles[0])) {
+			reset();
+			return false;
+		}
+		return true;
+	}
+
+	GLsizei tileSize = glImageTileSize;
+	while (tileSize > glImageTileBorder && tileSize + 2 * glImageTileBorder > maxSize) {
+		tileSize /= 2;
+	}
+	GLsizei cnt[2];
+	cnt[0] = (width + tileSize - 1) / tileSize;
+	cnt[1] = (height + tileSize - 1) / tileSize;
+	try {
+		tiles.resize((size_t)cnt[0] * (size_t)cnt[1]);
+	} catch (...) {
+		reset();
+		return false;
+	}
+	const GLsizei dims[2] = {width, height};
+	for (GLsizei y = 0; y < cnt[1]; y++) {
+		for (GLsizei x = 0; x < cnt[0]; x++) {
+			TGLImageTile& t = tiles[(size_t)y * (size_t)cnt[0] + (size_t)x];
+			t.pos[0] = x * tileSize;
+			t.pos[1] = y * tileSize;
+			for (int i=0; i<2; i++) {
+				t.size[i] = dims[i] - t.pos[i];
+				if (t.size[i] > tileSize) {
+					t.size[i] = tileSize;
+				}
+				t.texPos[i] = t.pos[i] - glImageTileBorder;
+				if (t.texPos[i] < 0) {
+					t.texPos[i] = 0;
+				}
+				GLsizei end = t.pos[i] + t.size[i] + glImageTileBorder;
+				if (end > dims[i]) {
+					end = dims[i];
+				}
+				t.texSize[i] = end - t.texPos[i];
+			}
+		}
+	}
+	tiled = true;
+	return true;
+}
+
+size_t CGLImage::updateResidency(const double region[4]) noexcept
+{
+	size_t resident = 0;
+	for (size_t i=0; i<tiles.size(); i++) {
+		TGLImageTile& t = tiles[i];
+		bool visible = !tiled ||
+			((double)(t.pos[0] + t.size[0]) > region[0] && (double)t.pos[0] < region[2] &&
+			 (double)(t.pos[1] + t.size[1]) > region[1] && (double)t.pos[1] < region[3]);
+		if (visible && !t.isResident()) {
+			createTile(t);
+		} else if (!visible && t.isResident()) {
+			if (mipTile == i) {
+				freeMips();
+			}
+			dropTile(t);
+		}
+		if (t.isResident()) {
+			pollTile(t);
+			resident++;
+		}
+	}
+	return resident;
+}
+
+bool CGLImage::upload(TGLUploadBudget& budget) noexcept
+{
+	bool started = false;
+	for (size_t i=0; i<tiles.size(); i++) {
+		TGLImageTile& t = tiles[i];
+		if (!t.isResident() || t.isComplete()) {
+			continue;
+		}
+		if (started && budget.isExhausted()) {
+			return false;
+		}
+		started = true;
+		if (!continueTile(i, budget)) {
+			/* recreated by the next updateResidency() */
+			util::warn("failed to upload tile %u of %dx%d image", (unsigned)i, (int)width, (int)height);
+			dropTile(t);
+			return false;
+		}
+		if (!t.isComplete()) {
+			return false;
+		}
+	}
 	return true;
 }
+
+bool CGLImage::isUploadPending() const noexcept
+{
+	for (size_t i=0; i<tiles.size(); i++) {
+		const TGLImageTile& t = tiles[i];
+		if (t.isResident() && !(t.isComplete() && t.ready)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void CGLImage::setUploadRing(CGLUploadRing *uploadRing) noexcept
+{
+	freeMips();
+	ring = (uploadRing && uploadRing->isValid()) ? uploadRing : NULL;
+}
@@ -3,16 +3,123 @@
 
 #include <glad/gl.h>
 
-class CImage; // forward from Image.h
+#include "image.h"
+
+#include <vector>
+
+/* Planar YCbCr images are kept as three GL_R8 textures: Y, Cb and Cr.
+ * The conversion to RGB is done in the fragment shader.
+ *
+ * Images larger than the maximum size passed to create() are split into
+ * tiles. Each tile has its own textures, which cover the tile plus a small
+ * border, so that linear filtering does not show the seams. The tiles are
+ * only uploaded when they become visible (see updateResidency()). A
+ * reference to the image data is kept for the uploads.
+ *
+ * With an upload ring, the texture data is streamed through a persistently
+ * mapped PBO, and a tile is only ready for drawing when its fence signaled.
+ *
+ * The textures have a full mip chain, generated on the CPU with a box
+ * filter. The levels are uploaded from the coarsest to the finest one, and
+ * GL_TEXTURE_BASE_LEVEL always points to the finest level available.
+ *
+ * create() and updateResidency() only allocate the textures, the data is
+ * transferred by upload(), in bands of rows and limited by a budget, so a
+ * large image can be uploaded over several frames. A tile can be drawn as
+ * soon as the coarsest level of every plane arrived. */
+
+/* Limits for the uploads done in one go. A new band is only started while
+ * budget is left, but each call to CGLImage::upload() transfers at least
+ * one band, so that uploads always make progress. */
+struct TGLUploadBudget {
+	size_t bytes;		/* bytes which may still be uploaded */
+	double deadline;	/* util::getTime() after which no new band is started, 0: none */
+
+	TGLUploadBudget() noexcept :
+		bytes((size_t)-1),
+		deadline(0.0)
+	{}
+	/* maxBytes: 0 for no limit, maxSeconds: <= 0 for no limit */
+	TGLUploadBudget(size_t maxBytes, double maxSeconds) noexcept;
+
+	bool isExhausted() const noexcept;
+	void consume(size_t n) noexcept {bytes = (n < bytes) ? (bytes - n) : 0;}
+};
+
+class CGLUploadRing; // forward glupload.h
+
+struct TGLImageTile {
+	GLuint tex[3];		/* Y or RGB(A), Cb, Cr */
+	GLsizei pos[2];		/* the part of the image this tile is responsible for */
+	GLsizei size[2];
+	GLsizei texPos[2];	/* the part of the image in the textures, including the border */
+	GLsizei texSize[2];
+	float chromaScale[2];	/* scale from luma to chroma texture coordinates */
+	GLint levels[3];	/* mip levels of the textures */
+	GLint baseLevel;	/* finest level of the first texture uploaded so far */
+	GLint rank;		/* upload progress: levels[p] - 1 - rank is the next level of each plane */
+	GLsizei row;		/* next row of the level currently uploaded */
+	size_t plane;		/* plane currently uploaded */
+	bool ready;		/* the coarsest levels arrived on the GPU */
+	GLsync fence;		/* upload still in flight */
+
+	TGLImageTile() noexcept :
+		tex{0, 0, 0},
+		pos{0, 0},
+		size{0, 0},
+		texPos{0, 0},
+		texSize{0, 0},
+		chromaScale{1.0f, 1.0f},
+		levels{0, 0, 0},
+		baseLevel(0),
+		rank(0),
+		row(0),
+		plane(0),
+		ready(false),
+		fence(NULL)
+	{}
+
+	bool isResident() const noexcept {return (tex[0] != 0);}
+	bool isReady() const noexcept {return (tex[0] != 0 && ready);}
+	bool isComplete() const noexcept {return (tex[0] != 0 && rank >= levels[0]);}
+};
 
 class CGLImage {
 	private:
-		GLuint tex;
+		static const GLint maxLevels = 32;
+
+		struct TMipLevel {
+			const unsigned char *data;
+			GLsizei w;
+			GLsizei h;
+			size_t stride;
+		};
+
+		std::vector<TGLImageTile> tiles;
+		CImage source;
+		CGLUploadRing *ring;
 		GLsizei width;
 		GLsizei height;
 		GLenum	internalFormat;
+		GLenum	format;
+		GLenum	dataType;
+		TImageLayout layout;
+		bool tiled;
 
-		void createTex(GLsizei w, GLsizei h, GLsizei ifmt) noexcept;
+		/* the mip chains of the tile currently uploaded, level 0
+		 * points into source, the others into mipMem */
+		TMipLevel mips[3][maxLevels];
+		unsigned char *mipMem;
+		size_t mipTile;
+
+		GLuint createTex(GLsizei w, GLsizei h, GLsizei ifmt, GLint levels) noexcept;
+		bool getPlaneRect(const TGLImageTile& t, size_t p, size_t rect[4]) const noexcept;
+		bool createTile(TGLImageTile& t) noexcept;
+		bool prepareMips(size_t idx) noexcept;
+		void freeMips() noexcept;
+		bool continueTile(size_t idx, TGLUploadBudget& budget) noexcept;
+		void pollTile(TGLImageTile& t) noexcept;
+		void dropTile(TGLImageTile& t) noexcept;
 
 	public:
 		CGLImage() noexcept;
@@ -25,9 +132,33 @@ class CGLImage {
 		void drop() noexcept;
 		void reset() noexcept;
 
-		bool create(const CImage& img) noexcept;
+		/* maxSize: maximum texture size, larger images are tiled (0: no limit)
+		 * uploadRing: stream the data through this ring (NULL: direct upload)
+		 * The pixel data is not uploaded yet, see upload(). */
+		bool create(const CImage& img, GLsizei maxSize=0, CGLUploadRing *uploadRing=NULL) noexcept;
+
+		/* make the tiles intersecting the region (x0, y0, x1, y1 in image
+		 * pixels) resident, and drop the others. Also checks the fences of
+		 * pending uploads. Returns the number of resident tiles. */
+		size_t updateResidency(const double region[4]) noexcept;
+
+		/* continue uploading the resident tiles within the budget,
+		 * returns true when all of them are complete */
+		bool upload(TGLUploadBudget& budget) noexcept;
+		/* true while a resident tile is incomplete or not ready for drawing */
+		bool isUploadPending() const noexcept;
+
+		/* for images handed over from another context: continue with
+		 * the ring of this one */
+		void setUploadRing(CGLUploadRing *uploadRing) noexcept;
 
-		GLuint getTex() const noexcept { return tex; }
+		GLuint getTex(size_t plane=0) const noexcept { return (tiles.empty() || plane > 2) ? 0 : tiles[0].tex[plane]; }
+		TImageLayout getLayout() const noexcept { return layout; }
+		bool isTiled() const noexcept { return tiled; }
+		GLsizei getWidth() const noexcept { return width; }
+		GLsizei getHeight() const noexcept { return height; }
+		size_t getTileCount() const noexcept { return tiles.size(); }
+		const TGLImageTile& getTile(size_t idx) const noexcept { return tiles[idx]; }
 };
 
 #endif /* !FASTCROP_GLIMAGE_H */
@@ -0,0 +1,270 @@
+#include "glprogram.h"
+#include "scratch.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* header of the cache files, followed by the program binary */
+struct TGLProgramFileHeader {
+	char magic[4];
+	uint32_t format;
+	uint64_t hash;
+	uint32_t size;
+	uint32_t reserved;
+};
+
+static const char glProgramFileMagic[4] = {'F', 'C', 'P', 'B'};
+
+/* sanity limit for the size of a cached binary */
+static const uint32_t glProgramMaxBinarySize = 64U * 1024U * 1024U;
+
+/* FNV-1a */
+static uint64_t hashString(uint64_t h, const char *str) noexcept
+{
+	if (str) {
+		while (*str) {
+			h ^= (uint64_t)(unsigned char)*str++;
+			h *= 0x100000001b3ULL;
+		}
+	}
+	/* hash the terminator too, so the concatenation of strings is unique */
+	h *= 0x100000001b3ULL;
+	return h;
+}
+
+CGLProgramCache::CGLProgramCache() noexcept :
+	driverHash(0),
+	parallel(false)
+{
+}
+
+void CGLProgramCache::initGL() noexcept
+{
+	driverHash = 0xcbf29ce484222325ULL;
+	driverHash = hashString(driverHash, (const char*)glGetString(GL_VENDOR));
+	driverHash = hashString(driverHash, (const char*)glGetString(GL_RENDERER));
+	driverHash = hashString(driverHash, (const char*)glGetString(GL_VERSION));
+	driverHash = hashString(driverHash, (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION));
+
+	dir.clear();
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	if (formats > 0) {
+		char buf[4096];
+		if (util::getCacheDir(buf, sizeof(buf), "shaders")) {
+			try {
+				dir = buf;
+			} catch (...) {
+				dir.clear();
+			}
+		}
+	}
+	if (dir.empty()) {
+		util::info("GL program binary cache not available");
+	} else {
+		util::info("GL program binary cache: %s", dir.c_str());
+	}
+
+	if (GLAD_GL_KHR_parallel_shader_compile) {
+		glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+		parallel = true;
+	} else if (GLAD_GL_ARB_parallel_shader_compile) {
+		glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+		parallel = true;
+	} else {
+		parallel = false;
+	}
+	if (parallel) {
+		util::info("using parallel shader compilation");
+	}
+}
+
+uint64_t CGLProgramCache::getHash(const TGLProgramSource& src) const noexcept
+{
+	uint64_t h = driverHash;
+	h = hashString(h, src.vs);
+	h = hashString(h, src.fs);
+	return h;
+}
+
+std::string CGLProgramCache::getFilename(uint64_t hash) const
+{
+	char name[32];
+	mysnprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)hash);
+	return dir + name;
+}
+
+GLuint CGLProgramCache::loadBinary(uint64_t hash) noexcept
+{
+	if (dir.empty()) {
+		return 0;
+	}
+
+	CScratchScope scratch;
+	FILE *file = NULL;
+	try {
+		file = util::fopen_wrapper(getFilename(hash).c_str(), "rb");
+	} catch (...) {
+		return 0;
+	}
+	if (!file) {
+		return 0;
+	}
+
+	TGLProgramFileHeader hdr;
+	void *data = NULL;
+	if (fread(&hdr, sizeof(hdr), 1, file) == 1 && !memcmp(hdr.magic, glProgramFileMagic, sizeof(hdr.magic)) &&
+	    hdr.hash == hash && hdr.size > 0 && hdr.size <= glProgramMaxBinarySize) {
+		data = scratch.getArena().allocate(hdr.size);
+		if (data && fread(data, 1, hdr.size, file) != hdr.size) {
+			data = NULL;
+		}
+	}
+	fclose(file);
+	if (!data) {
+		util::warn("ignoring invalid GL program binary %016llx", (unsigned long long)hash);
+		return 0;
+	}
+
+	GLint status = GL_FALSE;
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, (GLenum)hdr.format, data, (GLsizei)hdr.size);
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE) {
+		/* the driver rejects it, just build it again */
+		debug("GL program binary %016llx rejected", (unsigned long long)hash);
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+void CGLProgramCache::saveBinary(GLuint program, uint64_t hash) noexcept
+{
+	if (dir.empty()) {
+		return;
+	}
+
+	CScratchScope scratch;
+	GLint len = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &len);
+	if (len < 1) {
+		return;
+	}
+	void *data = scratch.getArena().allocate((size_t)len);
+	if (!data) {
+		return;
+	}
+	GLsizei got = 0;
+	GLenum format = GL_NONE;
+	glGetProgramBinary(program, (GLsizei)len, &got, &format, data);
+	if (got < 1) {
+		return;
+	}
+
+	TGLProgramFileHeader hdr;
+	memcpy(hdr.magic, glProgramFileMagic, sizeof(hdr.magic));
+	hdr.format = (uint32_t)format;
+	hdr.hash = hash;
+	hdr.size = (uint32_t)got;
+	hdr.reserved = 0;
+
+	/* write to a temporary file first, so that concurrent instances never
+	 * see a partial file */
+	try {
+		std::string name = getFilename(hash);
+		std::string tmp = name + ".tmp";
+		FILE *file = util::fopen_wrapper(tmp.c_str(), "wb");
+		if (!file) {
+			util::warn("failed to write GL program binary '%s'", tmp.c_str());
+			return;
+		}
+		bool success = (fwrite(&hdr, sizeof(hdr), 1, file) == 1 && fwrite(data, 1, (size_t)got, file) == (size_t)got);
+		success = (fclose(file) == 0) && success;
+#ifdef WIN32
+		remove(name.c_str());
+#endif
+		if (!success || rename(tmp.c_str(), name.c_str())) {
+			util::warn("failed to write GL program binary '%s'", name.c_str());
+			remove(tmp.c_str());
+		}
+	} catch (...) {
+		util::warn("failed to write GL program binary");
+	}
+}
+
+bool CGLProgramCache::createPrograms(const TGLProgramSource *src, GLuint *programs, size_t count) noexcept
+{
+	CScratchScope scratch;
+	uint64_t *hash = (uint64_t*)scratch.getArena().allocate(sizeof(uint64_t) * count);
+	GLuint *shaders = (GLuint*)scratch.getArena().allocate(sizeof(GLuint) * 2 * count);
+	if (!hash || !shaders) {
+		return false;
+	}
+
+	/* first pass: get the cached binaries, start building the others */
+	size_t cached = 0;
+	for (size_t i = 0; i < count; i++) {
+		shaders[2*i] = shaders[2*i+1] = 0;
+		programs[i] = 0;
+		if (!src[i].vs || !src[i].fs) {
+			continue;
+		}
+		hash[i] = getHash(src[i]);
+		programs[i] = loadBinary(hash[i]);
+		if (programs[i]) {
+			cached++;
+			continue;
+		}
+		GLuint *s = shaders + 2*i;
+		s[0] = glCreateShader(GL_VERTEX_SHADER);
+		s[1] = glCreateShader(GL_FRAGMENT_SHADER);
+		glShaderSource(s[0], 1, (const GLchar**)&src[i].vs, NULL);
+		glShaderSource(s[1], 1, (const GLchar**)&src[i].fs, NULL);
+		glCompileShader(s[0]);
+		glCompileShader(s[1]);
+		programs[i] = glCreateProgram();
+		glAttachShader(programs[i], s[0]);
+		glAttachShader(programs[i], s[1]);
+		glBindFragDataLocation(programs[i], 0, "color");
+		if (!dir.empty()) {
+			glProgramParameteri(programs[i], GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		}
+		glLinkProgram(programs[i]);
+	}
+
+	/* second pass: wait for the results */
+	bool success = true;
+	for (size_t i = 0; i < count; i++) {
+		GLuint *s = shaders + 2*i;
+		if (!s[0]) {
+			if (!programs[i]) {
+				success = false;
+			}
+			continue;
+		}
+		GLint status = GL_FALSE;
+		glGetProgramiv(programs[i], GL_LINK_STATUS, &status);
+		if (status != GL_TRUE) {
+			util::warn("failed to build program '%s'", src[i].name);
+			for (int j = 0; j < 2; j++) {
+				glGetShaderiv(s[j], GL_COMPILE_STATUS, &status);
+				if (status != GL_TRUE) {
+					util::printInfoLog(s[j], false);
+				}
+			}
+			util::printInfoLog(programs[i], true);
+			glDeleteProgram(programs[i]);
+			programs[i] = 0;
+			success = false;
+		} else {
+			saveBinary(programs[i], hash[i]);
+		}
+		glDeleteShader(s[0]);
+		glDeleteShader(s[1]);
+	}
+	util::info("created %u GL programs, %u from the binary cache", (unsigned)count, (unsigned)cached);
+	return success;
+}
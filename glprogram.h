@@ -0,0 +1,44 @@
+#ifndef FASTCROP_GLPROGRAM_H
+#define FASTCROP_GLPROGRAM_H
+
+#include <glad/gl.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+/* Builds GL programs from vertex and fragment shader sources. Linked
+ * programs are stored via glGetProgramBinary in the cache directory, keyed
+ * by a hash of the driver identification and the shader sources, and are
+ * loaded from there on the next start. Without a matching binary, all
+ * programs are compiled and linked before the first result is queried, so
+ * a GL with GL_KHR_parallel_shader_compile can work on them concurrently. */
+
+struct TGLProgramSource {
+	const char *name;	/* for messages */
+	const char *vs;		/* NULL: program is skipped */
+	const char *fs;
+};
+
+class CGLProgramCache {
+	private:
+		std::string dir;	/* empty: no binary cache */
+		uint64_t driverHash;
+		bool parallel;
+
+		uint64_t getHash(const TGLProgramSource& src) const noexcept;
+		std::string getFilename(uint64_t hash) const;
+		GLuint loadBinary(uint64_t hash) noexcept;
+		void saveBinary(GLuint program, uint64_t hash) noexcept;
+
+	public:
+		CGLProgramCache() noexcept;
+
+		void initGL() noexcept;
+
+		/* create count programs, failed ones are 0,
+		 * returns true if all programs were created */
+		bool createPrograms(const TGLProgramSource *src, GLuint *programs, size_t count) noexcept;
+};
+
+#endif /* !FASTCROP_GLPROGRAM_H */
@@ -0,0 +1,179 @@
+#include "gltimer.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+CGLTimers::CGLTimers() noexcept :
+	cur(0),
+	activePass(-1),
+	valid(false)
+{
+	memset(slots, 0, sizeof(slots));
+	resetStats();
+}
+
+CGLTimers::~CGLTimers() noexcept
+{
+	dropGL();
+}
+
+bool CGLTimers::initGL() noexcept
+{
+	dropGL();
+	for (unsigned int s = 0; s < slotCount; s++) {
+		glGenQueries(GL_TIMER_PASS_COUNT * maxIntervals, &slots[s].query[0][0]);
+		memset(slots[s].used, 0, sizeof(slots[s].used));
+		slots[s].busy = false;
+	}
+	cur = 0;
+	activePass = -1;
+	valid = true;
+	resetStats();
+	return true;
+}
+
+void CGLTimers::dropGL() noexcept
+{
+	if (valid) {
+		if (activePass >= 0) {
+			glEndQuery(GL_TIME_ELAPSED);
+			activePass = -1;
+		}
+		for (unsigned int s = 0; s < slotCount; s++) {
+			glDeleteQueries(GL_TIMER_PASS_COUNT * maxIntervals, &slots[s].query[0][0]);
+		}
+		memset(slots, 0, sizeof(slots));
+		valid = false;
+	}
+}
+
+/* add the results of a finished slot to the history, results which are
+ * not available yet stay in the slot, so we never wait for the GPU */
+void CGLTimers::collect(TSlot& slot) noexcept
+{
+	bool pending = false;
+	for (int p = 0; p < (int)GL_TIMER_PASS_COUNT; p++) {
+		unsigned int used = slot.used[p];
+		if (!used) {
+			continue;
+		}
+		GLuint available = GL_FALSE;
+		glGetQueryObjectuiv(slot.query[p][used - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available != GL_TRUE) {
+			pending = true;
+			continue;
+		}
+		slot.used[p] = 0;
+		GLuint64 sum = 0;
+		for (unsigned int i = 0; i < used; i++) {
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(slot.query[p][i], GL_QUERY_RESULT, &ns);
+			sum += ns;
+		}
+		history[p][historyPos[p]] = (float)((double)sum / 1.0e6);
+		historyPos[p] = (historyPos[p] + 1) % historySize;
+		if (historyCount[p] < historySize) {
+			historyCount[p]++;
+		}
+	}
+	slot.busy = pending;
+}
+
+void CGLTimers::nextFrame() noexcept
+{
+	if (!valid) {
+		return;
+	}
+	if (activePass >= 0) {
+		end((TGLTimerPass)activePass);
+	}
+	slots[cur].busy = true;
+	/* oldest first */
+	for (unsigned int i = 1; i <= slotCount; i++) {
+		TSlot& slot = slots[(cur + i) % slotCount];
+		if (slot.busy) {
+			collect(slot);
+		}
+	}
+	cur = (cur + 1) % slotCount;
+}
+
+void CGLTimers::begin(TGLTimerPass pass) noexcept
+{
+	if (!valid || activePass >= 0 || pass >= GL_TIMER_PASS_COUNT) {
+		return;
+	}
+	TSlot& slot = slots[cur];
+	if (slot.busy || slot.used[pass] >= maxIntervals) {
+		/* still waiting for the results of an earlier frame */
+		return;
+	}
+	glBeginQuery(GL_TIME_ELAPSED, slot.query[pass][slot.used[pass]]);
+	activePass = (int)pass;
+}
+
+void CGLTimers::end(TGLTimerPass pass) noexcept
+{
+	if (activePass != (int)pass) {
+		return;
+	}
+	glEndQuery(GL_TIME_ELAPSED);
+	slots[cur].used[pass]++;
+	activePass = -1;
+}
+
+void CGLTimers::getStats(TGLTimerPass pass, TGLTimerStats& stats) const noexcept
+{
+	stats = TGLTimerStats();
+	if (pass >= GL_TIMER_PASS_COUNT || !historyCount[pass]) {
+		return;
+	}
+	size_t n = historyCount[pass];
+	float sorted[historySize];
+	memcpy(sorted, history[pass], n * sizeof(float));
+	std::sort(sorted, sorted + n);
+
+	double sum = 0.0;
+	for (size_t i = 0; i < n; i++) {
+		sum += (double)sorted[i];
+	}
+	stats.samples = n;
+	stats.minMS = (double)sorted[0];
+	stats.avgMS = sum / (double)n;
+	stats.p99MS = (double)sorted[((n - 1) * 99) / 100];
+}
+
+void CGLTimers::resetStats() noexcept
+{
+	memset(history, 0, sizeof(history));
+	memset(historyCount, 0, sizeof(historyCount));
+	memset(historyPos, 0, sizeof(historyPos));
+}
+
+void CGLTimers::logStats() const noexcept
+{
+	for (int p = 0; p < (int)GL_TIMER_PASS_COUNT; p++) {
+		TGLTimerStats stats;
+		getStats((TGLTimerPass)p, stats);
+		if (stats.samples) {
+			util::info("GPU %s: min %.3fms, avg %.3fms, p99 %.3fms (%u frames)", getPassName((TGLTimerPass)p),
+				stats.minMS, stats.avgMS, stats.p99MS, (unsigned)stats.samples);
+		}
+	}
+}
+
+const char *CGLTimers::getPassName(TGLTimerPass pass) noexcept
+{
+	switch(pass) {
+		case GL_TIMER_UPLOAD:
+			return "upload";
+		case GL_TIMER_IMAGE:
+			return "image";
+		case GL_TIMER_CROPLINE:
+			return "crop line";
+		default:
+			return "unknown";
+	}
+}
@@ -0,0 +1,87 @@
+#ifndef FASTCROP_GLTIMER_H
+#define FASTCROP_GLTIMER_H
+
+#include <glad/gl.h>
+#include <stddef.h>
+
+/* GPU time measurement with GL_TIME_ELAPSED queries. The queries of a frame
+ * go to one of a ring of slots, their results are collected in the
+ * following frames as soon as they are available, so the measurement never
+ * stalls the pipeline. Slow frames are not dropped because their results
+ * come late: a frame whose slot still waits for its results is not
+ * measured at all, which does not bias the statistics.
+ * A pass may be measured several times per frame (the intervals are summed
+ * up), but the intervals of different passes must not overlap.
+ * Frames in which a pass was not executed don't count for its statistics. */
+
+enum TGLTimerPass {
+	GL_TIMER_UPLOAD = 0,	/* texture uploads on the render thread */
+	GL_TIMER_IMAGE,		/* the image pass of CRenderer */
+	GL_TIMER_CROPLINE,	/* the crop line pass of CRenderer */
+	GL_TIMER_PASS_COUNT // end marker
+};
+
+struct TGLTimerStats {
+	size_t samples;		/* frames in the statistics */
+	double minMS;
+	double avgMS;
+	double p99MS;
+
+	TGLTimerStats() noexcept :
+		samples(0),
+		minMS(0.0),
+		avgMS(0.0),
+		p99MS(0.0)
+	{}
+};
+
+class CGLTimers {
+	private:
+		static const unsigned int maxIntervals = 8;	/* per pass and frame */
+		static const size_t historySize = 256;		/* frames in the statistics */
+		static const unsigned int slotCount = 4;	/* frames in flight */
+
+		struct TSlot {
+			GLuint query[GL_TIMER_PASS_COUNT][maxIntervals];
+			unsigned int used[GL_TIMER_PASS_COUNT];
+			bool busy;	/* the frame is done, results pending */
+		};
+
+		TSlot slots[slotCount];
+		unsigned int cur;
+		int activePass;		/* -1: none */
+		bool valid;
+
+		float history[GL_TIMER_PASS_COUNT][historySize];
+		size_t historyCount[GL_TIMER_PASS_COUNT];
+		size_t historyPos[GL_TIMER_PASS_COUNT];
+
+		void collect(TSlot& slot) noexcept;
+
+	public:
+		CGLTimers() noexcept;
+		~CGLTimers() noexcept;
+
+		CGLTimers(const CGLTimers& other) = delete;
+		CGLTimers(CGLTimers&& other) = delete;
+		CGLTimers& operator=(const CGLTimers& other) = delete;
+		CGLTimers& operator=(CGLTimers&& other) = delete;
+
+		bool initGL() noexcept;
+		void dropGL() noexcept;
+
+		/* call once at the start of each frame */
+		void nextFrame() noexcept;
+
+		void begin(TGLTimerPass pass) noexcept;
+		void end(TGLTimerPass pass) noexcept;
+
+		/* statistics over the last frames the pass was executed in */
+		void getStats(TGLTimerPass pass, TGLTimerStats& stats) const noexcept;
+		void resetStats() noexcept;
+		void logStats() const noexcept;
+
+		static const char *getPassName(TGLTimerPass pass) noexcept;
+};
+
+#endif /* !FASTCROP_GLTIMER_H */
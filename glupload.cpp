@@ -0,0 +1,208 @@
+#include "glupload.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* wait at most one second for the GPU to release ring space */
+static const GLuint64 glUploadWaitTimeout = 1000000000ULL;
+
+CGLUploadRing::CGLUploadRing() noexcept :
+	pbo(0),
+	mem(NULL),
+	size(0),
+	head(0),
+	batchStart(0)
+{
+}
+
+CGLUploadRing::~CGLUploadRing() noexcept
+{
+	dropGL();
+}
+
+bool CGLUploadRing::initGL(size_t ringSize) noexcept
+{
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+	dropGL();
+	glCreateBuffers(1, &pbo);
+	glNamedBufferStorage(pbo, (GLsizeiptr)ringSize, NULL, flags);
+	mem = (unsigned char*)glMapNamedBufferRange(pbo, 0, (GLsizeiptr)ringSize, flags);
+	if (!mem) {
+		util::warn("failed to map %u MiB upload buffer", (unsigned)(ringSize / (1024U*1024U)));
+		dropGL();
+		return false;
+	}
+	size = ringSize;
+	head = 0;
+	batchStart = 0;
+	util::info("using %u MiB persistently mapped upload buffer", (unsigned)(ringSize / (1024U*1024U)));
+	return true;
+}
+
+void CGLUploadRing::dropGL() noexcept
+{
+	for (size_t i=0; i<batches.size(); i++) {
+		glDeleteSync(batches[i].fence);
+	}
+	batches.clear();
+	if (pbo) {
+		if (mem) {
+			glUnmapNamedBuffer(pbo);
+		}
+		glDeleteBuffers(1, &pbo);
+		pbo = 0;
+	}
+	mem = NULL;
+	size = 0;
+	head = 0;
+	batchStart = 0;
+}
+
+void CGLUploadRing::retire(bool wait) noexcept
+{
+	while (!batches.empty()) {
+		TBatch& b = batches.front();
+		GLenum res;
+		if (wait) {
+			res = glClientWaitSync(b.fence, GL_SYNC_FLUSH_COMMANDS_BIT, glUploadWaitTimeout);
+			wait = false;
+		} else {
+			res = glClientWaitSync(b.fence, 0, 0);
+		}
+		if (res == GL_TIMEOUT_EXPIRED) {
+			break;
+		}
+		glDeleteSync(b.fence);
+		batches.pop_front();
+	}
+}
+
+/* Get a contiguous part of the ring of at least minBytes and at most
+ * maxBytes, in multiples of granularity. The ring is a FIFO: the free space
+ * is between head and the start of the oldest batch still in flight. */
+unsigned char* CGLUploadRing::allocate(size_t minBytes, size_t maxBytes, size_t granularity, size_t& got) noexcept
+{
+	if (!mem || minBytes > size - 16) {
+		return NULL;
+	}
+
+	while (true) {
+		retire(false);
+		if (batches.empty() && head == batchStart) {
+			/* nothing in flight, start over */
+			head = batchStart = 0;
+		}
+		size_t pos = (head + 15) & ~(size_t)15;
+		size_t avail = 0;
+		if (batches.empty() || head >= batches.front().start) {
+			/* free: [head, size) and [0, oldest) */
+			if (pos < size && size - pos >= minBytes) {
+				avail = size - pos;
+			} else if (!batches.empty() && minBytes < batches.front().start) {
+				/* wrap around, the batches must stay contiguous */
+				pushBatch();
+				head = batchStart = 0;
+				continue;
+			}
+		} else {
+			/* free: [head, oldest) */
+			size_t tail = batches.front().start;
+			if (pos < tail && tail - pos > minBytes) {
+				avail = tail - pos - 1;
+			}
+		}
+
+		if (avail >= minBytes) {
+			if (avail > maxBytes) {
+				avail = maxBytes;
+			}
+			got = avail - (avail % granularity);
+			head = pos + got;
+			return mem + pos;
+		}
+
+		/* the ring is full: wait for the GPU */
+		pushBatch();
+		if (batches.empty()) {
+			head = batchStart = 0;
+		} else {
+			stats.waits++;
+			retire(true);
+		}
+	}
+}
+
+bool CGLUploadRing::upload(GLint level, GLint x, GLint y, GLsizei w, GLsizei h, GLenum format, GLenum type,
+			   const unsigned char *src, size_t stride, size_t pixelSize) noexcept
+{
+	size_t rowBytes = (size_t)w * pixelSize;
+	GLsizei done = 0;
+
+	if (!mem || !src || !rowBytes) {
+		return false;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+	while (done < h) {
+		size_t got;
+		unsigned char *ptr = allocate(rowBytes, rowBytes * (size_t)(h - done), rowBytes, got);
+		if (!ptr) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			return false;
+		}
+		GLsizei rows = (GLsizei)(got / rowBytes);
+		const unsigned char *s = src + (size_t)done * stride;
+		if (stride == rowBytes) {
+			memcpy(ptr, s, got);
+		} else {
+			for (GLsizei r = 0; r < rows; r++) {
+				memcpy(ptr + (size_t)r * rowBytes, s + (size_t)r * stride, rowBytes);
+			}
+		}
+		glTexSubImage2D(GL_TEXTURE_2D, level, x, y + done, w, rows, format, type, (const void*)(uintptr_t)(ptr - mem));
+		stats.bytes += got;
+		done += rows;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	return true;
+}
+
+void CGLUploadRing::pushBatch() noexcept
+{
+	if (head != batchStart) {
+		TBatch b;
+		b.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		b.start = batchStart;
+		b.end = head;
+		try {
+			batches.push_back(b);
+		} catch (...) {
+			/* can't track it, wait right now */
+			glClientWaitSync(b.fence, GL_SYNC_FLUSH_COMMANDS_BIT, glUploadWaitTimeout);
+			glDeleteSync(b.fence);
+		}
+		batchStart = head;
+		stats.batches++;
+	}
+}
+
+GLsync CGLUploadRing::fence() noexcept
+{
+	pushBatch();
+	return glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+extern bool glFenceSignaled(GLsync& fence) noexcept
+{
+	if (!fence) {
+		return true;
+	}
+	GLenum res = glClientWaitSync(fence, 0, 0);
+	if (res == GL_TIMEOUT_EXPIRED) {
+		return false;
+	}
+	glDeleteSync(fence);
+	fence = NULL;
+	return true;
+}
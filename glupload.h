@@ -0,0 +1,77 @@
+#ifndef FASTCROP_GLUPLOAD_H
+#define FASTCROP_GLUPLOAD_H
+
+#include <glad/gl.h>
+#include <stddef.h>
+
+#include <deque>
+
+/* Streaming texture uploads through a persistently mapped pixel buffer
+ * object. The pixel data is written into the mapped ring, and the texture
+ * update is sourced from the PBO, so glTexSubImage2D does not have to copy
+ * the data synchronously. Each batch of uploads is guarded by a fence, the
+ * ring memory is only reused after the GPU consumed it. Uploads larger than
+ * the ring are split into bands of rows. */
+
+struct TGLUploadStats {
+	size_t bytes;		/* bytes uploaded via the ring */
+	size_t batches;		/* number of fences inserted */
+	size_t waits;		/* times we had to wait for the GPU to free ring space */
+
+	TGLUploadStats() noexcept :
+		bytes(0),
+		batches(0),
+		waits(0)
+	{}
+};
+
+class CGLUploadRing {
+	private:
+		struct TBatch {
+			GLsync fence;
+			size_t start;
+			size_t end;
+		};
+
+		GLuint pbo;
+		unsigned char *mem;
+		size_t size;
+		size_t head;		/* next free byte */
+		size_t batchStart;	/* start of the allocations not yet fenced */
+		std::deque<TBatch> batches;
+		TGLUploadStats stats;
+
+		void pushBatch() noexcept;
+		void retire(bool wait) noexcept;
+		unsigned char* allocate(size_t bytes, size_t maxBytes, size_t granularity, size_t& got) noexcept;
+
+	public:
+		CGLUploadRing() noexcept;
+		~CGLUploadRing() noexcept;
+
+		CGLUploadRing(const CGLUploadRing& other) = delete;
+		CGLUploadRing(CGLUploadRing&& other) = delete;
+		CGLUploadRing& operator=(const CGLUploadRing& other) = delete;
+		CGLUploadRing& operator=(CGLUploadRing&& other) = delete;
+
+		bool initGL(size_t ringSize) noexcept;
+		void dropGL() noexcept;
+		bool isValid() const noexcept {return (mem != NULL);}
+
+		/* upload a rectangle of w x h pixels to a level of the bound
+		 * GL_TEXTURE_2D, src points to the first pixel, stride is the
+		 * source row size */
+		bool upload(GLint level, GLint x, GLint y, GLsizei w, GLsizei h, GLenum format, GLenum type,
+			    const unsigned char *src, size_t stride, size_t pixelSize) noexcept;
+
+		/* fence all uploads issued so far, returns an additional fence
+		 * the caller owns (can be used to check if the data arrived) */
+		GLsync fence() noexcept;
+
+		const TGLUploadStats& getStats() const noexcept {return stats;}
+};
+
+/* non-blocking check of a fence, deletes it and sets it to NULL when signaled */
+extern bool glFenceSignaled(GLsync& fence) noexcept;
+
+#endif /* !FASTCROP_GLUPLOAD_H */
@@ -0,0 +1,167 @@
+#include "glworker.h"
+#include "glupload.h"
+#include "util.h"
+
+#include <GLFW/glfw3.h>
+
+#include <utility>
+
+/* size of the persistently mapped upload buffer of the worker */
+static const size_t glWorkerRingSize = 32U * 1024U * 1024U;
+
+CGLUploadWorker::CGLUploadWorker() noexcept :
+	win(NULL),
+	nextTicket(1),
+	stopRequested(false)
+{
+}
+
+CGLUploadWorker::~CGLUploadWorker() noexcept
+{
+	stop();
+}
+
+bool CGLUploadWorker::start(GLFWwindow *sharedWin) noexcept
+{
+	if (isRunning() || !sharedWin) {
+		return false;
+	}
+	win = sharedWin;
+	stopRequested = false;
+	try {
+		thread = std::thread(&CGLUploadWorker::run, this);
+	} catch (...) {
+		util::warn("failed to start GL upload thread");
+		win = NULL;
+		return false;
+	}
+	return true;
+}
+
+void CGLUploadWorker::stop() noexcept
+{
+	if (!isRunning()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopRequested = true;
+	}
+	cond.notify_all();
+	thread.join();
+
+	jobs.clear();
+	for (size_t i=0; i<results.size(); i++) {
+		results[i].glImage.drop();
+		if (results[i].fence) {
+			glDeleteSync(results[i].fence);
+		}
+	}
+	results.clear();
+	win = NULL;
+}
+
+void CGLUploadWorker::run() noexcept
+{
+	CGLUploadRing ring;
+
+	glfwMakeContextCurrent(win);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	ring.initGL(glWorkerRingSize);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		cond.wait(lock, [this]{return stopRequested || !jobs.empty();});
+		if (stopRequested) {
+			break;
+		}
+		TJob job = std::move(jobs.front());
+		jobs.pop_front();
+		lock.unlock();
+
+		TGLWorkerResult r;
+		r.ticket = job.ticket;
+		r.user = job.user;
+		r.success = r.glImage.create(job.image, job.maxSize, &ring);
+		if (r.success) {
+			TGLUploadBudget unlimited;
+			r.glImage.upload(unlimited);
+		}
+		job.image.reset();
+		/* the render thread waits for this before using the textures,
+		 * we wait for it here, so the result is usable when the main
+		 * loop wakes up */
+		r.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glClientWaitSync(r.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+
+		lock.lock();
+		try {
+			results.push_back(std::move(r));
+			glfwPostEmptyEvent();
+		} catch (...) {
+			util::warn("GL upload thread: failed to queue result");
+			glClientWaitSync(r.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+			glDeleteSync(r.fence);
+			r.glImage.drop();
+		}
+	}
+	lock.unlock();
+
+	ring.dropGL();
+	glfwMakeContextCurrent(NULL);
+}
+
+unsigned int CGLUploadWorker::submit(const CImage& img, GLsizei maxSize, void *user) noexcept
+{
+	if (!isRunning()) {
+		return 0;
+	}
+	unsigned int ticket;
+	TJob job;
+	job.user = user;
+	job.image = img;
+	job.maxSize = maxSize;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ticket = nextTicket++;
+		if (!nextTicket) {
+			nextTicket = 1;
+		}
+		job.ticket = ticket;
+		try {
+			jobs.push_back(std::move(job));
+		} catch (...) {
+			return 0;
+		}
+	}
+	cond.notify_one();
+	return ticket;
+}
+
+void CGLUploadWorker::cancel(unsigned int ticket) noexcept
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (std::deque<TJob>::iterator it = jobs.begin(); it != jobs.end(); it++) {
+		if (it->ticket == ticket) {
+			jobs.erase(it);
+			return;
+		}
+	}
+}
+
+bool CGLUploadWorker::fetch(TGLWorkerResult& result) noexcept
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (results.empty() || !glFenceSignaled(results.front().fence)) {
+		return false;
+	}
+	result = std::move(results.front());
+	results.pop_front();
+	return true;
+}
+
+bool CGLUploadWorker::hasResults() noexcept
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return !results.empty();
+}
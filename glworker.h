@@ -0,0 +1,88 @@
+#ifndef FASTCROP_GLWORKER_H
+#define FASTCROP_GLWORKER_H
+
+#include <glad/gl.h>
+
+#include "glimage.h"
+#include "image.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/* Creates and fills GL images on a separate thread. The thread owns a GL
+ * context which shares its objects with the render context (the context of
+ * a hidden window). The render thread submits images and gets back CGLImage
+ * objects ready for drawing: fetch() only returns a result after the fence
+ * the worker inserted behind the uploads signaled. The worker wakes up the
+ * main loop with glfwPostEmptyEvent() when a result arrives.
+ *
+ * Each job is identified by a ticket. Queued jobs can be cancelled, the
+ * result of a job which is already running has to be dropped by the
+ * receiver. */
+
+struct GLFWwindow; // forward GLFW/glfw3.h
+
+struct TGLWorkerResult {
+	unsigned int ticket;
+	void *user;		/* as passed to submit() */
+	CGLImage glImage;
+	GLsync fence;
+	bool success;
+
+	TGLWorkerResult() noexcept :
+		ticket(0),
+		user(NULL),
+		fence(NULL),
+		success(false)
+	{}
+};
+
+class CGLUploadWorker {
+	private:
+		struct TJob {
+			unsigned int ticket;
+			void *user;
+			CImage image;
+			GLsizei maxSize;
+		};
+
+		GLFWwindow *win;
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::deque<TJob> jobs;
+		std::deque<TGLWorkerResult> results;
+		unsigned int nextTicket;
+		bool stopRequested;
+
+		void run() noexcept;
+
+	public:
+		CGLUploadWorker() noexcept;
+		~CGLUploadWorker() noexcept;
+
+		CGLUploadWorker(const CGLUploadWorker& other) = delete;
+		CGLUploadWorker(CGLUploadWorker&& other) = delete;
+		CGLUploadWorker& operator=(const CGLUploadWorker& other) = delete;
+		CGLUploadWorker& operator=(CGLUploadWorker&& other) = delete;
+
+		/* sharedWin: window whose context shares the objects of the
+		 * render context, it is made current on the worker thread */
+		bool start(GLFWwindow *sharedWin) noexcept;
+		/* must be called with the render context current, so that the
+		 * results not fetched yet can be deleted */
+		void stop() noexcept;
+		bool isRunning() const noexcept {return thread.joinable();}
+
+		/* queue an image, returns the ticket, 0 on failure */
+		unsigned int submit(const CImage& img, GLsizei maxSize, void *user) noexcept;
+		void cancel(unsigned int ticket) noexcept;
+
+		/* get the next finished image, non-blocking */
+		bool fetch(TGLWorkerResult& result) noexcept;
+		bool hasResults() noexcept;
+};
+
+#endif /* !FASTCROP_GLWORKER_H */
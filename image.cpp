@@ -4,9 +4,16 @@
 #include <string.h>
 #include <stdint.h>
 
+#include <atomic>
 #include <cmath>
+#include <new>
 #include <utility>
 
+#include "scratch.h"
+
+/* stbir frees all of its working memory before returning */
+#define STBIR_MALLOC(size,user_data) ((void)(user_data), getScratchArena().allocate(size))
+#define STBIR_FREE(ptr,user_data)    ((void)(user_data), getScratchArena().release(ptr))
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include "stb/stb_image_resize2.h"
 
@@ -23,19 +30,64 @@ extern "C" {
 #define GET_PIXEL(i,d,x,y,c) (((unsigned char*)d) + GET_PIXEL_OFFSET(i,x,y,c))
 #define GET_PIXELC(i,d,x,y,c) (((const unsigned char*)d) + GET_PIXEL_OFFSET(i,x,y,c))
 
+/****************************************************************************
+ * SHARED PIXEL BUFFERS                                                     *
+ ****************************************************************************/
+
+struct TImageBuffer {
+	std::atomic<unsigned int> refCount;
+	void *data;	/* malloc()ed, owned by the buffer */
+	size_t size;
+
+	TImageBuffer(void *d, size_t s) noexcept :
+		refCount(1),
+		data(d),
+		size(s)
+	{}
+};
+
+static TImageBuffer* bufferCreate(void *data, size_t size) noexcept
+{
+	TImageBuffer *b = new (std::nothrow) TImageBuffer(data, size);
+	return b;
+}
+
+static TImageBuffer* bufferRef(TImageBuffer *b) noexcept
+{
+	if (b) {
+		b->refCount.fetch_add(1, std::memory_order_relaxed);
+	}
+	return b;
+}
+
+static void bufferUnref(TImageBuffer *b) noexcept
+{
+	if (b && b->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		free(b->data);
+		delete b;
+	}
+}
+
+/****************************************************************************
+ * IMAGE                                                                    *
+ ****************************************************************************/
+
 CImage::CImage() noexcept :
+	buffer(NULL),
 	data(NULL)
 {
 	reset();
 }
 
 CImage::CImage(const CImage& other) noexcept :
+	buffer(NULL),
 	data(NULL)
 {
 	*this = other;
 }
 
 CImage::CImage(CImage&& other) noexcept :
+	buffer(NULL),
 	data(NULL)
 {
 	*this = std::move(other);
@@ -47,10 +99,9 @@ CImage& CImage::operator=(const CImage& other) noexcept
 		return *this;
 	}
 
-	allocate(other.info);
-	if (data && other.data) {
-		memcpy(data, other.data, other.info.getDataSize());
-	}
+	setFormat(other.info);
+	buffer = bufferRef(other.buffer);
+	data = other.data;
 	exif = other.exif;
 	return *this;
 }
@@ -62,7 +113,9 @@ CImage& CImage::operator=(CImage&& other) noexcept
 	}
 
 	setFormat(other.info);
+	buffer = other.buffer;
 	data = other.data;
+	other.buffer = NULL;
 	other.data = NULL;
 	exif = other.exif;
 	return *this;
@@ -75,10 +128,11 @@ CImage::~CImage() noexcept
 
 void CImage::dropData() noexcept
 {
-	if (data) {
-		free(data);
-		data = NULL;
+	if (buffer) {
+		bufferUnref(buffer);
+		buffer = NULL;
 	}
+	data = NULL;
 	exif.parsed = false;
 }
 
@@ -93,15 +147,48 @@ bool CImage::allocate(const TImageInfo& newInfo, bool clear) noexcept
 	setFormat(newInfo);
 	size_t s = info.getDataSize();
 	if (s > 0) {
+		void *d;
 		if (clear) {
-			data = calloc(s, 1);
+			d = calloc(s, 1);
 		} else {
-			data = malloc(s);
+			d = malloc(s);
+		}
+		if (d) {
+			buffer = bufferCreate(d, s);
+			if (buffer) {
+				data = d;
+			} else {
+				free(d);
+			}
 		}
 	}
 	return (data != NULL);
 }
 
+bool CImage::makeUnique() noexcept
+{
+	if (!buffer || buffer->refCount.load(std::memory_order_acquire) == 1) {
+		return true;
+	}
+
+	size_t s = buffer->size;
+	void *d = malloc(s);
+	if (!d) {
+		util::warn("image: failed to clone shared buffer");
+		return false;
+	}
+	TImageBuffer *b = bufferCreate(d, s);
+	if (!b) {
+		free(d);
+		return false;
+	}
+	memcpy(d, data, s);
+	bufferUnref(buffer);
+	buffer = b;
+	data = d;
+	return true;
+}
+
 void CImage::reset() noexcept
 {
 	dropData();
@@ -123,6 +210,9 @@ void* CImage::getData() noexcept
 	if (!hasData()) {
 		return NULL;
 	}
+	if (!makeUnique()) {
+		return NULL;
+	}
 
 	return data;
 }
@@ -132,6 +222,11 @@ bool CImage::hasData() const noexcept
 	return (data && info.isValid());
 }
 
+bool CImage::isShared() const noexcept
+{
+	return (buffer && buffer->refCount.load(std::memory_order_acquire) > 1);
+}
+
 bool CImage::create(const TImageInfo& newInfo) noexcept
 {
 	return allocate(newInfo);
@@ -145,10 +240,15 @@ bool CImage::adopt(const TImageInfo& newInfo, void *dataPtr) noexcept
 		return false;
 	}
 
-	if (info.getDataSize() < 1) {
+	size_t s = info.getDataSize();
+	if (s < 1) {
 		return false;
 	}
 
+	buffer = bufferCreate(dataPtr, s);
+	if (!buffer) {
+		return false;
+	}
 	data = dataPtr;
 	return true;
 }
@@ -170,20 +270,253 @@ bool CImage::makeChecker(const TImageInfo& newInfo) noexcept
 	return false;
 }
 
-static bool resizeSTB(const unsigned char *src, const TImageInfo& info, unsigned char *dst, const TImageInfo& dstInfo, const TImageResizeCtx& ctx) noexcept
+/****************************************************************************
+ * LINEAR-LIGHT HELPERS                                                     *
+ ****************************************************************************/
+
+static float halfToFloat(uint16_t h) noexcept
 {
-	(void)ctx;
+	uint32_t sign = ((uint32_t)h & 0x8000U) << 16;
+	uint32_t exp = ((uint32_t)h >> 10) & 0x1fU;
+	uint32_t mant = (uint32_t)h & 0x3ffU;
+	uint32_t x;
+	float f;
+
+	if (exp == 0) {
+		/* zero and subnormals */
+		f = (float)mant * (1.0f / 16777216.0f);
+		return (sign) ? -f : f;
+	} else if (exp == 31) {
+		x = sign | 0x7f800000U | (mant << 13);
+	} else {
+		x = sign | ((exp + 112U) << 23) | (mant << 13);
+	}
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
 
-	if (!src || !dst) {
-		util::warn("resizeSTB: no valid data");
-		return false;
+/* round to nearest even */
+static uint16_t floatToHalf(float f) noexcept
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	uint32_t sign = (x >> 16) & 0x8000U;
+	uint32_t mant = x & 0x7fffffU;
+	int32_t exp = (int32_t)((x >> 23) & 0xffU) - 127 + 15;
+	uint32_t h, rem, shift, halfway;
+
+	if (((x >> 23) & 0xffU) == 0xffU) {
+		/* inf and NaN */
+		return (uint16_t)(sign | 0x7c00U | ((mant) ? 0x200U : 0U));
 	}
-	if (info.bytesPerChannel != 1) {
-		util::warn("resizeSTB: unsupported bit depth %u", (unsigned)info.bytesPerChannel*8U);
-		return false;
+	if (exp >= 31) {
+		return (uint16_t)(sign | 0x7c00U);
 	}
+	if (exp <= 0) {
+		if (exp < -10) {
+			return (uint16_t)sign;
+		}
+		mant |= 0x800000U;
+		shift = (uint32_t)(14 - exp);
+		h = mant >> shift;
+		rem = mant & ((1U << shift) - 1U);
+		halfway = 1U << (shift - 1U);
+	} else {
+		h = ((uint32_t)exp << 10) | (mant >> 13);
+		rem = mant & 0x1fffU;
+		halfway = 0x1000U;
+	}
+	if (rem > halfway || (rem == halfway && (h & 1U))) {
+		h++; /* may carry into the exponent, which is still correct */
+	}
+	return (uint16_t)(sign | h);
+}
 
-	stbir_pixel_layout l;
+static double srgbToLinear(double s) noexcept
+{
+	if (s <= 0.04045) {
+		return s / 12.92;
+	}
+	return pow((s + 0.055) / 1.055, 2.4);
+}
+
+static double linearToSRGB(double l) noexcept
+{
+	if (l <= 0.0031308) {
+		return l * 12.92;
+	}
+	return 1.055 * pow(l, 1.0/2.4) - 0.055;
+}
+
+/* Conversion tables for the 16 bit linear-light path. All are indexed by
+ * a 16 bit value: either the sRGB-encoded input sample or the bit pattern
+ * of a half float. Half floats are logarithmically spaced, which matches the
+ * sRGB curve well, so a single table lookup is enough on the way back. */
+struct TLinearLightTables {
+	float    srgb16ToLinear[65536];
+	uint16_t srgb16ToLinearHalf[65536];
+	float    linearHalfToSRGB16[65536]; /* in [0,65535], not rounded */
+
+	TLinearLightTables() noexcept
+	{
+		for (uint32_t i=0; i<65536U; i++) {
+			float l = (float)srgbToLinear((double)i / 65535.0);
+			srgb16ToLinear[i] = l;
+			srgb16ToLinearHalf[i] = floatToHalf(l);
+
+			double f = (double)halfToFloat((uint16_t)i);
+			double v;
+			if (!(f > 0.0)) {
+				/* also catches NaN */
+				v = 0.0;
+			} else if (f >= 1.0) {
+				v = 65535.0;
+			} else {
+				v = linearToSRGB(f) * 65535.0;
+			}
+			linearHalfToSRGB16[i] = (float)v;
+		}
+	}
+};
+
+static const TLinearLightTables& getLinearLightTables() noexcept
+{
+	static const TLinearLightTables tables;
+	return tables;
+}
+
+struct TLinearResizeState {
+	const TLinearLightTables *tables;
+	uint8_t *dst;
+	size_t dstStride;
+	size_t channels;
+	size_t alphaChannel; /* == channels if there is no alpha */
+	bool dither;
+};
+
+static inline uint16_t clampRound16(float v) noexcept
+{
+	if (v <= 0.0f) {
+		return 0;
+	}
+	if (v >= 65535.0f) {
+		return 65535;
+	}
+	return (uint16_t)(v + 0.5f);
+}
+
+/* stb_image_resize2 pixel callbacks: they convert one span of a scanline at
+ * a time, so the linear-light data never exists as a full-size image. The
+ * input pointer is always the begin of the source row, as we give stbir our
+ * own row stride. */
+static const void* linearInputHalf(void *optional_output, const void *input_ptr, int num_pixels, int x, int y, void *context) noexcept
+{
+	(void)y;
+	const TLinearResizeState *st = (const TLinearResizeState*)context;
+	const uint16_t *tbl = st->tables->srgb16ToLinearHalf;
+	const uint16_t *s = (const uint16_t*)input_ptr + (size_t)x * st->channels;
+	uint16_t *d = (uint16_t*)optional_output;
+	size_t cnt = (size_t)num_pixels * st->channels;
+
+	for (size_t i=0; i<cnt; i++) {
+		d[i] = tbl[s[i]];
+	}
+	if (st->alphaChannel < st->channels) {
+		for (size_t i=st->alphaChannel; i<cnt; i += st->channels) {
+			d[i] = floatToHalf((float)s[i] * (1.0f/65535.0f));
+		}
+	}
+	return optional_output;
+}
+
+static const void* linearInputFloat(void *optional_output, const void *input_ptr, int num_pixels, int x, int y, void *context) noexcept
+{
+	(void)y;
+	const TLinearResizeState *st = (const TLinearResizeState*)context;
+	const float *tbl = st->tables->srgb16ToLinear;
+	const uint16_t *s = (const uint16_t*)input_ptr + (size_t)x * st->channels;
+	float *d = (float*)optional_output;
+	size_t cnt = (size_t)num_pixels * st->channels;
+
+	for (size_t i=0; i<cnt; i++) {
+		d[i] = tbl[s[i]];
+	}
+	if (st->alphaChannel < st->channels) {
+		for (size_t i=st->alphaChannel; i<cnt; i += st->channels) {
+			d[i] = (float)s[i] * (1.0f/65535.0f);
+		}
+	}
+	return optional_output;
+}
+
+static void linearOutputHalf(const void *output_ptr, int num_pixels, int y, void *context) noexcept
+{
+	const TLinearResizeState *st = (const TLinearResizeState*)context;
+	const float *tbl = st->tables->linearHalfToSRGB16;
+	const uint16_t *s = (const uint16_t*)output_ptr;
+	uint16_t *d = (uint16_t*)(st->dst + (size_t)y * st->dstStride);
+	size_t cnt = (size_t)num_pixels * st->channels;
+
+	for (size_t i=0; i<cnt; i++) {
+		d[i] = (uint16_t)(tbl[s[i]] + 0.5f);
+	}
+	if (st->alphaChannel < st->channels) {
+		for (size_t i=st->alphaChannel; i<cnt; i += st->channels) {
+			d[i] = clampRound16(halfToFloat(s[i]) * 65535.0f);
+		}
+	}
+}
+
+static void linearOutputFloat(const void *output_ptr, int num_pixels, int y, void *context) noexcept
+{
+	const TLinearResizeState *st = (const TLinearResizeState*)context;
+	const float *tbl = st->tables->linearHalfToSRGB16;
+	const float *s = (const float*)output_ptr;
+	uint16_t *d = (uint16_t*)(st->dst + (size_t)y * st->dstStride);
+	size_t cnt = (size_t)num_pixels * st->channels;
+	uint32_t rnd = ((uint32_t)y + 1U) * 2654435761U;
+
+	for (size_t i=0; i<cnt; i++) {
+		float l = s[i];
+		if (!(l > 0.0f)) {
+			l = 0.0f;
+		} else if (l > 1.0f) {
+			l = 1.0f;
+		}
+		/* bracket l by two adjacent half floats and interpolate the
+		 * table in between */
+		uint16_t h = floatToHalf(l);
+		float l0 = halfToFloat(h);
+		if (l0 > l) {
+			l0 = halfToFloat(--h);
+		}
+		float v = tbl[h];
+		if (h < 0x3c00U) {
+			float l1 = halfToFloat((uint16_t)(h+1));
+			v += (tbl[h+1] - v) * ((l - l0) / (l1 - l0));
+		}
+		if (st->dither) {
+			/* triangular noise with +/-1 LSB amplitude */
+			rnd ^= rnd << 13;
+			rnd ^= rnd >> 17;
+			rnd ^= rnd << 5;
+			v += (float)((rnd & 0xffffU) + (rnd >> 16)) * (1.0f/65536.0f) - 1.0f;
+		}
+		d[i] = clampRound16(v);
+	}
+	if (st->alphaChannel < st->channels) {
+		for (size_t i=st->alphaChannel; i<cnt; i += st->channels) {
+			d[i] = clampRound16(s[i] * 65535.0f);
+		}
+	}
+}
+
+/****************************************************************************
+ * RESIZE                                                                   *
+ ****************************************************************************/
+
+static bool getSTBLayout(const TImageInfo& info, stbir_pixel_layout& l) noexcept
+{
 	switch(info.channels) {
 		case 1:
 			l=STBIR_1CHANNEL;
@@ -201,12 +534,96 @@ static bool resizeSTB(const unsigned char *src, const TImageInfo& info, unsigned
 			util::warn("resizeSTB: unsupported channel count %u", (unsigned)info.channels);
 			return false;
 	}
-	stbir_resize_uint8_srgb(src, (int)info.width, (int)info.height, 0,
-				dst, (int)dstInfo.width, (int)dstInfo.height, 0, l);
+	return true;
+}
+
+/* 16 bit sRGB data: convert to linear light on the fly, resize there and
+ * convert back on the fly */
+static bool resizeSTBLinear16(const unsigned char *src, const TImageInfo& info, unsigned char *dst, const TImageInfo& dstInfo, const TImageResizeCtx& ctx, stbir_pixel_layout l) noexcept
+{
+	STBIR_RESIZE r;
+	TLinearResizeState st;
+	stbir_datatype dt;
+
+	st.tables = &getLinearLightTables();
+	st.dst = dst;
+	st.dstStride = dstInfo.width * dstInfo.channels * dstInfo.bytesPerChannel;
+	st.channels = info.channels;
+	st.alphaChannel = (info.channels == 2 || info.channels == 4) ? (info.channels - 1) : info.channels;
+	st.dither = ctx.dither;
+
+	dt = (ctx.linearFormat == FC_LINEAR_FLOAT) ? STBIR_TYPE_FLOAT : STBIR_TYPE_HALF_FLOAT;
+	stbir_resize_init(&r, src, (int)info.width, (int)info.height, (int)(info.width * info.channels * info.bytesPerChannel),
+			  NULL, (int)dstInfo.width, (int)dstInfo.height, 0, l, dt);
+	stbir_set_user_data(&r, &st);
+	if (dt == STBIR_TYPE_FLOAT) {
+		stbir_set_pixel_callbacks(&r, linearInputFloat, linearOutputFloat);
+	} else {
+		stbir_set_pixel_callbacks(&r, linearInputHalf, linearOutputHalf);
+	}
+	if (!stbir_resize_extended(&r)) {
+		util::warn("resizeSTB: linear-light resize failed");
+		return false;
+	}
+	return true;
+}
+
+static bool resizeSTB(const unsigned char *src, const TImageInfo& info, unsigned char *dst, const TImageInfo& dstInfo, const TImageResizeCtx& ctx) noexcept
+{
+	if (!src || !dst) {
+		util::warn("resizeSTB: no valid data");
+		return false;
+	}
+
+	stbir_pixel_layout l;
+	if (!getSTBLayout(info, l)) {
+		return false;
+	}
+
+	CScratchScope scratch;
+
+	switch(info.bytesPerChannel) {
+		case 1:
+			stbir_resize_uint8_srgb(src, (int)info.width, (int)info.height, 0,
+						dst, (int)dstInfo.width, (int)dstInfo.height, 0, l);
+			break;
+		case 2:
+			return resizeSTBLinear16(src, info, dst, dstInfo, ctx, l);
+		case 4:
+			/* float data is linear already */
+			if (!stbir_resize(src, (int)info.width, (int)info.height, 0,
+					  dst, (int)dstInfo.width, (int)dstInfo.height, 0,
+					  l, STBIR_TYPE_FLOAT, STBIR_EDGE_CLAMP, STBIR_FILTER_DEFAULT)) {
+				util::warn("resizeSTB: float resize failed");
+				return false;
+			}
+			break;
+		default:
+			util::warn("resizeSTB: unsupported bit depth %u", (unsigned)info.bytesPerChannel*8U);
+			return false;
+	}
 	return true;
 }
 
 #ifdef WITH_LIBSWSCALE
+/* Keep the scaler context (and its internal buffers) of each thread alive
+ * between images, it is only rebuilt if the parameters change. */
+struct TSWSContextCache {
+	struct SwsContext *ctx;
+
+	TSWSContextCache() noexcept :
+		ctx(NULL)
+	{}
+	~TSWSContextCache() noexcept
+	{
+		if (ctx) {
+			sws_freeContext(ctx);
+		}
+	}
+};
+
+static thread_local TSWSContextCache swsContextCache;
+
 static bool resizeSWS(const uint8_t *src, const TImageInfo& info, uint8_t *dst, const TImageInfo& dstInfo, const TImageResizeCtx& ctx) noexcept
 {
 	enum AVPixelFormat fmt;
@@ -299,7 +716,9 @@ static bool resizeSWS(const uint8_t *src, const TImageInfo& info, uint8_t *dst,
 			return false;
 	}
 	debug("resizeSWS: selected mode %d, flags: 0x%x, format %d: %u channels, bit depth %u", (int)ctx.swsMode, (unsigned) flags, (int)fmt, (unsigned)info.channels, (unsigned)info.bytesPerChannel*8U);
-	struct SwsContext *swsctx = sws_getContext((int)info.width, (int)info.height, fmt, (int)dstInfo.width, (int)dstInfo.height, fmt, flags, NULL, NULL, NULL);
+	/* sws_getCachedContext frees the old context if it fails */
+	struct SwsContext *swsctx = sws_getCachedContext(swsContextCache.ctx, (int)info.width, (int)info.height, fmt, (int)dstInfo.width, (int)dstInfo.height, fmt, flags, NULL, NULL, NULL);
+	swsContextCache.ctx = swsctx;
 	if (!swsctx) {
 		util::warn("resizeSWS: failed to get context");
 		return false;
@@ -352,11 +771,77 @@ static bool resizeSWS(const uint8_t *src, const TImageInfo& info, uint8_t *dst,
 		util::warn("resizeSWS: failed to scale: %d",res);
 	}
 
-	sws_freeContext(swsctx);
 	return success;
 }
 #endif /* WITH_LIBSWSCALE */
 
+/* Resize one plane of a planar YCbCr image at its own resolution. The
+ * chroma planes may extend beyond the image (partially covered chroma
+ * blocks at the right and bottom edges), select the input range which
+ * corresponds to the extent of the output plane, so that the chroma stays
+ * aligned with the luma. */
+static bool resizePlaneSTB(const unsigned char *src, const TImageInfo& info, unsigned char *dst, const TImageInfo& dstInfo, size_t plane) noexcept
+{
+	STBIR_RESIZE r;
+	size_t sw, sh, dw, dh;
+
+	info.getPlaneDims(plane, sw, sh);
+	dstInfo.getPlaneDims(plane, dw, dh);
+	stbir_resize_init(&r, src, (int)sw, (int)sh, 0, dst, (int)dw, (int)dh, 0, STBIR_1CHANNEL, STBIR_TYPE_UINT8);
+	if (plane) {
+		double s1 = ((double)info.width / (double)(sw << info.chromaShift[0])) *
+			    ((double)(dw << dstInfo.chromaShift[0]) / (double)dstInfo.width);
+		double t1 = ((double)info.height / (double)(sh << info.chromaShift[1])) *
+			    ((double)(dh << dstInfo.chromaShift[1]) / (double)dstInfo.height);
+		stbir_set_input_subrect(&r, 0.0, 0.0, s1, t1);
+	}
+	stbir_set_edgemodes(&r, STBIR_EDGE_CLAMP, STBIR_EDGE_CLAMP);
+	if (!stbir_resize_extended(&r)) {
+		util::warn("resizeSTB: failed to resize plane %u", (unsigned)plane);
+		return false;
+	}
+	return true;
+}
+
+static bool resizePlanes(const CImage& src, CImage& dst, TFCResizeMode mode, const TImageResizeCtx& ctx) noexcept
+{
+	const TImageInfo& info = src.getInfo();
+	const TImageInfo& dstInfo = dst.getInfo();
+	CScratchScope scratch;
+	/* swscale maps the rounded-up chroma planes edge to edge, which shifts
+	 * them against luma unless both sides are aligned */
+	bool chromaAligned = info.isChromaAligned(0) && info.isChromaAligned(1) &&
+			     dstInfo.isChromaAligned(0) && dstInfo.isChromaAligned(1);
+	for (size_t p = 0; p < info.getPlaneCount(); p++) {
+		const unsigned char *s = (const unsigned char*)src.getPlane(p);
+		unsigned char *d = (unsigned char*)dst.getPlane(p);
+		bool success;
+		switch((p && !chromaAligned) ? FC_RESIZE_STB : mode) {
+			case FC_RESIZE_STB:
+				success = resizePlaneSTB(s, info, d, dstInfo, p);
+				break;
+#ifdef WITH_LIBSWSCALE
+			case FC_RESIZE_SWSCALE:
+				{
+					size_t sw, sh, dw, dh;
+					info.getPlaneDims(p, sw, sh);
+					dstInfo.getPlaneDims(p, dw, dh);
+					success = resizeSWS(s, TImageInfo(sw, sh, 1, 1), d, TImageInfo(dw, dh, 1, 1), ctx);
+				}
+				break;
+#endif
+			default:
+				(void)ctx;
+				util::warn("resize: invalid mode %u", (unsigned)mode);
+				success = false;
+		}
+		if (!success) {
+			return false;
+		}
+	}
+	return true;
+}
+
 bool CImage::resizeTo(CImage& dst, const TImageResizeCtx& ctx, size_t w, size_t h) const noexcept
 {
 	if (!hasData()) {
@@ -367,18 +852,32 @@ bool CImage::resizeTo(CImage& dst, const TImageResizeCtx& ctx, size_t w, size_t
 	TFCResizeMode mode = ctx.mode;
 	if (mode == FC_RESIZE_AUTO) {
 #ifdef WITH_LIBSWSCALE
-		mode = FC_RESIZE_SWSCALE;
+		/* swscale resizes high bit depths in gamma space */
+		mode = (info.bytesPerChannel > 1) ? FC_RESIZE_STB : FC_RESIZE_SWSCALE;
 #else
 		mode = FC_RESIZE_STB;
 #endif
 	}
 
-	if (!dst.allocate(TImageInfo(w,h,info.channels,info.bytesPerChannel))) {
+	TImageInfo dstInfo(w,h,info.channels,info.bytesPerChannel);
+	if (info.isPlanar()) {
+		/* resize Y, Cb and Cr at their native resolutions */
+		dstInfo.setYCbCrPlanar(info.chromaShift[0], info.chromaShift[1]);
+	}
+	if (!dst.allocate(dstInfo)) {
 		util::warn("resize: failed to allocate output");
 		return false;
 	}
 
 	bool success;
+	if (info.isPlanar()) {
+		success = resizePlanes(*this, dst, mode, ctx);
+		if (!success) {
+			util::warn("resize failed");
+			dst.dropData();
+		}
+		return success;
+	}
 	switch(mode) {
 		case FC_RESIZE_STB:
 			success = resizeSTB((const unsigned char*)data, info, (unsigned char*)dst.data, dst.info, ctx);
@@ -445,7 +944,9 @@ bool CImage::resizeToLimits(CImage& dst, const TImageResizeCtx& ctx, size_t maxS
 	}
 
 	if (s[0] == info.width && s[1] == info.height) {
+		/* shares the pixels */
 		dst = *this;
+		return true;
 	}
 	return resizeTo(dst, ctx, s[0], s[1]);
 }
@@ -465,29 +966,44 @@ bool CImage::transposeTo(CImage& dst, bool flip) const noexcept
 	if (!hasData()) {
 		return false;
 	}
-	if (!dst.allocate(TImageInfo(info.height, info.width, info.channels, info.bytesPerChannel))) {
+	if (flip && !info.isChromaAligned(1)) {
+		CImage rgb;
+		return convertToInterleaved(rgb) && rgb.transposeTo(dst, flip);
+	}
+	TImageInfo dstInfo = info;
+	dstInfo.width = info.height;
+	dstInfo.height = info.width;
+	dstInfo.chromaShift[0] = info.chromaShift[1];
+	dstInfo.chromaShift[1] = info.chromaShift[0];
+	if (!dst.allocate(dstInfo)) {
 		return false;
 	}
 	size_t x,y,i;
-	size_t ps = info.channels * info.bytesPerChannel;
-	intptr_t ls = info.width * ps;
-	size_t ss = 0;
-	size_t dls = dst.info.width * ps;
-	if (flip) {
-		ss = info.height - 1;
-		ls = -ls;
-	}
-	const unsigned char *s;
-	unsigned char *d= GET_PIXEL(dst.info, dst.data, 0, 0, 0);
-	for (y=0; y<dst.info.height; y++) {
-       		s = GET_PIXELC(info,data,y,ss,0);
-		for (x=0; x<dst.info.width; x++) {
-			for (i=0; i<ps; i++) {
-				d[x*ps+i] = s[i];
+	size_t ps = info.getPlanePixelSize();
+	for (size_t p=0; p<info.getPlaneCount(); p++) {
+		size_t pw, ph, dw, dh;
+		info.getPlaneDims(p, pw, ph);
+		dst.info.getPlaneDims(p, dw, dh);
+		const unsigned char *plane = (const unsigned char*)data + info.getPlaneOffset(p);
+		intptr_t ls = (intptr_t)(pw * ps);
+		size_t ss = 0;
+		size_t dls = dw * ps;
+		if (flip) {
+			ss = ph - 1;
+			ls = -ls;
+		}
+		const unsigned char *s;
+		unsigned char *d = (unsigned char*)dst.data + dst.info.getPlaneOffset(p);
+		for (y=0; y<dh; y++) {
+			s = plane + (ss * pw + y) * ps;
+			for (x=0; x<dw; x++) {
+				for (i=0; i<ps; i++) {
+					d[x*ps+i] = s[i];
+				}
+				s += ls;
 			}
-			s += ls;
+			d += dls;
 		}
-		d += dls;
 	}
 	return true;
 }
@@ -507,19 +1023,34 @@ bool CImage::flipH() noexcept
 	if (!hasData()) {
 		return false;
 	}
+	if (!info.isChromaAligned(0)) {
+		CImage rgb;
+		if (!convertToInterleaved(rgb)) {
+			return false;
+		}
+		*this = std::move(rgb);
+	}
+	if (!makeUnique()) {
+		return false;
+	}
 
 	size_t x,y,i;
-	size_t ps = info.channels * info.bytesPerChannel;
-	size_t a = info.width>>1U;
-	size_t b = info.width - 1;
-
-	for (y=0; y<info.height; y++) {
-		unsigned char *p = GET_PIXEL(info, data, 0, y, 0);
-		for (x=0; x<a; x++) {
-			for (i=0; i<ps; i++) {
-				unsigned char tmp = p[x*ps + i];
-				p[x*ps + i] = p[(b-x)*ps + i];
-				p[(b-x)*ps + i] = tmp;
+	size_t ps = info.getPlanePixelSize();
+	for (size_t p=0; p<info.getPlaneCount(); p++) {
+		size_t pw, ph;
+		info.getPlaneDims(p, pw, ph);
+		unsigned char *plane = (unsigned char*)data + info.getPlaneOffset(p);
+		size_t a = pw>>1U;
+		size_t b = pw - 1;
+
+		for (y=0; y<ph; y++) {
+			unsigned char *l = plane + y * pw * ps;
+			for (x=0; x<a; x++) {
+				for (i=0; i<ps; i++) {
+					unsigned char tmp = l[x*ps + i];
+					l[x*ps + i] = l[(b-x)*ps + i];
+					l[(b-x)*ps + i] = tmp;
+				}
 			}
 		}
 	}
@@ -531,20 +1062,230 @@ bool CImage::flipV() noexcept
 	if (!hasData()) {
 		return false;
 	}
+	if (!info.isChromaAligned(1)) {
+		CImage rgb;
+		if (!convertToInterleaved(rgb)) {
+			return false;
+		}
+		*this = std::move(rgb);
+	}
+	if (!makeUnique()) {
+		return false;
+	}
 
 	size_t i,y;
-	size_t ps = info.channels * info.bytesPerChannel;
-	size_t a = info.height>>1U;
-	size_t b = info.height - 1;
-	size_t c = info.width * ps;
-
-	for (y=0; y<a; y++) {
-		unsigned char *p = GET_PIXEL(info, data, 0, y, 0);
-		unsigned char *q = GET_PIXEL(info, data, 0, b-y, 0);
-		for (i=0; i<c; i++) {
-			unsigned char tmp = p[i];
-			p[i] = q[i];
-			q[i] = tmp;
+	size_t ps = info.getPlanePixelSize();
+	for (size_t p=0; p<info.getPlaneCount(); p++) {
+		size_t pw, ph;
+		info.getPlaneDims(p, pw, ph);
+		unsigned char *plane = (unsigned char*)data + info.getPlaneOffset(p);
+		size_t a = ph>>1U;
+		size_t b = ph - 1;
+		size_t c = pw * ps;
+
+		for (y=0; y<a; y++) {
+			unsigned char *l = plane + y * c;
+			unsigned char *q = plane + (b-y) * c;
+			for (i=0; i<c; i++) {
+				unsigned char tmp = l[i];
+				l[i] = q[i];
+				q[i] = tmp;
+			}
+		}
+	}
+	return true;
+}
+
+/****************************************************************************
+ * YCBCR TO RGB                                                             *
+ ****************************************************************************/
+
+/* JFIF YCbCr -> RGB in 16.16 fixed point, the same as libjpeg does */
+struct TYCbCrTables {
+	int32_t crR[256];
+	int32_t cbB[256];
+	int32_t crG[256];
+	int32_t cbG[256];
+
+	TYCbCrTables() noexcept
+	{
+		for (int i=0; i<256; i++) {
+			double x = (double)(i - 128);
+			crR[i] = (int32_t)std::lround(1.40200 * 65536.0 * x) + 32768;
+			cbB[i] = (int32_t)std::lround(1.77200 * 65536.0 * x) + 32768;
+			crG[i] = (int32_t)std::lround(-0.71414 * 65536.0 * x);
+			cbG[i] = (int32_t)std::lround(-0.34414 * 65536.0 * x) + 32768;
+		}
+	}
+};
+
+static const TYCbCrTables& getYCbCrTables() noexcept
+{
+	static const TYCbCrTables tables;
+	return tables;
+}
+
+static inline uint8_t clamp8(int32_t v) noexcept
+{
+	if (v < 0) {
+		return 0;
+	}
+	if (v > 255) {
+		return 255;
+	}
+	return (uint8_t)v;
+}
+
+/* Bilinear chroma upsampling with centered chroma siting: for each luma
+ * coordinate, the two neighbouring chroma samples and the weight of the
+ * second one (in 1/256). For a factor of 2, this is the same triangle
+ * filter as libjpeg's fancy upsampling. */
+struct TChromaTap {
+	int32_t a;
+	int32_t b;
+	int32_t w;
+};
+
+static void getChromaTap(int32_t pos, size_t shift, int32_t chromaSize, TChromaTap& t) noexcept
+{
+	if (!shift) {
+		t.a = t.b = (pos < 0) ? 0 : ((pos >= chromaSize) ? chromaSize - 1 : pos);
+		t.w = 0;
+		return;
+	}
+	/* c = (pos + 0.5) / 2^shift - 0.5, in 1/256 */
+	int32_t c = (((2 * pos + 1) * 256) >> (shift + 1)) - 128;
+	int32_t a = (c >= 0) ? (c >> 8) : -((-c + 255) >> 8);
+	t.w = c - a * 256;
+	t.a = a;
+	t.b = a + 1;
+	if (t.a < 0) {
+		t.a = 0;
+	}
+	if (t.b < 0) {
+		t.b = 0;
+	}
+	if (t.a >= chromaSize) {
+		t.a = chromaSize - 1;
+	}
+	if (t.b >= chromaSize) {
+		t.b = chromaSize - 1;
+	}
+}
+
+static bool cropPlanarToRGB(const CImage& src, CImage& dst, const int32_t pos[2], const int32_t size[2]) noexcept
+{
+	const TImageInfo& info = src.getInfo();
+	const TYCbCrTables& t = getYCbCrTables();
+	size_t cw, ch;
+	info.getPlaneDims(1, cw, ch);
+	const uint8_t *py = (const uint8_t*)src.getPlane(0);
+	const uint8_t *pcb = (const uint8_t*)src.getPlane(1);
+	const uint8_t *pcr = (const uint8_t*)src.getPlane(2);
+	uint8_t *d = (uint8_t*)dst.getData();
+	int32_t w = (int32_t)info.width;
+	int32_t h = (int32_t)info.height;
+	if (!py || !pcb || !pcr || !d) {
+		return false;
+	}
+
+	CScratchScope scratch;
+	TChromaTap *xtaps = (TChromaTap*)scratch.getArena().allocate(sizeof(TChromaTap) * (size_t)size[0]);
+	if (!xtaps) {
+		return false;
+	}
+	for (int32_t x = 0; x < size[0]; x++) {
+		getChromaTap(x + pos[0], info.chromaShift[0], (int32_t)cw, xtaps[x]);
+	}
+
+	for (int32_t y = 0; y < size[1]; y++) {
+		int32_t sy = y + pos[1];
+		uint8_t *l = d + (size_t)y * (size_t)size[0] * 3U;
+		if (sy < 0 || sy >= h) {
+			memset(l, 0, (size_t)size[0] * 3U);
+			continue;
+		}
+		TChromaTap yt;
+		getChromaTap(sy, info.chromaShift[1], (int32_t)ch, yt);
+		const uint8_t *ly = py + (size_t)sy * info.width;
+		const uint8_t *cba = pcb + (size_t)yt.a * cw;
+		const uint8_t *cbb = pcb + (size_t)yt.b * cw;
+		const uint8_t *cra = pcr + (size_t)yt.a * cw;
+		const uint8_t *crb = pcr + (size_t)yt.b * cw;
+		for (int32_t x = 0; x < size[0]; x++) {
+			int32_t sx = x + pos[0];
+			if (sx < 0 || sx >= w) {
+				l[3*x] = l[3*x+1] = l[3*x+2] = 0;
+				continue;
+			}
+			const TChromaTap& xt = xtaps[x];
+			int32_t cb = ((cba[xt.a] * (256 - xt.w) + cba[xt.b] * xt.w) * (256 - yt.w) +
+				      (cbb[xt.a] * (256 - xt.w) + cbb[xt.b] * xt.w) * yt.w + 32768) >> 16;
+			int32_t cr = ((cra[xt.a] * (256 - xt.w) + cra[xt.b] * xt.w) * (256 - yt.w) +
+				      (crb[xt.a] * (256 - xt.w) + crb[xt.b] * xt.w) * yt.w + 32768) >> 16;
+			int32_t yy = ly[sx];
+			l[3*x  ] = clamp8(yy + (t.crR[cr] >> 16));
+			l[3*x+1] = clamp8(yy + ((t.cbG[cb] + t.crG[cr]) >> 16));
+			l[3*x+2] = clamp8(yy + (t.cbB[cb] >> 16));
+		}
+	}
+	return true;
+}
+
+/* Crop the planes of a planar YCbCr image. If the crop position is not on
+ * the chroma grid, the new chroma samples are interpolated between the two
+ * neighbouring source samples. Areas outside of the image become black. */
+static bool cropPlanes(const CImage& src, CImage& dst, const int32_t pos[2], const int32_t size[2]) noexcept
+{
+	const TImageInfo& info = src.getInfo();
+	const TImageInfo& dstInfo = dst.getInfo();
+	size_t sw, sh, dw, dh;
+
+	for (size_t p = 0; p < info.getPlaneCount(); p++) {
+		const uint8_t *s = (const uint8_t*)src.getPlane(p);
+		uint8_t *d = (uint8_t*)dst.getPlane(p);
+		if (!s || !d) {
+			return false;
+		}
+		info.getPlaneDims(p, sw, sh);
+		dstInfo.getPlaneDims(p, dw, dh);
+		int32_t shift[2] = {0, 0};
+		uint8_t black = 0;
+		if (p) {
+			shift[0] = (int32_t)info.chromaShift[0];
+			shift[1] = (int32_t)info.chromaShift[1];
+			black = 128;
+		}
+		/* start position in the plane in 1/256 samples */
+		int32_t start[2], frac[2];
+		for (int i=0; i<2; i++) {
+			int32_t f = pos[i] * (256 >> shift[i]);
+			start[i] = (f >= 0) ? (f >> 8) : -((-f + 255) >> 8);
+			frac[i] = f - start[i] * 256;
+		}
+		int32_t w = (int32_t)sw;
+		int32_t h = (int32_t)sh;
+		for (int32_t y = 0; y < (int32_t)dh; y++) {
+			int32_t ya = y + start[1];
+			int32_t yb = (frac[1] && ya + 1 < h) ? ya + 1 : ya;
+			uint8_t *l = d + (size_t)y * dw;
+			if (ya < 0 || ya >= h) {
+				memset(l, black, dw);
+				continue;
+			}
+			const uint8_t *la = s + (size_t)ya * sw;
+			const uint8_t *lb = s + (size_t)yb * sw;
+			for (int32_t x = 0; x < (int32_t)dw; x++) {
+				int32_t xa = x + start[0];
+				if (xa < 0 || xa >= w) {
+					l[x] = black;
+					continue;
+				}
+				int32_t xb = (frac[0] && xa + 1 < w) ? xa + 1 : xa;
+				int32_t a = la[xa] * (256 - frac[0]) + la[xb] * frac[0];
+				int32_t b = lb[xa] * (256 - frac[0]) + lb[xb] * frac[0];
+				l[x] = (uint8_t)((a * (256 - frac[1]) + b * frac[1] + 32768) >> 16);
+			}
 		}
 	}
 	return true;
@@ -557,10 +1298,18 @@ bool CImage::cropTo(CImage& dst, const int32_t pos[2], const int32_t size[2]) co
 		return false;
 	}
 
-	if (!dst.allocate(TImageInfo((size_t)size[0], (size_t)size[1], info.channels, info.bytesPerChannel))) {
+	TImageInfo dstInfo((size_t)size[0], (size_t)size[1], info.channels, info.bytesPerChannel);
+	if (info.isPlanar()) {
+		dstInfo.setYCbCrPlanar(info.chromaShift[0], info.chromaShift[1]);
+	}
+	if (!dst.allocate(dstInfo)) {
 		return false;
 	}
 
+	if (info.isPlanar()) {
+		return cropPlanes(*this, dst, pos, size);
+	}
+
 	int32_t w = (int32_t)info.width;
 	int32_t h = (int32_t)info.height;
 	int32_t ps = (int32_t)(info.channels * info.bytesPerChannel);
@@ -589,3 +1338,43 @@ bool CImage::cropTo(CImage& dst, const int32_t pos[2], const int32_t size[2]) co
 	}
 	return true;
 }
+
+bool CImage::convertToInterleaved(CImage& dst) const noexcept
+{
+	if (!hasData()) {
+		return false;
+	}
+	if (!info.isPlanar()) {
+		dst = *this;
+		return true;
+	}
+	int32_t pos[2] = {0, 0};
+	int32_t size[2] = {(int32_t)info.width, (int32_t)info.height};
+	if (!dst.allocate(TImageInfo(info.width, info.height, info.channels, info.bytesPerChannel)) ||
+	    !cropPlanarToRGB(*this, dst, pos, size)) {
+		dst.reset();
+		return false;
+	}
+	dst.exif = exif;
+	return true;
+}
+
+const void* CImage::getPlane(size_t plane) const noexcept
+{
+	if (!hasData() || plane >= info.getPlaneCount()) {
+		return NULL;
+	}
+	return (const unsigned char*)data + info.getPlaneOffset(plane);
+}
+
+void* CImage::getPlane(size_t plane) noexcept
+{
+	if (plane >= info.getPlaneCount()) {
+		return NULL;
+	}
+	unsigned char *d = (unsigned char*)getData();
+	if (!d) {
+		return NULL;
+	}
+	return d + info.getPlaneOffset(plane);
+}
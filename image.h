@@ -6,24 +6,35 @@
 
 const size_t maxImageSize = 1*1024U*1024U*1024U;
 
+typedef enum {
+	FC_LAYOUT_INTERLEAVED = 0,
+	FC_LAYOUT_YCBCR_PLANAR,	/* JFIF YCbCr: Y, Cb, Cr planes, 8 bit, chroma subsampled by chromaShift */
+} TImageLayout;
+
 struct TImageInfo {
 	size_t width;
 	size_t height;
 	size_t channels;
 	size_t bytesPerChannel;
+	TImageLayout layout;
+	size_t chromaShift[2];
 
 	TImageInfo() noexcept :
 		width(0),
 		height(0),
 		channels(0),
-		bytesPerChannel(0)
+		bytesPerChannel(0),
+		layout(FC_LAYOUT_INTERLEAVED),
+		chromaShift{0, 0}
 	{}
 
 	TImageInfo(size_t w, size_t h, size_t c=3, size_t bpc=1) noexcept :
 		width(w),
 		height(h),
 		channels(c),
-		bytesPerChannel(bpc)
+		bytesPerChannel(bpc),
+		layout(FC_LAYOUT_INTERLEAVED),
+		chromaShift{0, 0}
 	{}
 
 	void reset() noexcept
@@ -32,6 +43,23 @@ struct TImageInfo {
 		height = 0;
 		channels = 0;
 		bytesPerChannel = 0;
+		layout = FC_LAYOUT_INTERLEAVED;
+		chromaShift[0] = 0;
+		chromaShift[1] = 0;
+	}
+
+	void setYCbCrPlanar(size_t shiftX, size_t shiftY) noexcept
+	{
+		channels = 3;
+		bytesPerChannel = 1;
+		layout = FC_LAYOUT_YCBCR_PLANAR;
+		chromaShift[0] = shiftX;
+		chromaShift[1] = shiftY;
+	}
+
+	bool isPlanar() const noexcept
+	{
+		return (layout != FC_LAYOUT_INTERLEAVED);
 	}
 
 	bool isValid() const noexcept
@@ -39,10 +67,64 @@ struct TImageInfo {
 		if (!width || !height || !channels || !bytesPerChannel || channels > 4 || bytesPerChannel > 4 || bytesPerChannel == 3) {
 			return false;
 		}
+		if (layout == FC_LAYOUT_YCBCR_PLANAR) {
+			if (channels != 3 || bytesPerChannel != 1 || chromaShift[0] > 2 || chromaShift[1] > 2) {
+				return false;
+			}
+		} else if (layout != FC_LAYOUT_INTERLEAVED) {
+			return false;
+		}
 
 		return true;
 	}
 
+	/* Chroma samples are sited relative to the top-left corner, so mirroring
+	 * the planes along an axis keeps them aligned with the luma only if the
+	 * size is a multiple of the subsampling factor (axis 0: x, 1: y) */
+	bool isChromaAligned(size_t axis) const noexcept
+	{
+		size_t dim = (axis) ? height : width;
+		return !isPlanar() || !(dim & (((size_t)1 << chromaShift[axis]) - 1));
+	}
+
+	size_t getPlaneCount() const noexcept
+	{
+		return (isPlanar()) ? channels : 1;
+	}
+
+	/* bytes per pixel within a plane */
+	size_t getPlanePixelSize() const noexcept
+	{
+		return (isPlanar()) ? bytesPerChannel : (channels * bytesPerChannel);
+	}
+
+	void getPlaneDims(size_t plane, size_t& w, size_t& h) const noexcept
+	{
+		if (isPlanar() && plane > 0) {
+			w = (width + (((size_t)1 << chromaShift[0]) - 1)) >> chromaShift[0];
+			h = (height + (((size_t)1 << chromaShift[1]) - 1)) >> chromaShift[1];
+		} else {
+			w = width;
+			h = height;
+		}
+	}
+
+	size_t getPlaneSize(size_t plane) const noexcept
+	{
+		size_t w, h;
+		getPlaneDims(plane, w, h);
+		return w * h * getPlanePixelSize();
+	}
+
+	size_t getPlaneOffset(size_t plane) const noexcept
+	{
+		size_t offset = 0;
+		for (size_t i=0; i<plane; i++) {
+			offset += getPlaneSize(i);
+		}
+		return offset;
+	}
+
 	size_t getDataSize(size_t maxSize=maxImageSize) const noexcept
 	{
 		if (!isValid()) {
@@ -56,6 +138,10 @@ struct TImageInfo {
 		if (s < width) {
 			return 0;
 		}
+		if (isPlanar()) {
+			/* subsampled planes are never larger than the full one */
+			return getPlaneOffset(channels);
+		}
 		return width * height * channels * bytesPerChannel;
 	}
 };
@@ -86,30 +172,48 @@ typedef enum {
 } TFCSWSMode;
 #endif
 
+/* intermediate format for the linear-light resize of 16 bit images */
+typedef enum {
+	FC_LINEAR_HALF = 0,	/* table-driven both ways, fastest */
+	FC_LINEAR_FLOAT,	/* interpolated output, supports dithering */
+	FC_LINEAR_COUNT /* end marker */
+} TFCLinearFormat;
+
 struct TImageResizeCtx {
 #ifdef WITH_LIBSWSCALE
 	TFCSWSMode swsMode;
 #endif
 	TFCResizeMode mode;
+	TFCLinearFormat linearFormat;
+	bool dither;
 
 	TImageResizeCtx() noexcept :
 #ifdef WITH_LIBSWSCALE
 		swsMode(FC_SWS_SPLINE),
 #endif
-		mode(FC_RESIZE_AUTO)
+		mode(FC_RESIZE_AUTO),
+		linearFormat(FC_LINEAR_HALF),
+		dither(false)
 	{}
 };
 
+struct TImageBuffer; // image.cpp
+
+/* The pixel data is a reference-counted buffer: copies of a CImage share it,
+ * it is only cloned when a shared buffer is about to be modified
+ * (copy-on-write). The non-const getData() counts as modification. */
 class CImage {
 	private:
 		TImageInfo info;
 		TExifData  exif;
 
+		TImageBuffer* buffer;
 		void* data;
 
 		void dropData() noexcept;
 		void setFormat(const TImageInfo& newInfo) noexcept;
 		bool allocate(const TImageInfo& newInfo, bool clear=false) noexcept;
+		bool makeUnique() noexcept;
 
 	public:
 		CImage() noexcept;
@@ -125,6 +229,7 @@ class CImage {
 		const void* getData() const noexcept; // NULL if invalid 
 		void* getData() noexcept; // NULL if invalid
 		bool hasData() const noexcept;
+		bool isShared() const noexcept;
 		const TImageInfo& getInfo() const noexcept {return info;}
 		const TExifData& getExif() const noexcept {return exif;}
 		TExifData& getExif() noexcept {return exif;}
@@ -143,7 +248,12 @@ class CImage {
 		bool flipH() noexcept;
 		bool flipV() noexcept;
 
+		/* crop and resize keep planar YCbCr images planar */
 		bool cropTo(CImage& dst, const int32_t pos[2], const int32_t size[2]) const noexcept;
+		bool convertToInterleaved(CImage& dst) const noexcept;
+
+		const void* getPlane(size_t plane) const noexcept;
+		void* getPlane(size_t plane) noexcept;
 };
 
 #endif /* !FASTCROP_IMAGE_H */
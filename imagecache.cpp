@@ -0,0 +1,182 @@
+#include "imagecache.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <utility>
+
+/* if the size of the physical memory is unknown */
+static const size_t defaultBudget = 1024U * 1024U * 1024U;
+
+size_t CImageCache::getDefaultBudget() noexcept
+{
+	size_t mem = util::getPhysicalMemory();
+	return (mem) ? mem / 4 : defaultBudget;
+}
+
+CImageCache::CImageCache() noexcept :
+	budget(getDefaultBudget()),
+	useCounter(0),
+	pool(NULL),
+	releaseQueued(false),
+	lastRelease(0.0)
+{
+}
+
+/* releaseFreeMemory() walks the whole heap, which takes milliseconds:
+ * not on the render thread if it can be avoided */
+void CImageCache::releaseMemory() noexcept
+{
+	if (pool) {
+		if (releaseQueued.exchange(true)) {
+			return;
+		}
+		std::atomic<bool> *queued = &releaseQueued;
+		bool success = false;
+		try {
+			success = pool->submit(FC_TASK_BACKGROUND, [queued](const CCancelToken&) {
+				queued->store(false);
+				util::releaseFreeMemory();
+			});
+		} catch (...) {
+			success = false;
+		}
+		if (!success) {
+			releaseQueued = false;
+		}
+		return;
+	}
+	double now = util::getTime();
+	if (now - lastRelease >= 1.0) {
+		lastRelease = now;
+		util::releaseFreeMemory();
+	}
+}
+
+size_t CImageCache::find(const char *filename) const noexcept
+{
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (!strcmp(entries[i].filename.c_str(), filename)) {
+			return i;
+		}
+	}
+	return entries.size();
+}
+
+void CImageCache::remove(size_t idx) noexcept
+{
+	stats.residentBytes -= entries[idx].size;
+	if (idx + 1 < entries.size()) {
+		entries[idx] = std::move(entries.back());
+	}
+	entries.pop_back();
+	stats.entries = entries.size();
+}
+
+/* drop the least recently used images until required bytes are free */
+bool CImageCache::evict(size_t required) noexcept
+{
+	if (required > budget) {
+		return false;
+	}
+	size_t evicted = 0;
+	size_t freed = 0;
+	while (!entries.empty() && stats.residentBytes + required > budget) {
+		size_t oldest = 0;
+		for (size_t i = 1; i < entries.size(); i++) {
+			if (entries[i].lastUse < entries[oldest].lastUse) {
+				oldest = i;
+			}
+		}
+		freed += entries[oldest].size;
+		remove(oldest);
+		evicted++;
+	}
+	if (evicted) {
+		stats.evicted += evicted;
+		debug("image cache: evicted %u images, %u KiB", (unsigned)evicted, (unsigned)(freed / 1024U));
+		releaseMemory();
+	}
+	return true;
+}
+
+void CImageCache::setBudget(size_t bytes) noexcept
+{
+	if (bytes == budget) {
+		return;
+	}
+	budget = bytes;
+	evict(0);
+}
+
+bool CImageCache::insert(const char *filename, CImage& image, unsigned int tier, const TImageInfo& fullInfo) noexcept
+{
+	if (!filename || !image.hasData()) {
+		return false;
+	}
+	size_t idx = find(filename);
+	if (idx < entries.size()) {
+		remove(idx);
+	}
+	size_t size = image.getInfo().getDataSize();
+	if (!evict(size)) {
+		return false;
+	}
+	try {
+		TEntry e;
+		e.filename = filename;
+		e.image = std::move(image);
+		e.fullInfo = fullInfo;
+		e.tier = tier;
+		e.size = size;
+		e.lastUse = ++useCounter;
+		entries.push_back(std::move(e));
+	} catch (...) {
+		return false;
+	}
+	stats.inserted++;
+	stats.entries = entries.size();
+	stats.residentBytes += size;
+	if (stats.residentBytes > stats.peakBytes) {
+		stats.peakBytes = stats.residentBytes;
+	}
+	return true;
+}
+
+bool CImageCache::take(const char *filename, CImage& image, unsigned int& tier, TImageInfo& fullInfo) noexcept
+{
+	size_t idx = (filename && budget) ? find(filename) : entries.size();
+	if (idx >= entries.size()) {
+		return false;
+	}
+	TEntry& e = entries[idx];
+	image = std::move(e.image);
+	tier = e.tier;
+	fullInfo = e.fullInfo;
+	remove(idx);
+	stats.hits++;
+	return true;
+}
+
+void CImageCache::clear() noexcept
+{
+	bool hadEntries = !entries.empty();
+	entries.clear();
+	stats.entries = 0;
+	stats.residentBytes = 0;
+	if (hadEntries) {
+		releaseMemory();
+	}
+}
+
+void CImageCache::logStats() const noexcept
+{
+	const TImageCacheStats& s = stats;
+	if (!s.hits && !s.misses && !s.inserted) {
+		return;
+	}
+	util::info("image cache: %u hits, %u misses, %u inserted, %u evicted, %u images resident, %u/%u MiB (peak %u MiB)",
+		(unsigned)s.hits, (unsigned)s.misses, (unsigned)s.inserted, (unsigned)s.evicted, (unsigned)s.entries,
+		(unsigned)(s.residentBytes / (1024U * 1024U)), (unsigned)(budget / (1024U * 1024U)),
+		(unsigned)(s.peakBytes / (1024U * 1024U)));
+}
@@ -0,0 +1,102 @@
+#ifndef FASTCROP_IMAGECACHE_H
+#define FASTCROP_IMAGECACHE_H
+
+#include "image.h"
+#include "threadpool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+/* Keeps the decoded images which left the prefetch window, so going back
+ * to them does not decode them again. The cache is bounded by a byte budget
+ * (TImageInfo::getDataSize() of the pixel data), the least recently used
+ * images are evicted first, and the memory is handed back to the system
+ * afterwards. An image is either in the cache or loaded by an entity:
+ * take() removes it from the cache. The tier is not interpreted by the
+ * cache, it is the decode tier of the controller.
+ * Only for the thread which owns the controller. */
+
+struct TImageCacheStats {
+	size_t hits;
+	size_t misses;
+	size_t inserted;
+	size_t evicted;		/* dropped to stay within the budget */
+	size_t entries;
+	size_t residentBytes;
+	size_t peakBytes;
+
+	TImageCacheStats() noexcept :
+		hits(0),
+		misses(0),
+		inserted(0),
+		evicted(0),
+		entries(0),
+		residentBytes(0),
+		peakBytes(0)
+	{}
+};
+
+class CImageCache {
+	private:
+		struct TEntry {
+			std::string filename;
+			CImage image;
+			TImageInfo fullInfo;
+			unsigned int tier;
+			size_t size;
+			uint64_t lastUse;
+		};
+
+		std::vector<TEntry> entries;
+		size_t budget;
+		uint64_t useCounter;
+		TImageCacheStats stats;
+		CThreadPool *pool;
+		std::atomic<bool> releaseQueued;
+		double lastRelease;
+
+		size_t find(const char *filename) const noexcept;
+		void remove(size_t idx) noexcept;
+		bool evict(size_t required) noexcept;
+		void releaseMemory() noexcept;
+
+	public:
+		/* a quarter of the physical memory */
+		static size_t getDefaultBudget() noexcept;
+
+		CImageCache() noexcept;
+
+		CImageCache(const CImageCache& other) = delete;
+		CImageCache(CImageCache&& other) = delete;
+		CImageCache& operator=(const CImageCache& other) = delete;
+		CImageCache& operator=(CImageCache&& other) = delete;
+
+		/* hand the freed memory back to the system in this pool
+		 * (NULL: on this thread, at most once per second), it has to
+		 * be stopped before the cache is destroyed */
+		void setThreadPool(CThreadPool *threadPool) noexcept {pool = threadPool;}
+
+		/* 0 disables the cache */
+		void setBudget(size_t bytes) noexcept;
+		size_t getBudget() const noexcept {return budget;}
+
+		/* take over the image, replaces the one cached for filename,
+		 * returns false if it does not fit into the budget */
+		bool insert(const char *filename, CImage& image, unsigned int tier, const TImageInfo& fullInfo) noexcept;
+		/* move the image out of the cache, false on a miss. Misses
+		 * are not counted here, the cache may be checked several times
+		 * before an image is decoded */
+		bool take(const char *filename, CImage& image, unsigned int& tier, TImageInfo& fullInfo) noexcept;
+		/* count a miss, when the image is decoded after all */
+		void noteMiss() noexcept {if (budget) stats.misses++;}
+		void clear() noexcept;
+
+		const TImageCacheStats& getStats() const noexcept {return stats;}
+		void logStats() const noexcept;
+};
+
+#endif /* !FASTCROP_IMAGECACHE_H */
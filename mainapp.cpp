@@ -3,7 +3,14 @@
 
 #include "codec.h"
 #include "controller.h"
+#include "filecache.h"
+#include "gltimer.h"
+#include "glworker.h"
+#include "prefetch.h"
+#include "previewcache.h"
 #include "render.h"
+#include "scratch.h"
+#include "threadpool.h"
 #include "util.h"
 
 #ifdef WITH_IMGUI
@@ -23,8 +30,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <vector>
+
 const int baseMods = (GLFW_MOD_CONTROL | GLFW_MOD_SHIFT | GLFW_MOD_ALT);
 
+/* when nothing changes, wake up at least this often (in seconds) */
+const double idleTimeout = 0.5;
+
 /****************************************************************************
  * DATA STRUCTURES                                                          *
  ****************************************************************************/
@@ -51,6 +64,18 @@ struct AppConfig {
 	bool debugOutputSynchronous;
 	float colorBackground[4];
 	bool withGUI;
+	unsigned int uploadBudgetMB;	/* texture data uploaded per frame, 0: no limit */
+	double uploadBudgetMS;		/* time spent on uploads per frame, 0: no limit */
+	bool uploadThread;		/* create the GL images on a separate thread */
+	bool threadPool;		/* decode, resize and export in the background */
+	unsigned int workerThreads;	/* threads of the pool, 0: one less than the cores */
+	size_t fileCacheSize;		/* bytes of image files kept in memory, 0: always read them */
+	size_t previewCacheSize;	/* bytes of previews kept on disk, 0: no preview cache */
+	bool gpuTimers;			/* measure and log the GPU time of the passes */
+	bool continuous;		/* draw frames even if nothing changed */
+	bool headless;			/* render offscreen, run the script and exit */
+	const char *script;		/* commands for the headless mode, NULL: default */
+	const char *dumpPrefix;		/* prefix for the frames dumped in headless mode, NULL: no dumps */
 
 	AppConfig() :
 		posx(100),
@@ -68,10 +93,22 @@ struct AppConfig {
 		debugOutputSynchronous(false),
 		colorBackground{0.0f,0.0f,0.0f,0.0f},
 #ifdef WITH_IMGUI
-		withGUI(true)
+		withGUI(true),
 #else
-		withGUI(false)
+		withGUI(false),
 #endif
+		uploadBudgetMB(32),
+		uploadBudgetMS(4.0),
+		uploadThread(true),
+		threadPool(true),
+		workerThreads(0),
+		fileCacheSize(CFileCache::getDefaultBudget()),
+		previewCacheSize(2048U * 1024U * 1024U),
+		gpuTimers(true),
+		continuous(false),
+		headless(false),
+		script(NULL),
+		dumpPrefix(NULL)
 	{
 	}
 
@@ -85,6 +122,7 @@ struct AppConfig {
 typedef struct TMainApp {
 	/* the window and related state */
 	GLFWwindow *win;
+	GLFWwindow *uploadWin;	/* hidden, its context is used by the upload worker */
 	AppConfig* cfg;
 	int winWidth, winHeight;
 	double winToPixel[2];
@@ -105,13 +143,24 @@ typedef struct TMainApp {
 	int maxGlTextureSize;
 	int maxGlSize;
 
+	/* offscreen framebuffer of the headless mode, 0: draw to the window */
+	GLuint fbo;
+	GLuint fboColor;
+
+	CFileCache  fileCache;
+	CPreviewCache previewCache;
 	CCodecs     codecs;
 	CCodecSettings codecSettings;
 	CController controller;
 	CRenderer renderer;
+	CGLUploadWorker uploadWorker;
+	CGLTimers timers;
+	CPrefetchManager prefetcher;
+	CThreadPool pool; /* last: its tasks refer to the members above */
 
 	TMainApp() :
-		controller(codecs, codecSettings, codecSettings)
+		controller(codecs, codecSettings, codecSettings),
+		prefetcher(codecs, codecSettings)
 	{}
 } MainApp;
 
@@ -223,13 +272,53 @@ static void initGLState(MainApp* app, const AppConfig& cfg)
 	util::info("GL limits: tex size: %d, viewport: %dx%d, framebuffer: %dx%d, using limt: %d",
 			app->maxGlTextureSize, maxViewport[0], maxViewport[1], maxFB[0], maxFB[1], app->maxGlSize);
 
-	if (!app->controller.initGL()) {
+	if (!app->controller.initGL(app->maxGlSize)) {
 		util::warn("GL controller failed to initialize");
 	}
 	if (!app->renderer.initGL()) {
 		util::warn("GL renderer failed to initialize");
 	}
 	app->renderer.invalidateImageState();
+
+	if (cfg.gpuTimers && app->timers.initGL()) {
+		app->controller.setTimers(&app->timers);
+		app->renderer.setTimers(&app->timers);
+	}
+
+	if (app->uploadWin) {
+		if (app->uploadWorker.start(app->uploadWin)) {
+			util::info("creating GL images on a separate thread");
+			app->controller.setUploadWorker(&app->uploadWorker);
+		}
+	}
+}
+
+/* create the framebuffer the headless mode renders into */
+static bool initOffscreen(MainApp* app, int w, int h)
+{
+	glCreateRenderbuffers(1, &app->fboColor);
+	glNamedRenderbufferStorage(app->fboColor, GL_RGBA8, w, h);
+	glCreateFramebuffers(1, &app->fbo);
+	glNamedFramebufferRenderbuffer(app->fbo, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, app->fboColor);
+	GLenum status = glCheckNamedFramebufferStatus(app->fbo, GL_DRAW_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		util::warn("failed to create %dx%d offscreen framebuffer: 0x%x", w, h, (unsigned)status);
+		return false;
+	}
+	util::info("rendering offscreen at %dx%d", w, h);
+	return true;
+}
+
+static void dropOffscreen(MainApp* app)
+{
+	if (app->fbo) {
+		glDeleteFramebuffers(1, &app->fbo);
+		app->fbo = 0;
+	}
+	if (app->fboColor) {
+		glDeleteRenderbuffers(1, &app->fboColor);
+		app->fboColor = 0;
+	}
 }
 
 /****************************************************************************
@@ -240,6 +329,9 @@ static void doTestScaleFilter(MainApp *app)
 {
 	char suffix[16];
 	TConfig& cfg = app->controller.getConfig();
+	const TScratchStats& scratchStats = getScratchArena().getStats();
+	size_t fallbackAllocsBefore = scratchStats.fallbackAllocs;
+	unsigned int images = 0;
 
 	for (int m = ((int)FC_RESIZE_AUTO)+1;  m < (int)FC_RESIZE_COUNT; m++) {
 		TFCResizeMode mode = (TFCResizeMode)m;
@@ -249,17 +341,23 @@ static void doTestScaleFilter(MainApp *app)
 			for (int n = 0; n<(int)FC_SWS_COUNT; n++) {
 				cfg.resizeCtx.swsMode = (TFCSWSMode)n;
 				mysnprintf(suffix, sizeof(suffix), "_fct%d_%d", m, n);
-				app->controller.processImage(suffix);
+				app->controller.processImage(suffix, false);
+				images++;
 			}
 		} else {
 #endif
 			mysnprintf(suffix, sizeof(suffix), "_fct%d", m);
-			app->controller.processImage(suffix);
+			app->controller.processImage(suffix, false);
+			images++;
 #ifdef WITH_LIBSWSCALE
 		}
 #endif
 	}
 
+	if (images) {
+		util::info("scale filter test: %u images, %.2f scratch block/fallback allocations per image",
+			images, (double)(scratchStats.fallbackAllocs - fallbackAllocsBefore) / (double)images);
+	}
 
 }
 
@@ -283,6 +381,8 @@ static bool isOurInput(MainApp *app, bool mouse)
 				inputAllowed = false;
 			}
 		}
+		/* the GUI reacts to all input */
+		app->renderer.invalidateFrame();
 	}
 #endif
 	return inputAllowed;
@@ -307,6 +407,14 @@ static void callback_Resize(GLFWwindow *win, int w, int h)
 	app->winToPixel[1] = (double)ws.dims[1] / (double)app->winHeight;
 }
 
+/* This function is registered as the window refresh callback for GLFW,
+ * so GLFW will call this whenever the window contents are damaged. */
+static void callback_Refresh(GLFWwindow *win)
+{
+	MainApp *app=(MainApp*)glfwGetWindowUserPointer(win);
+	app->renderer.invalidateFrame();
+}
+
 /* This function is registered as the window size callback for GLFW,
  * so GLFW will call this whenever the window is resized. */
 static void callback_WinResize(GLFWwindow *win, int w, int h)
@@ -516,6 +624,9 @@ bool initMainApp(MainApp *app, AppConfig& cfg)
 
 	/* Initialize the app structure */
 	app->win=NULL;
+	app->uploadWin=NULL;
+	app->fbo=0;
+	app->fboColor=0;
 	app->cfg=&cfg;
 	app->flags=0;
 	app->avg_frametime=-1.0;
@@ -545,7 +656,7 @@ bool initMainApp(MainApp *app, AppConfig& cfg)
 	w = cfg.width;
 	h = cfg.height;
 
-	if (cfg.fullscreen) {
+	if (cfg.fullscreen && !cfg.headless) {
 		monitor = glfwGetPrimaryMonitor();
 	}
 	if (monitor) {
@@ -565,9 +676,15 @@ bool initMainApp(MainApp *app, AppConfig& cfg)
 		glfwWindowHint(GLFW_DECORATED, GL_FALSE);
 	}
 
-	/* create the window and the gl context */
+	/* create the window and the gl context, in headless mode
+	 * the window is invisible and just provides the context */
 	util::info("creating window and OpenGL context");
-	app->win=glfwCreateWindow(w, h, APP_TITLE, monitor, NULL);
+	if (cfg.headless) {
+		glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+		app->win=glfwCreateWindow(1, 1, APP_TITLE, NULL, NULL);
+	} else {
+		app->win=glfwCreateWindow(w, h, APP_TITLE, monitor, NULL);
+	}
 	if (!app->win) {
 		util::warn("failed to get window with OpenGL 4.5 core context");
 		return false;
@@ -584,20 +701,33 @@ bool initMainApp(MainApp *app, AppConfig& cfg)
 	app->mousePosPixel[1] = 0.0f;
 	app->modifiers = 0;
 
-	if (!monitor) {
+	if (!monitor && !cfg.headless) {
 		glfwSetWindowPos(app->win, x, y);
 	}
 
+	if (cfg.uploadThread) {
+		/* an invisible window just for a second context, sharing
+		 * the textures and sync objects with the main one */
+		glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+		app->uploadWin=glfwCreateWindow(1, 1, APP_TITLE " upload", NULL, app->win);
+		if (!app->uploadWin) {
+			util::warn("failed to create shared context, uploading textures in the main thread");
+		}
+	}
+
 	/* store a pointer to our application context in GLFW's window data.
 	 * This allows us to access our data from within the callbacks */
 	glfwSetWindowUserPointer(app->win, app);
-	/* register our callbacks */
-	glfwSetFramebufferSizeCallback(app->win, callback_Resize);
-	glfwSetWindowSizeCallback(app->win, callback_WinResize);
-	glfwSetKeyCallback(app->win, callback_Keyboard);
-	glfwSetCursorPosCallback(app->win, callback_mouse_position);
-	glfwSetMouseButtonCallback(app->win, callback_mouse_button);
-	glfwSetScrollCallback(app->win, callback_scroll);
+	/* register our callbacks, the headless mode takes no input */
+	if (!cfg.headless) {
+		glfwSetFramebufferSizeCallback(app->win, callback_Resize);
+		glfwSetWindowSizeCallback(app->win, callback_WinResize);
+		glfwSetWindowRefreshCallback(app->win, callback_Refresh);
+		glfwSetKeyCallback(app->win, callback_Keyboard);
+		glfwSetCursorPosCallback(app->win, callback_mouse_position);
+		glfwSetMouseButtonCallback(app->win, callback_mouse_button);
+		glfwSetScrollCallback(app->win, callback_scroll);
+	}
 
 	/* make the context the current context (of the current thread) */
 	glfwMakeContextCurrent(app->win);
@@ -605,7 +735,7 @@ bool initMainApp(MainApp *app, AppConfig& cfg)
 	/* ask the driver to enable synchronizing the buffer swaps to the
 	 * VBLANK of the display. Depending on the driver and the user's
 	 * setting, this may have no effect. But we can try... */
-	glfwSwapInterval(1);
+	glfwSwapInterval((cfg.headless) ? 0 : 1);
 
 	/* initialize glad,
 	 * this will load all OpenGL function pointers
@@ -623,6 +753,29 @@ bool initMainApp(MainApp *app, AppConfig& cfg)
 
 	app->flags |= APP_HAVE_GL;
 
+	/* the image shader converts planar YCbCr, so let the JPEG decoder skip
+	 * the color conversion and chroma upsampling for display */
+	app->codecSettings.planarYCbCr = true;
+
+	if (cfg.fileCacheSize) {
+		app->fileCache.setBudget(cfg.fileCacheSize);
+		app->codecs.setFileCache(&app->fileCache);
+	}
+
+	if (cfg.threadPool && app->pool.start(cfg.workerThreads)) {
+		app->controller.setThreadPool(&app->pool);
+		if (cfg.previewCacheSize && app->previewCache.init(cfg.previewCacheSize)) {
+			CPreviewCache *cache = &app->previewCache;
+			app->prefetcher.setPreviewCache(cache);
+			/* enforce the limit of earlier sessions */
+			app->pool.submit(FC_TASK_BACKGROUND, [cache](const CCancelToken&){cache->trim();});
+		}
+		if (app->prefetcher.start(&app->pool)) {
+			util::info("decoding images in the background");
+			app->controller.setPrefetchManager(&app->prefetcher);
+		}
+	}
+
 	if (cfg.withGUI) {
 #ifdef WITH_IMGUI
 		/* initialize imgui */
@@ -645,6 +798,10 @@ bool initMainApp(MainApp *app, AppConfig& cfg)
 	/* initialize the GL context */
 	initGLState(app, cfg);
 
+	if (cfg.headless && !initOffscreen(app, w, h)) {
+		return false;
+	}
+
 	/* initialize the timer */
 	app->timeCur=glfwGetTime();
 
@@ -657,8 +814,27 @@ static void destroyMainApp(MainApp *app)
 	if (app->flags & APP_HAVE_GLFW) {
 		if (app->win) {
 			if (app->flags & APP_HAVE_GL) {
+				app->controller.logPrefetchStats();
+				app->controller.logCacheStats();
+				app->controller.setPrefetchManager(NULL);
+				app->controller.setThreadPool(NULL);
+				app->prefetcher.stop();
+				if (app->pool.isRunning()) {
+					app->pool.logStats();
+					app->pool.stop();
+				}
+				app->fileCache.logStats();
+				app->codecs.setFileCache(NULL);
+				app->previewCache.logStats();
+				app->prefetcher.setPreviewCache(NULL);
+				app->controller.setUploadWorker(NULL);
+				app->uploadWorker.stop();
+				app->controller.setTimers(NULL);
+				app->renderer.setTimers(NULL);
+				app->timers.dropGL();
 				app->renderer.dropGL();
 				app->controller.dropGL();
+				dropOffscreen(app);
 				/* shut down imgui */
 #ifdef WITH_IMGUI
 				if (app->flags & APP_HAVE_IMGUI) {
@@ -668,6 +844,9 @@ static void destroyMainApp(MainApp *app)
 				}
 #endif
 			}
+			if (app->uploadWin) {
+				glfwDestroyWindow(app->uploadWin);
+			}
 			glfwDestroyWindow(app->win);
 		}
 		glfwTerminate();
@@ -680,17 +859,17 @@ static void destroyMainApp(MainApp *app)
 
 /* This draws the complete scene for a single eye */
 static void
-drawScene(MainApp *app, AppConfig& cfg)
+drawScene(MainApp *app, AppConfig& cfg, TGLUploadBudget& uploadBudget)
 {
 	/* set the viewport (might have changed since last iteration) */
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, app->fbo);
 	const TWindowState& ws = app->controller.getWindowState();
 	glViewport(0, 0, ws.dims[0], ws.dims[1]);
 
 	glClearColor(cfg.colorBackground[0], cfg.colorBackground[1], cfg.colorBackground[2], cfg.colorBackground[3]);
 	glClear(GL_COLOR_BUFFER_BIT); /* clear the buffers */
 
-	const CImageEntity& cur = app->controller.getCurrent();
+	const CImageEntity& cur = app->controller.getCurrent(uploadBudget);
 	app->renderer.render(cur, app->controller);
 
 
@@ -716,12 +895,27 @@ drawScene(MainApp *app, AppConfig& cfg)
 static bool
 displayFunc(MainApp *app, AppConfig& cfg)
 {
+	/* limit the texture uploads, large images are uploaded over
+	 * several frames */
+	TGLUploadBudget uploadBudget((size_t)cfg.uploadBudgetMB * 1024U * 1024U, cfg.uploadBudgetMS / 1000.0);
+
+	/* collect the GPU times of two frames ago */
+	app->timers.nextFrame();
+
 	// Render an animation frame
-	drawScene(app, cfg);
+	drawScene(app, cfg, uploadBudget);
+
+	/* the rest of the budget goes to the images we might show next */
+	app->controller.uploadNeighbours(uploadBudget);
 
 	/* finished with drawing, swap FRONT and BACK buffers to show what we
-	 * have rendered */
-	glfwSwapBuffers(app->win);
+	 * have rendered. Offscreen, we wait for the GPU instead, so that the
+	 * frame times include the GPU work */
+	if (app->fbo) {
+		glFinish();
+	} else {
+		glfwSwapBuffers(app->win);
+	}
 
 	/* In DEBUG builds, we also check for GL errors in the display
 	 * function, to make sure no GL error goes unnoticed. */
@@ -733,45 +927,68 @@ displayFunc(MainApp *app, AppConfig& cfg)
  * MAIN LOOP                                                                *
  ****************************************************************************/
 
+/* true if the next frame would differ from the last one */
+static bool needsRedraw(MainApp *app, const AppConfig& cfg)
+{
+	return cfg.continuous || app->renderer.isDirty() || app->controller.isUpdatePending();
+}
+
 /* The main loop of the application. This will call the display function
- *  until the application is closed. This function also keeps timing
- *  statistics. */
+ *  until the application is closed. Frames are only drawn if something
+ *  changed, otherwise we sleep until the next event. The upload worker
+ *  wakes us up with an empty event. This function also keeps timing
+ *  statistics, over the frames actually drawn. */
 static void mainLoop(MainApp *app, AppConfig& cfg)
 {
 	unsigned int frame=0;
+	double frameTime=0.0;
 	double start_time=glfwGetTime();
 	double last_time=start_time;
 
 	util::info("entering main loop");
 	while (!glfwWindowShouldClose(app->win)) {
+		/* This is needed for GLFW event handling. These functions
+		 * will call the registered callback functions to forward
+		 * the events to us. */
+		if (needsRedraw(app, cfg)) {
+			glfwPollEvents();
+		} else {
+			glfwWaitEventsTimeout(app->controller.getIdleTimeout(idleTimeout));
+		}
+
 		/* update the current time and time delta to last frame */
 		double now=glfwGetTime();
 		app->timeDelta = now - app->timeCur;
 		app->timeCur = now;
 
-		/* update FPS estimate at most once every second */
+		/* update FPS estimate at most once every second, the frame
+		 * time is the time spent on drawing, excluding idle time */
 		double elapsed = app->timeCur - last_time;
 		if (elapsed >= 1.0) {
-			char WinTitle[80];
-			app->avg_frametime=1000.0 * elapsed/(double)frame;
-			app->avg_fps=(double)frame/elapsed;
+			if (frame) {
+				char WinTitle[80];
+				app->avg_frametime=1000.0 * frameTime/(double)frame;
+				app->avg_fps=(double)frame/elapsed;
+				/* update window title */
+				mysnprintf(WinTitle, sizeof(WinTitle), APP_TITLE "   /// AVG: %4.2fms/frame (%.1ffps)", app->avg_frametime, app->avg_fps);
+				glfwSetWindowTitle(app->win, WinTitle);
+				util::info("frame time: %4.2fms/frame (%u frames in %.1fs, %.1ffps)",app->avg_frametime, frame, elapsed, app->avg_fps);
+				app->timers.logStats();
+			}
 			last_time=app->timeCur;
 			frame=0;
-			/* update window title */
-			mysnprintf(WinTitle, sizeof(WinTitle), APP_TITLE "   /// AVG: %4.2fms/frame (%.1ffps)", app->avg_frametime, app->avg_fps);
-			glfwSetWindowTitle(app->win, WinTitle);
-			util::info("frame time: %4.2fms/frame (%.1ffps)",app->avg_frametime, app->avg_fps);
+			frameTime=0.0;
 		}
 
-		/* This is needed for GLFW event handling. This function
-		 * will call the registered callback functions to forward
-		 * the events to us. */
-		glfwPollEvents();
+		if (!needsRedraw(app, cfg)) {
+			continue;
+		}
 
 		/* call the display function */
 		if (!displayFunc(app, cfg)) {
 			break;
 		}
+		frameTime += glfwGetTime() - now;
 		app->frame++;
 		frame++;
 		if (cfg.frameCount && app->frame >= cfg.frameCount) {
@@ -783,12 +1000,240 @@ static void mainLoop(MainApp *app, AppConfig& cfg)
 		(double)app->frame/(app->timeCur-start_time) );
 }
 
+/****************************************************************************
+ * HEADLESS MODE                                                            *
+ ****************************************************************************/
+
+/* The headless mode renders into an offscreen framebuffer of the window
+ * size and runs a script instead of the main loop, one command per line:
+ *   next [n], prev [n]	switch the image
+ *   zoom <factor>		adjust the zoom
+ *   crop-scale <factor>	adjust the crop scale
+ *   aspect <a> <b>		set the crop aspect ratio
+ *   reset			reset the crop and display state
+ *   draw [n]			draw n frames (default: 1)
+ *   settle			draw until all uploads are finished
+ *   dump [name]		settle and write the frame to <dump prefix><name>.png
+ * Empty lines and lines starting with '#' are ignored. Without a script,
+ * the first image is dumped and --frameCount (default: 100) frames are
+ * drawn. Finally, the frame time statistics are logged. */
+
+/* upper limit for the frames of a settle command */
+const unsigned int headlessMaxSettleFrames = 1000;
+
+struct THeadlessState {
+	std::vector<double> frameTimes;	/* in ms */
+	unsigned int dumps;
+
+	THeadlessState() :
+		dumps(0)
+	{}
+};
+
+/* draw a frame, even if nothing changed */
+static bool drawFrameHeadless(MainApp *app, AppConfig& cfg, THeadlessState& hs)
+{
+	double start = glfwGetTime();
+	/* handle the wakeups of the upload worker */
+	glfwPollEvents();
+	app->renderer.invalidateFrame();
+	if (!displayFunc(app, cfg)) {
+		return false;
+	}
+	try {
+		hs.frameTimes.push_back(1000.0 * (glfwGetTime() - start));
+	} catch (...) {
+		util::warn("headless: failed to record frame time");
+	}
+	app->frame++;
+	return true;
+}
+
+/* draw frames until the current image and its neighbours are uploaded */
+static bool settleHeadless(MainApp *app, AppConfig& cfg, THeadlessState& hs)
+{
+	for (unsigned int i = 0; i < headlessMaxSettleFrames; i++) {
+		bool pending = app->controller.isUpdatePending();
+		if (!pending && app->controller.isWorkQueued()) {
+			/* nothing to do until the upload worker wakes us up */
+			glfwWaitEventsTimeout(idleTimeout);
+			continue;
+		}
+		if (!pending && !app->renderer.isDirty()) {
+			return true;
+		}
+		if (!drawFrameHeadless(app, cfg, hs)) {
+			return false;
+		}
+	}
+	util::warn("headless: uploads did not finish after %u frames", headlessMaxSettleFrames);
+	return true;
+}
+
+/* write the current frame as PNG, does nothing without a dump prefix */
+static bool dumpFrameHeadless(MainApp *app, const AppConfig& cfg, THeadlessState& hs, const char *name)
+{
+	if (!cfg.dumpPrefix) {
+		return true;
+	}
+
+	const TWindowState& ws = app->controller.getWindowState();
+	CImage img;
+	if (!img.create(TImageInfo((size_t)ws.dims[0], (size_t)ws.dims[1], 3))) {
+		util::warn("headless: failed to allocate %dx%d frame", ws.dims[0], ws.dims[1]);
+		return false;
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, app->fbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, ws.dims[0], ws.dims[1], GL_RGB, GL_UNSIGNED_BYTE, img.getData());
+	/* GL has the origin at the bottom */
+	img.flipV();
+
+	char filename[4096];
+	if (name) {
+		mysnprintf(filename, sizeof(filename), "%s%s.png", cfg.dumpPrefix, name);
+	} else {
+		mysnprintf(filename, sizeof(filename), "%s%04u.png", cfg.dumpPrefix, hs.dumps);
+	}
+	hs.dumps++;
+
+	CCodecSettings settings;
+	if (!app->codecs.encode(filename, img, settings)) {
+		util::warn("headless: failed to write '%s'", filename);
+		return false;
+	}
+	util::info("headless: wrote '%s'", filename);
+	return true;
+}
+
+/* run a single script command, line is modified */
+static bool runHeadlessCommand(MainApp *app, AppConfig& cfg, THeadlessState& hs, char *line)
+{
+	const char *args[4];
+	int argCount = 0;
+	char *pos = line;
+
+	while (argCount < 4) {
+		while (*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\n') {
+			pos++;
+		}
+		if (!*pos || *pos == '#') {
+			break;
+		}
+		args[argCount++] = pos;
+		while (*pos && *pos != ' ' && *pos != '\t' && *pos != '\r' && *pos != '\n') {
+			pos++;
+		}
+		if (*pos) {
+			*pos++ = 0;
+		}
+	}
+	if (!argCount) {
+		return true;
+	}
+
+	const char *cmd = args[0];
+	if (!strcmp(cmd, "next") || !strcmp(cmd, "prev")) {
+		int n = (argCount > 1) ? (int)strtol(args[1], NULL, 10) : 1;
+		app->controller.switchDelta((cmd[0] == 'n') ? n : -n);
+		app->renderer.invalidateCropState();
+		app->renderer.invalidateImageState();
+	} else if (!strcmp(cmd, "zoom") && argCount > 1) {
+		app->controller.adjustZoom(strtof(args[1], NULL));
+		app->renderer.invalidateDisplayState();
+	} else if (!strcmp(cmd, "crop-scale") && argCount > 1) {
+		app->controller.adjustCropScale(strtof(args[1], NULL));
+		app->renderer.invalidateCropState();
+	} else if (!strcmp(cmd, "aspect") && argCount > 2) {
+		app->controller.setCropAspect(strtof(args[1], NULL), strtof(args[2], NULL));
+		app->renderer.invalidateCropState();
+	} else if (!strcmp(cmd, "reset")) {
+		app->controller.resetCropState(false);
+		app->controller.resetDisplayState();
+		app->renderer.invalidateCropState();
+		app->renderer.invalidateDisplayState();
+	} else if (!strcmp(cmd, "draw")) {
+		unsigned int n = (argCount > 1) ? (unsigned)strtoul(args[1], NULL, 10) : 1;
+		for (unsigned int i = 0; i < n; i++) {
+			if (!drawFrameHeadless(app, cfg, hs)) {
+				return false;
+			}
+		}
+	} else if (!strcmp(cmd, "settle")) {
+		return settleHeadless(app, cfg, hs);
+	} else if (!strcmp(cmd, "dump")) {
+		return settleHeadless(app, cfg, hs) && dumpFrameHeadless(app, cfg, hs, (argCount > 1) ? args[1] : NULL);
+	} else {
+		util::warn("headless: invalid command '%s'", cmd);
+		return false;
+	}
+	return true;
+}
+
+static void logFrameStatsHeadless(THeadlessState& hs, double elapsed)
+{
+	std::vector<double>& t = hs.frameTimes;
+	if (t.empty()) {
+		util::info("headless: no frames drawn");
+		return;
+	}
+	std::sort(t.begin(), t.end());
+	double sum = 0.0;
+	for (size_t i = 0; i < t.size(); i++) {
+		sum += t[i];
+	}
+	util::info("headless: %u frames in %.2fs, frame time: min %.3fms, avg %.3fms, p99 %.3fms, max %.3fms",
+		(unsigned)t.size(), elapsed, t[0], sum / (double)t.size(), t[((t.size() - 1) * 99) / 100], t[t.size() - 1]);
+}
+
+/* returns false if the script failed */
+static bool runHeadless(MainApp *app, AppConfig& cfg)
+{
+	THeadlessState hs;
+	bool success = true;
+	double start = glfwGetTime();
+
+	util::info("running headless");
+	if (cfg.script) {
+		FILE *file = util::fopen_wrapper(cfg.script, "rt");
+		if (!file) {
+			util::warn("headless: failed to open script '%s'", cfg.script);
+			return false;
+		}
+		char line[1024];
+		unsigned int lineNo = 0;
+		while (success && fgets(line, sizeof(line), file)) {
+			lineNo++;
+			if (!runHeadlessCommand(app, cfg, hs, line)) {
+				util::warn("headless: script '%s' failed in line %u", cfg.script, lineNo);
+				success = false;
+			}
+		}
+		fclose(file);
+	} else {
+		char line[32];
+		mysnprintf(line, sizeof(line), "draw %u", (cfg.frameCount) ? cfg.frameCount : 100U);
+		success = settleHeadless(app, cfg, hs) && dumpFrameHeadless(app, cfg, hs, NULL) && runHeadlessCommand(app, cfg, hs, line);
+	}
+
+	logFrameStatsHeadless(hs, glfwGetTime() - start);
+	app->timers.logStats();
+	return success;
+}
+
 /****************************************************************************
  * SIMPLE COMMAND LINE PARSER                                               *
  ****************************************************************************/
 
 void parseCommandlineArgs(AppConfig& cfg, MainApp& app, int argc, char**argv)
 {
+	/* at most, if every argument is a file */
+	size_t nameBytes = 0;
+	for (int i = 1; i < argc; i++) {
+		nameBytes += strlen(argv[i]) + 1;
+	}
+	app.controller.reserveFiles((size_t)argc, nameBytes);
+
 	for (int i = 1; i < argc; i++) {
 		if (!strcmp(argv[i], "--fullscreen")) {
 			cfg.fullscreen = true;
@@ -801,6 +1246,17 @@ void parseCommandlineArgs(AppConfig& cfg, MainApp& app, int argc, char**argv)
 			cfg.withGUI = false;
 		} else if (!strcmp(argv[i], "--with-gui")) {
 			cfg.withGUI = true;
+		} else if (!strcmp(argv[i], "--no-upload-thread")) {
+			cfg.uploadThread = false;
+		} else if (!strcmp(argv[i], "--no-thread-pool")) {
+			cfg.threadPool = false;
+		} else if (!strcmp(argv[i], "--no-gpu-timers")) {
+			cfg.gpuTimers = false;
+		} else if (!strcmp(argv[i], "--continuous")) {
+			cfg.continuous = true;
+		} else if (!strcmp(argv[i], "--headless")) {
+			cfg.headless = true;
+			cfg.withGUI = false;
 		} else {
 			bool unhandled = false;
 			if (i + 1 < argc) {
@@ -814,6 +1270,22 @@ void parseCommandlineArgs(AppConfig& cfg, MainApp& app, int argc, char**argv)
 					cfg.posy = (int)strtol(argv[++i], NULL, 10);
 				} else if (!strcmp(argv[i], "--frameCount")) {
 					cfg.frameCount = (unsigned)strtoul(argv[++i], NULL, 10);
+				} else if (!strcmp(argv[i], "--threads")) {
+					cfg.workerThreads = (unsigned)strtoul(argv[++i], NULL, 10);
+				} else if (!strcmp(argv[i], "--upload-budget-mb")) {
+					cfg.uploadBudgetMB = (unsigned)strtoul(argv[++i], NULL, 10);
+				} else if (!strcmp(argv[i], "--file-cache-mb")) {
+					cfg.fileCacheSize = (size_t)strtoul(argv[++i], NULL, 10) * 1024U * 1024U;
+				} else if (!strcmp(argv[i], "--preview-cache-mb")) {
+					cfg.previewCacheSize = (size_t)strtoul(argv[++i], NULL, 10) * 1024U * 1024U;
+				} else if (!strcmp(argv[i], "--image-cache-mb")) {
+					app.controller.getConfig().imageCacheSize = (size_t)strtoul(argv[++i], NULL, 10) * 1024U * 1024U;
+				} else if (!strcmp(argv[i], "--upload-budget-ms")) {
+					cfg.uploadBudgetMS = strtod(argv[++i], NULL);
+				} else if (!strcmp(argv[i], "--script")) {
+					cfg.script = argv[++i];
+				} else if (!strcmp(argv[i], "--dump-prefix")) {
+					cfg.dumpPrefix = argv[++i];
 				} else if (!strcmp(argv[i], "--gl-debug-level")) {
 					cfg.debugOutputLevel = (DebugOutputLevel)strtoul(argv[++i], NULL, 10);
 				} else {
@@ -843,6 +1315,7 @@ int REALMAIN (int argc, char **argv)
 {
 	AppConfig cfg;	/* the generic configuration */
 	MainApp app;	/* the cube application stata stucture */
+	int result = 0;
 #ifdef WITH_IMGUI
 	/*
 	filedialog::CFileDialogTracks fileDialog(app.animCtrl);
@@ -866,12 +1339,20 @@ int REALMAIN (int argc, char **argv)
 		*/
 #endif
 		/* initialization succeeded, enter the main loop */
-		mainLoop(&app, cfg);
+		if (cfg.headless) {
+			if (!runHeadless(&app, cfg)) {
+				result = 1;
+			}
+		} else {
+			mainLoop(&app, cfg);
+		}
+	} else {
+		result = 1;
 	}
 	/* clean everything up */
 	destroyMainApp(&app);
 
-	return 0;
+	return result;
 }
 
 #ifdef WIN32
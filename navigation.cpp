@@ -0,0 +1,91 @@
+#include "navigation.h"
+
+#include <math.h>
+
+const double CNavigationModel::skimInterval = 0.25;
+const double CNavigationModel::settleTime = 0.35;
+const double CNavigationModel::lookahead = 0.75;
+const size_t CNavigationModel::maxWindow = 24;
+
+CNavigationModel::CNavigationModel() noexcept
+{
+	reset();
+}
+
+void CNavigationModel::reset() noexcept
+{
+	for (size_t i = 0; i < historySize; i++) {
+		dwell[i] = 0.0;
+	}
+	count = 0;
+	pos = 0;
+	lastSwitch = -1.0;
+	direction = 1;
+}
+
+void CNavigationModel::onSwitch(int delta, double now) noexcept
+{
+	if (!delta) {
+		return;
+	}
+	int dir = (delta > 0) ? 1 : -1;
+	if (dir != direction) {
+		/* turning around starts over */
+		count = 0;
+		pos = 0;
+	} else if (lastSwitch >= 0.0) {
+		dwell[pos] = now - lastSwitch;
+		pos = (pos + 1) % historySize;
+		if (count < historySize) {
+			count++;
+		}
+	}
+	direction = dir;
+	lastSwitch = now;
+}
+
+double CNavigationModel::getAverageDwell(size_t n) const noexcept
+{
+	if (n > count) {
+		n = count;
+	}
+	if (!n) {
+		return 0.0;
+	}
+	double sum = 0.0;
+	for (size_t i = 0; i < n; i++) {
+		sum += dwell[(pos + historySize - 1 - i) % historySize];
+	}
+	return sum / (double)n;
+}
+
+bool CNavigationModel::isSkimming(double now) const noexcept
+{
+	if (count < skimSwitches || lastSwitch < 0.0 || now - lastSwitch >= settleTime) {
+		return false;
+	}
+	return getAverageDwell(skimSwitches) < skimInterval;
+}
+
+void CNavigationModel::getWindow(double now, size_t baseAhead, size_t baseBehind, size_t& ahead, size_t& behind) const noexcept
+{
+	ahead = baseAhead;
+	behind = baseBehind;
+	if (isSkimming(now)) {
+		double avg = getAverageDwell(skimSwitches);
+		size_t n = (avg > 0.0) ? (size_t)ceil(lookahead / avg) : maxWindow;
+		if (n > maxWindow) {
+			n = maxWindow;
+		}
+		if (n > ahead) {
+			ahead = n;
+		}
+		/* nobody looks back while skimming */
+		behind = (baseBehind > 1) ? 1 : baseBehind;
+	}
+	if (direction < 0) {
+		size_t tmp = ahead;
+		ahead = behind;
+		behind = tmp;
+	}
+}
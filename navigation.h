@@ -0,0 +1,47 @@
+#ifndef FASTCROP_NAVIGATION_H
+#define FASTCROP_NAVIGATION_H
+
+#include <stddef.h>
+
+/* Estimates how the user moves through the images from the switches: the
+ * direction, how fast the images are switched (e.g. the key repeat rate
+ * while a key is held) and how long the recent images were looked at.
+ * The user skims while the recent switches came faster than skimInterval,
+ * until no switch came for settleTime. While skimming, the prefetch window
+ * grows in the direction of travel to cover lookahead seconds of
+ * switches. */
+
+class CNavigationModel {
+	private:
+		static const size_t historySize = 8;	/* recent dwell times */
+		static const size_t skimSwitches = 3;	/* needed to detect skimming */
+
+		double dwell[historySize];	/* time between switches, newest at pos-1 */
+		size_t count;
+		size_t pos;
+		double lastSwitch;		/* time of the last switch, <0: none */
+		int direction;			/* of the last switch: 1 forward, -1 backward */
+
+	public:
+		static const double skimInterval;	/* max. average dwell time while skimming, seconds */
+		static const double settleTime;		/* the user stopped if nothing happened for this long */
+		static const double lookahead;		/* seconds of switches to prefetch while skimming */
+		static const size_t maxWindow;		/* images prefetched in the direction of travel */
+
+		CNavigationModel() noexcept;
+
+		void reset() noexcept;
+		void onSwitch(int delta, double now) noexcept;
+
+		int getDirection() const noexcept {return direction;}
+		/* average of the recent dwell times, 0: not enough switches yet */
+		double getAverageDwell(size_t n = historySize) const noexcept;
+		bool isSkimming(double now) const noexcept;
+		/* the time when isSkimming() becomes false without another switch */
+		double getSkimEnd() const noexcept {return lastSwitch + settleTime;}
+
+		/* the prefetch window for the current state */
+		void getWindow(double now, size_t baseAhead, size_t baseBehind, size_t& ahead, size_t& behind) const noexcept;
+};
+
+#endif /* !FASTCROP_NAVIGATION_H */
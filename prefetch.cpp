@@ -0,0 +1,192 @@
+#include "prefetch.h"
+#include "codec.h"
+#include "util.h"
+
+#include <GLFW/glfw3.h>
+
+#include <utility>
+
+CPrefetchManager::CPrefetchManager(CCodecs& c, const CCodecSettings& s) noexcept :
+	codecs(c),
+	settings(s),
+	pool(NULL),
+	previewCache(NULL),
+	nextTicket(1)
+{
+}
+
+CPrefetchManager::~CPrefetchManager() noexcept
+{
+	stop();
+}
+
+bool CPrefetchManager::start(CThreadPool *threadPool) noexcept
+{
+	if (isRunning() || !threadPool || !threadPool->isRunning()) {
+		return false;
+	}
+	pool = threadPool;
+	return true;
+}
+
+void CPrefetchManager::stop() noexcept
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (size_t i = 0; i < jobs.size(); i++) {
+		jobs[i].token.cancel();
+	}
+	jobs.clear();
+	results.clear();
+	pool = NULL;
+}
+
+size_t CPrefetchManager::findJob(unsigned int ticket) const noexcept
+{
+	for (size_t i = 0; i < jobs.size(); i++) {
+		if (jobs[i].ticket == ticket) {
+			return i;
+		}
+	}
+	return jobs.size();
+}
+
+/* submit a task for the job, with a new token, called with the mutex held */
+bool CPrefetchManager::queueJob(TJob& job) noexcept
+{
+	if (!job.token.reset()) {
+		return false;
+	}
+	unsigned int ticket = job.ticket;
+	return pool->submit(job.priority, [this, ticket](const CCancelToken& token){run(ticket, token);}, job.token);
+}
+
+void CPrefetchManager::run(unsigned int ticket, const CCancelToken& token) noexcept
+{
+	TPrefetchResult r;
+	std::string filename;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t idx = findJob(ticket);
+		if (idx >= jobs.size() || jobs[idx].running || token.isCancelled()) {
+			/* cancelled, or resubmitted (with a new token) and
+			 * already taken */
+			return;
+		}
+		try {
+			filename = jobs[idx].filename;
+		} catch (...) {
+			jobs.erase(jobs.begin() + idx);
+			return;
+		}
+		jobs[idx].running = true;
+		r.ctx = jobs[idx].request;
+		r.ticket = ticket;
+		r.user = jobs[idx].user;
+	}
+
+	bool cached = (previewCache && previewCache->load(filename.c_str(), r.image, r.ctx));
+	if (cached) {
+		r.success = true;
+	} else {
+		r.ctx.cancel = &token;
+		r.success = codecs.decode(filename.c_str(), r.image, settings, &r.ctx);
+		r.ctx.cancel = NULL;
+	}
+
+	CThreadPool *storePool = NULL;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t idx = findJob(ticket);
+		if (idx >= jobs.size() || token.isCancelled()) {
+			/* cancelled meanwhile, the codec gave up: not a decode
+			 * failure, a job which is still wanted runs again */
+			if (idx < jobs.size()) {
+				jobs[idx].running = false;
+				if (!queueJob(jobs[idx])) {
+					jobs.erase(jobs.begin() + idx);
+				}
+			}
+			debug("prefetch: dropped the decode of '%s'", filename.c_str());
+			return;
+		}
+		jobs.erase(jobs.begin() + idx);
+		storePool = pool;
+	}
+	if (r.success && !cached && previewCache && storePool && r.ctx.scaleShift && !r.ctx.isThumbnail) {
+		/* writing it out must not delay the result */
+		CPreviewCache *cache = previewCache;
+		CImage preview = r.image;
+		TCodecDecodeCtx ctx = r.ctx;
+		try {
+			storePool->submit(FC_TASK_BACKGROUND, [cache, filename, preview, ctx](const CCancelToken&){cache->store(filename.c_str(), preview, ctx);});
+		} catch (...) {
+			util::warn("prefetch: failed to queue the preview of '%s'", filename.c_str());
+		}
+	}
+	if (results.push(std::move(r))) {
+		glfwPostEmptyEvent();
+	} else {
+		util::warn("prefetch: failed to queue result");
+	}
+}
+
+unsigned int CPrefetchManager::submit(const char *filename, TFCTaskPriority priority, const TCodecDecodeCtx& request, void *user) noexcept
+{
+	if (!isRunning() || !filename) {
+		return 0;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	for (size_t i = 0; i < jobs.size(); i++) {
+		TJob& job = jobs[i];
+		if (job.user != user) {
+			continue;
+		}
+		/* single flight */
+		if (job.running) {
+			return job.ticket;
+		}
+		job.request = request;
+		if (priority < job.priority) {
+			job.token.cancel();
+			job.priority = priority;
+			if (!queueJob(job)) {
+				jobs.erase(jobs.begin() + i);
+				return 0;
+			}
+		}
+		return job.ticket;
+	}
+
+	unsigned int ticket = nextTicket++;
+	if (!nextTicket) {
+		nextTicket = 1;
+	}
+	try {
+		TJob job;
+		job.ticket = ticket;
+		job.user = user;
+		job.filename = filename;
+		job.priority = priority;
+		job.request = request;
+		job.running = false;
+		jobs.push_back(std::move(job));
+	} catch (...) {
+		return 0;
+	}
+	if (!queueJob(jobs.back())) {
+		jobs.pop_back();
+		return 0;
+	}
+	return ticket;
+}
+
+void CPrefetchManager::cancel(unsigned int ticket) noexcept
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t idx = findJob(ticket);
+	if (idx < jobs.size()) {
+		/* a running decode is aborted by the codec */
+		jobs[idx].token.cancel();
+		jobs.erase(jobs.begin() + idx);
+	}
+}
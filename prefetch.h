@@ -0,0 +1,97 @@
+#ifndef FASTCROP_PREFETCH_H
+#define FASTCROP_PREFETCH_H
+
+#include "codec.h"
+#include "completion.h"
+#include "image.h"
+#include "previewcache.h"
+#include "threadpool.h"
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Decodes images in the thread pool before they are needed. Each
+ * decode is identified by a ticket. Requests for a receiver (user pointer)
+ * which already has a decode queued or running are coalesced: they get the
+ * ticket of that decode. A queued one takes over the new request, and is
+ * resubmitted if the priority class rose.
+ *
+ * The results are published through a lock-free completion queue, which
+ * the render thread drains once per frame, so it never waits for the
+ * workers. They wake up the main loop with glfwPostEmptyEvent(). Queued
+ * and running decodes can be cancelled: the codecs check the cancel token
+ * of the task and give up early. The thread pool has to be stopped before the
+ * manager is destroyed.
+ *
+ * With a preview cache, reduced decodes are served from it if possible,
+ * and the previews decoded from the files are stored into it by background
+ * tasks. */
+
+struct TPrefetchResult {
+	unsigned int ticket;
+	void *user;		/* as passed to submit() */
+	CImage image;
+	TCodecDecodeCtx ctx;	/* the request and what the codec delivered */
+	bool success;
+
+	TPrefetchResult() noexcept :
+		ticket(0),
+		user(NULL),
+		success(false)
+	{}
+};
+
+class CPrefetchManager {
+	private:
+		struct TJob {
+			unsigned int ticket;
+			void *user;
+			std::string filename;
+			TFCTaskPriority priority;
+			TCodecDecodeCtx request;
+			CCancelToken token;
+			bool running;
+		};
+
+		CCodecs& codecs;
+		const CCodecSettings& settings;
+		CThreadPool *pool;
+		CPreviewCache *previewCache;
+		std::mutex mutex;
+		std::vector<TJob> jobs;			/* queued and running */
+		CCompletionQueue<TPrefetchResult> results;
+		unsigned int nextTicket;
+
+		void run(unsigned int ticket, const CCancelToken& token) noexcept;
+		size_t findJob(unsigned int ticket) const noexcept;
+		bool queueJob(TJob& job) noexcept;
+
+	public:
+		CPrefetchManager(CCodecs& c, const CCodecSettings& s) noexcept;
+		~CPrefetchManager() noexcept;
+
+		CPrefetchManager(const CPrefetchManager& other) = delete;
+		CPrefetchManager(CPrefetchManager&& other) = delete;
+		CPrefetchManager& operator=(const CPrefetchManager& other) = delete;
+		CPrefetchManager& operator=(CPrefetchManager&& other) = delete;
+
+		bool start(CThreadPool *threadPool) noexcept;
+		void stop() noexcept;
+		bool isRunning() const noexcept {return pool != NULL;}
+		/* set before start(), NULL for none */
+		void setPreviewCache(CPreviewCache *cache) noexcept {previewCache = cache;}
+
+		/* queue a decode with the reduction allowed by request (see
+		 * TCodecDecodeCtx, the cancel token is set by the manager),
+		 * returns the ticket, 0 on failure */
+		unsigned int submit(const char *filename, TFCTaskPriority priority, const TCodecDecodeCtx& request, void *user) noexcept;
+		void cancel(unsigned int ticket) noexcept;
+
+		/* get the next decoded image, non-blocking,
+		 * only for the thread which owns the manager */
+		bool fetch(TPrefetchResult& result) noexcept {return results.pop(result);}
+		bool hasResults() const noexcept {return !results.isEmpty();}
+};
+
+#endif /* !FASTCROP_PREFETCH_H */
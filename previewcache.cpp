@@ -0,0 +1,356 @@
+#include "previewcache.h"
+#include "codec.h"
+#include "image.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+struct TPreviewImageHeader {
+	uint32_t width;
+	uint32_t height;
+	uint32_t channels;
+	uint32_t bytesPerChannel;
+	uint32_t layout;
+	uint32_t chromaShift[2];
+	uint32_t reserved;
+	uint64_t dataSize;
+};
+
+/* header of the cache files, followed by the data of the thumbnail and
+ * of the preview */
+struct TPreviewFileHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t hash;
+	uint32_t fullWidth;
+	uint32_t fullHeight;
+	uint32_t scaleShift;	/* of the preview */
+	uint32_t reserved;
+	TPreviewImageHeader thumbnail;
+	TPreviewImageHeader preview;
+};
+
+static const char previewFileMagic[4] = {'F', 'C', 'P', 'V'};
+static const uint32_t previewFileVersion = 1;
+static const char previewFileExt[] = ".fcp";
+
+/* numbers the temporary files of the stores */
+static std::atomic<unsigned int> tmpCounter(0);
+
+/* FNV-1a */
+static uint64_t hashBytes(uint64_t h, const void *data, size_t size) noexcept
+{
+	const unsigned char *d = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++) {
+		h ^= (uint64_t)d[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void setImageHeader(const TImageInfo& info, TPreviewImageHeader& hdr)
+{
+	hdr.width = (uint32_t)info.width;
+	hdr.height = (uint32_t)info.height;
+	hdr.channels = (uint32_t)info.channels;
+	hdr.bytesPerChannel = (uint32_t)info.bytesPerChannel;
+	hdr.layout = (uint32_t)info.layout;
+	hdr.chromaShift[0] = (uint32_t)info.chromaShift[0];
+	hdr.chromaShift[1] = (uint32_t)info.chromaShift[1];
+	hdr.reserved = 0;
+	hdr.dataSize = (uint64_t)info.getDataSize();
+}
+
+static bool getImageInfo(const TPreviewImageHeader& hdr, TImageInfo& info)
+{
+	info.width = (size_t)hdr.width;
+	info.height = (size_t)hdr.height;
+	info.channels = (size_t)hdr.channels;
+	info.bytesPerChannel = (size_t)hdr.bytesPerChannel;
+	info.layout = (TImageLayout)hdr.layout;
+	info.chromaShift[0] = (size_t)hdr.chromaShift[0];
+	info.chromaShift[1] = (size_t)hdr.chromaShift[1];
+	return info.isValid() && info.getDataSize() == (size_t)hdr.dataSize;
+}
+
+static bool readImage(FILE *file, const TImageInfo& info, CImage& img)
+{
+	if (!img.create(info)) {
+		return false;
+	}
+	size_t size = info.getDataSize();
+	void *data = img.getData();
+	if (!data || fread(data, 1, size, file) != size) {
+		img.reset();
+		return false;
+	}
+	return true;
+}
+
+/* the same condition the codecs use to pick the reduction */
+static bool coversRequest(const TCodecDecodeCtx& ctx, const TImageInfo& info, uint32_t scaleShift)
+{
+	if (scaleShift > ctx.maxScaleShift) {
+		return false;
+	}
+	return (ctx.fitWidth <= info.width || ctx.fitHeight <= info.height);
+}
+
+CPreviewCache::CPreviewCache() noexcept :
+	maxSize(0),
+	diskSize(0)
+{
+}
+
+bool CPreviewCache::init(size_t maxBytes) noexcept
+{
+	char buf[4096];
+	dir.clear();
+	maxSize = maxBytes;
+	if (maxSize && util::getCacheDir(buf, sizeof(buf), "previews")) {
+		try {
+			dir = buf;
+		} catch (...) {
+			dir.clear();
+		}
+	}
+	if (dir.empty()) {
+		util::info("preview cache not available");
+		return false;
+	}
+	util::info("preview cache: %s, %u MiB", dir.c_str(), (unsigned)(maxSize / (1024U * 1024U)));
+	return true;
+}
+
+bool CPreviewCache::getFilename(const char *filename, std::string& name, uint64_t& hash) const
+{
+	util::TFileStat st;
+	if (!util::statFile(filename, st)) {
+		return false;
+	}
+	hash = 0xcbf29ce484222325ULL;
+	hash = hashBytes(hash, filename, strlen(filename) + 1);
+	hash = hashBytes(hash, &st.size, sizeof(st.size));
+	hash = hashBytes(hash, &st.mtime, sizeof(st.mtime));
+	hash = hashBytes(hash, &st.inode, sizeof(st.inode));
+
+	char base[32];
+	mysnprintf(base, sizeof(base), "/%016llx%s", (unsigned long long)hash, previewFileExt);
+	name = dir + base;
+	return true;
+}
+
+bool CPreviewCache::load(const char *filename, CImage& img, TCodecDecodeCtx& ctx) noexcept
+{
+	if (dir.empty() || !filename || (!ctx.thumbnail && !ctx.maxScaleShift)) {
+		/* the full image is wanted */
+		return false;
+	}
+
+	bool success = false;
+	std::string name;
+	FILE *file = NULL;
+	try {
+		uint64_t hash;
+		if (getFilename(filename, name, hash)) {
+			file = util::fopen_wrapper(name.c_str(), "rb");
+		}
+		TPreviewFileHeader hdr;
+		TImageInfo thumbInfo, previewInfo;
+		if (file && fread(&hdr, sizeof(hdr), 1, file) == 1 && !memcmp(hdr.magic, previewFileMagic, sizeof(hdr.magic)) &&
+		    hdr.version == previewFileVersion && hdr.hash == hash &&
+		    getImageInfo(hdr.thumbnail, thumbInfo) && getImageInfo(hdr.preview, previewInfo)) {
+			if (ctx.thumbnail) {
+				success = readImage(file, thumbInfo, img);
+				ctx.isThumbnail = success;
+			} else if (coversRequest(ctx, previewInfo, hdr.scaleShift)) {
+				success = !fseek(file, (long)hdr.thumbnail.dataSize, SEEK_CUR) && readImage(file, previewInfo, img);
+				ctx.scaleShift = (success) ? hdr.scaleShift : 0;
+			}
+			if (success) {
+				ctx.fullWidth = (size_t)hdr.fullWidth;
+				ctx.fullHeight = (size_t)hdr.fullHeight;
+			}
+		}
+		if (file) {
+			fclose(file);
+		}
+		if (success) {
+			/* for the LRU eviction */
+			util::touchFile(name.c_str());
+		}
+	} catch (...) {
+		success = false;
+	}
+
+	std::lock_guard<std::mutex> lock(statsMutex);
+	if (success) {
+		stats.hits++;
+	} else {
+		stats.misses++;
+	}
+	return success;
+}
+
+bool CPreviewCache::store(const char *filename, const CImage& preview, const TCodecDecodeCtx& ctx) noexcept
+{
+	if (dir.empty() || !filename || !preview.hasData() || !ctx.scaleShift || ctx.isThumbnail ||
+	    (!ctx.fitWidth && !ctx.fitHeight)) {
+		/* only window-sized previews are worth keeping */
+		return false;
+	}
+
+	const TImageInfo& info = preview.getInfo();
+	CImage thumb;
+	size_t maxDim = (info.width > info.height) ? info.width : info.height;
+	if (maxDim > thumbnailSize) {
+		size_t w = (info.width * thumbnailSize + maxDim - 1) / maxDim;
+		size_t h = (info.height * thumbnailSize + maxDim - 1) / maxDim;
+		if (!preview.resizeTo(thumb, TImageResizeCtx(), w, h)) {
+			return false;
+		}
+	} else {
+		thumb = preview;
+	}
+
+	TPreviewFileHeader hdr;
+	memcpy(hdr.magic, previewFileMagic, sizeof(hdr.magic));
+	hdr.version = previewFileVersion;
+	hdr.fullWidth = (uint32_t)ctx.fullWidth;
+	hdr.fullHeight = (uint32_t)ctx.fullHeight;
+	hdr.scaleShift = (uint32_t)ctx.scaleShift;
+	hdr.reserved = 0;
+	setImageHeader(thumb.getInfo(), hdr.thumbnail);
+	setImageHeader(info, hdr.preview);
+
+	/* write to a temporary file first, so that a concurrent load never
+	 * sees a partial file. Its name is unique, the same image may be
+	 * stored by several threads at once */
+	bool success = false;
+	try {
+		std::string name;
+		if (!getFilename(filename, name, hdr.hash)) {
+			return false;
+		}
+		char suffix[64];
+		mysnprintf(suffix, sizeof(suffix), ".%x.%x.tmp",
+			   (unsigned)std::hash<std::thread::id>()(std::this_thread::get_id()), tmpCounter++);
+		std::string tmp = name + suffix;
+		FILE *file = util::fopen_wrapper(tmp.c_str(), "wb");
+		if (!file) {
+			util::warn("failed to write preview '%s'", tmp.c_str());
+			return false;
+		}
+		success = (fwrite(&hdr, sizeof(hdr), 1, file) == 1 &&
+			   fwrite(thumb.getData(), 1, (size_t)hdr.thumbnail.dataSize, file) == (size_t)hdr.thumbnail.dataSize &&
+			   fwrite(preview.getData(), 1, (size_t)hdr.preview.dataSize, file) == (size_t)hdr.preview.dataSize);
+		success = (fclose(file) == 0) && success;
+#ifdef WIN32
+		remove(name.c_str());
+#endif
+		if (!success || rename(tmp.c_str(), name.c_str())) {
+			util::warn("failed to write preview '%s'", name.c_str());
+			remove(tmp.c_str());
+			success = false;
+		}
+	} catch (...) {
+		success = false;
+	}
+	if (!success) {
+		return false;
+	}
+
+	uint64_t size = sizeof(hdr) + hdr.thumbnail.dataSize + hdr.preview.dataSize;
+	{
+		std::lock_guard<std::mutex> lock(statsMutex);
+		stats.stored++;
+	}
+	if ((diskSize += size) > (uint64_t)maxSize) {
+		trim();
+	}
+	return true;
+}
+
+void CPreviewCache::trim() noexcept
+{
+	if (dir.empty()) {
+		return;
+	}
+	std::unique_lock<std::mutex> lock(trimMutex, std::try_to_lock);
+	if (!lock.owns_lock()) {
+		/* another thread does it already */
+		return;
+	}
+
+	struct TFile {
+		std::string name;
+		util::TFileStat st;
+	};
+	std::vector<TFile> files;
+	uint64_t total = 0;
+	size_t evicted = 0;
+	try {
+		std::vector<std::string> names;
+		if (!util::listDir(dir.c_str(), names)) {
+			return;
+		}
+		size_t extLen = sizeof(previewFileExt) - 1;
+		for (size_t i = 0; i < names.size(); i++) {
+			if (names[i].size() <= extLen || names[i].compare(names[i].size() - extLen, extLen, previewFileExt)) {
+				/* the temporary files of stores in progress */
+				continue;
+			}
+			TFile f;
+			f.name = dir + "/" + names[i];
+			if (util::statFile(f.name.c_str(), f.st)) {
+				total += f.st.size;
+				files.push_back(std::move(f));
+			}
+		}
+		if (total > (uint64_t)maxSize) {
+			/* some headroom, so that not every store trims again */
+			uint64_t limit = (uint64_t)(maxSize - maxSize / 8);
+			std::sort(files.begin(), files.end(), [](const TFile& a, const TFile& b) {return a.st.mtime < b.st.mtime;});
+			for (size_t i = 0; i < files.size() && total > limit; i++) {
+				if (!remove(files[i].name.c_str())) {
+					total -= files[i].st.size;
+					evicted++;
+				}
+			}
+		}
+	} catch (...) {
+		util::warn("failed to trim the preview cache");
+		return;
+	}
+	diskSize = total;
+	if (evicted) {
+		debug("preview cache: evicted %u previews, %u MiB left", (unsigned)evicted, (unsigned)(total / (1024U * 1024U)));
+	}
+	std::lock_guard<std::mutex> statsLock(statsMutex);
+	stats.evicted += evicted;
+}
+
+void CPreviewCache::getStats(TPreviewCacheStats& s) const noexcept
+{
+	std::lock_guard<std::mutex> lock(statsMutex);
+	s = stats;
+}
+
+void CPreviewCache::logStats() const noexcept
+{
+	TPreviewCacheStats s;
+	getStats(s);
+	if (!s.hits && !s.misses && !s.stored) {
+		return;
+	}
+	util::info("preview cache: %u hits, %u misses, %u stored, %u evicted, %u MiB on disk",
+		(unsigned)s.hits, (unsigned)s.misses, (unsigned)s.stored, (unsigned)s.evicted,
+		(unsigned)(diskSize.load() / (1024U * 1024U)));
+}
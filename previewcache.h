@@ -0,0 +1,74 @@
+#ifndef FASTCROP_PREVIEWCACHE_H
+#define FASTCROP_PREVIEWCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+/* Keeps the window-sized previews of decoded images in the cache
+ * directory, so reopening a set of images does not decode the full files
+ * again. Each file holds the oriented preview and a small thumbnail made
+ * from it, uncompressed: loading them is a single read. The files are
+ * named by a hash of the path, and the size, modification time and inode
+ * of the image file, so a changed image is never shown from a stale
+ * preview. Loading a preview touches its file, trim() deletes the least
+ * recently used files until the cache is within its size limit.
+ * May be used from any thread once init() is done. */
+
+class CImage; // forward image.h
+struct TCodecDecodeCtx; // forward codec.h
+
+struct TPreviewCacheStats {
+	size_t hits;
+	size_t misses;
+	size_t stored;
+	size_t evicted;
+
+	TPreviewCacheStats() noexcept :
+		hits(0),
+		misses(0),
+		stored(0),
+		evicted(0)
+	{}
+};
+
+class CPreviewCache {
+	private:
+		std::string dir;	/* empty: no cache */
+		size_t maxSize;
+		std::atomic<uint64_t> diskSize;	/* estimate, exact after trim() */
+		std::mutex trimMutex;
+		mutable std::mutex statsMutex;
+		TPreviewCacheStats stats;
+
+		bool getFilename(const char *filename, std::string& name, uint64_t& hash) const;
+
+	public:
+		static const size_t thumbnailSize = 256; /* max. width and height */
+
+		CPreviewCache() noexcept;
+
+		CPreviewCache(const CPreviewCache& other) = delete;
+		CPreviewCache(CPreviewCache&& other) = delete;
+		CPreviewCache& operator=(const CPreviewCache& other) = delete;
+		CPreviewCache& operator=(CPreviewCache&& other) = delete;
+
+		bool init(size_t maxBytes) noexcept;
+		bool isEnabled() const noexcept {return !dir.empty();}
+
+		/* load the thumbnail or preview which satisfies the request in
+		 * ctx (see TCodecDecodeCtx), fills in the results like a codec */
+		bool load(const char *filename, CImage& img, TCodecDecodeCtx& ctx) noexcept;
+		/* store the preview the codec delivered for ctx */
+		bool store(const char *filename, const CImage& preview, const TCodecDecodeCtx& ctx) noexcept;
+		/* delete the least recently used previews exceeding the limit */
+		void trim() noexcept;
+
+		void getStats(TPreviewCacheStats& s) const noexcept;
+		void logStats() const noexcept;
+};
+
+#endif /* !FASTCROP_PREVIEWCACHE_H */
@@ -1,13 +1,20 @@
 #include "render.h"
 #include "controller.h"
+#include "gltimer.h"
 #include "util.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
 
 CRenderer::CRenderer() noexcept :
+	timers(NULL),
 	vaoEmpty(0),
-	ubosDirty(0)
+	ubosDirty(0),
+	frameDirty(true),
+	lastEntity(NULL),
+	lastEntityIndex(0)
 {
 	int i;
 	for (i=0; i<(int)RENDER_PROGRAMS_COUNT; i++) {
@@ -29,6 +36,7 @@ bool CRenderer::initGL()
 	dropGL();
 
 	glGenVertexArrays(1, &vaoEmpty);
+	programCache.initGL();
 	bool success = loadPrograms();
 
 	updateUBOs();
@@ -46,47 +54,76 @@ void CRenderer::dropGL() noexcept
 	dropUBOs();
 }
 
-bool CRenderer::loadProgram(TRenderPrograms p)
+#ifdef WITH_EMBEDDED_SHADERS
+/* the contents of the shaders/ directory, generated by the Makefile */
+static const struct {
+	const char *name;
+	const char *source;
+} embeddedShaders[] = {
+#include "shaders_embedded.h"
+	{NULL, NULL}
+};
+#endif
+
+/* get the source of a shader: built into the binary, or from the shaders/
+ * directory relative to the working directory */
+static bool getShaderSource(const char *name, std::string& source)
 {
-	if (p >= RENDER_PROGRAMS_COUNT) {
-		return false;
-	}
-	if (program[p]) {
-		glDeleteProgram(program[p]);
-		program[p] = 0;
-	}
-	std::string base = "shaders/";
-	std::string selected;
-	std::string vs;
-	std::string fs;
-	switch(p) {
-		case RENDER_PROGRAM_IMG:
-			selected = "img";
-			break;
-		case RENDER_PROGRAM_CROPLINE:
-			selected = "cropline";
-			break;
-		default:
-			return false;
+#ifdef WITH_EMBEDDED_SHADERS
+	for (size_t i = 0; embeddedShaders[i].name; i++) {
+		if (!strcmp(embeddedShaders[i].name, name)) {
+			source = embeddedShaders[i].source;
+			return true;
+		}
 	}
-
-	vs = base + selected + ".vert.glsl";
-	fs = base + selected + ".frag.glsl";
-	program[p]=util::programCreateFromFiles(vs.c_str(), fs.c_str());
-	if (!program[p]) {
-		util::warn("failed to load shader %d: %s %s",(int)p,vs.c_str(),fs.c_str());
+#endif
+	std::string filename = std::string("shaders/") + name;
+	util::info("loading shader file '%s'", filename.c_str());
+	FILE *file = util::fopen_wrapper(filename.c_str(), "rb");
+	if (!file) {
+		util::warn("Failed to open shader file '%s'", filename.c_str());
 		return false;
 	}
+	char buf[4096];
+	size_t got;
+	source.clear();
+	while ((got = fread(buf, 1, sizeof(buf), file)) > 0) {
+		source.append(buf, got);
+	}
+	fclose(file);
 	return true;
 }
 
 bool CRenderer::loadPrograms()
 {
-	bool success = true;
+	std::string vs[RENDER_PROGRAMS_COUNT];
+	std::string fs[RENDER_PROGRAMS_COUNT];
+	TGLProgramSource src[RENDER_PROGRAMS_COUNT];
+
+	dropPrograms();
 	for (int p=0; p<(int)RENDER_PROGRAMS_COUNT; p++) {
-		success = loadProgram((TRenderPrograms)p) && success;
+		const char *selected;
+		switch((TRenderPrograms)p) {
+			case RENDER_PROGRAM_IMG:
+				selected = "img";
+				break;
+			case RENDER_PROGRAM_CROPLINE:
+				selected = "cropline";
+				break;
+			default:
+				selected = "";
+		}
+		src[p].name = selected;
+		src[p].vs = NULL;
+		src[p].fs = NULL;
+		std::string base(selected);
+		if (getShaderSource((base + ".vert.glsl").c_str(), vs[p]) &&
+		    getShaderSource((base + ".frag.glsl").c_str(), fs[p])) {
+			src[p].vs = vs[p].c_str();
+			src[p].fs = fs[p].c_str();
+		}
 	}
-	return success;
+	return programCache.createPrograms(src, program, RENDER_PROGRAMS_COUNT);
 }
 
 void CRenderer::dropPrograms() noexcept
@@ -111,6 +148,9 @@ const void* CRenderer::getUBOData(GLsizeiptr& size, TUniformBuffers u) const
 		case UBO_CROP_STATE:
 			size = sizeof(TUBOCropState);
 			return (const void*)&uboCropState;
+		case UBO_TILE_STATE:
+			size = sizeof(TUBOTileState);
+			return (const void*)&uboTileState;
 		default:
 			size = 0;
 			return NULL;
@@ -158,6 +198,12 @@ void CRenderer::dropUBOs() noexcept
 	}
 }
 
+/* the previous GL image of an entity is drawn until the new one is uploaded */
+static const CGLImage& getDrawnGLImage(const CImageEntity& e)
+{
+	return (e.flags & FLAG_ENTITY_GLIMAGE_PREV) ? e.glImagePrev : e.glImage;
+}
+
 void CRenderer::prepareUBOs(const CImageEntity& e, const CController& ctrl)
 {
 	if (ubosDirty & (1U<<(unsigned)UBO_WINDOW_STATE)) {
@@ -168,12 +214,25 @@ void CRenderer::prepareUBOs(const CImageEntity& e, const CController& ctrl)
 		ubosDirty &= ~(1U<<(unsigned)UBO_WINDOW_STATE);
 	}
 
+	/* the GL image might be replaced at any time by the upload worker or
+	 * by a finer tier, the geometry refers to the full resolution image */
+	const CGLImage& glImage = getDrawnGLImage(e);
+	if ((int32_t)glImage.getLayout() != uboDisplayState.imgFormat) {
+		ubosDirty |= (1U<<(unsigned)UBO_DISPLAY_STATE);
+	}
+	if (e.flags & FLAG_ENTITY_IMAGE) {
+		const TImageInfo& info = e.fullInfo;
+		if ((int32_t)info.width != uboDisplayState.imgDims[0] || (int32_t)info.height != uboDisplayState.imgDims[1]) {
+			ubosDirty |= (1U<<(unsigned)UBO_DISPLAY_STATE) | (1U<<(unsigned)UBO_CROP_STATE);
+		}
+	}
+
 	if (ubosDirty & (1U<<(unsigned)UBO_DISPLAY_STATE)) {
 		double scale[2];
 		double offset[2];
 		ctrl.getDisplayTransform(e, scale, offset, true);
 		if (e.flags & FLAG_ENTITY_IMAGE) {
-			const TImageInfo& info = e.image.getInfo();
+			const TImageInfo& info = e.fullInfo;
 			uboDisplayState.imgDims[0] = (int32_t)info.width;
 			uboDisplayState.imgDims[1] = (int32_t)info.height;
 		} else {
@@ -184,6 +243,7 @@ void CRenderer::prepareUBOs(const CImageEntity& e, const CController& ctrl)
 		uboDisplayState.scale[1] = (float)scale[1];
 		uboDisplayState.offset[0] = (float)offset[0];
 		uboDisplayState.offset[1] = (float)offset[1];
+		uboDisplayState.imgFormat = (int32_t)glImage.getLayout();
 		updateUBO(UBO_DISPLAY_STATE);
 		ubosDirty &= ~(1U<<(unsigned)UBO_DISPLAY_STATE);
 	}
@@ -192,7 +252,7 @@ void CRenderer::prepareUBOs(const CImageEntity& e, const CController& ctrl)
 		bool croppingEnabled;
 		const TCropState& cs = ctrl.getCropState(e, croppingEnabled);
 		if (croppingEnabled) {
-			const TImageInfo& info = e.image.getInfo();
+			const TImageInfo& info = e.fullInfo;
 			ctrl.applyCropping(info, cs, uboCropState.cropPos, uboCropState.cropSize);
 			uboCropState.cropPos[1] = (int32_t)info.height - uboCropState.cropPos[1] -  uboCropState.cropSize[1];
 		} else {
@@ -206,19 +266,87 @@ void CRenderer::prepareUBOs(const CImageEntity& e, const CController& ctrl)
 	}
 }
 
+/* set up the tile state, returns false if the tile is not visible */
+bool CRenderer::prepareTile(const CGLImage& img, size_t idx)
+{
+	const TGLImageTile& t = img.getTile(idx);
+	if (!t.isReady()) {
+		return false;
+	}
+	float w = (float)img.getWidth();
+	float h = (float)img.getHeight();
+	TUBOTileState ts;
+	ts.tileOffset[0] = (float)t.pos[0] / w;
+	ts.tileOffset[1] = 1.0f - (float)(t.pos[1] + t.size[1]) / h;
+	ts.tileScale[0] = (float)t.size[0] / w;
+	ts.tileScale[1] = (float)t.size[1] / h;
+
+	/* cull against the [-1,1] clip space */
+	for (int i=0; i<2; i++) {
+		float a = uboDisplayState.scale[i] * ts.tileOffset[i] + uboDisplayState.offset[i];
+		float b = a + uboDisplayState.scale[i] * ts.tileScale[i];
+		if (b < -1.0f || a > 1.0f) {
+			return false;
+		}
+	}
+
+	ts.texOffset[0] = (float)(t.pos[0] - t.texPos[0]) / (float)t.texSize[0];
+	ts.texOffset[1] = (float)(t.pos[1] - t.texPos[1]) / (float)t.texSize[1];
+	ts.texScale[0] = (float)t.size[0] / (float)t.texSize[0];
+	ts.texScale[1] = (float)t.size[1] / (float)t.texSize[1];
+	ts.chromaScale[0] = t.chromaScale[0];
+	ts.chromaScale[1] = t.chromaScale[1];
+	if (memcmp(&ts, &uboTileState, sizeof(ts))) {
+		uboTileState = ts;
+		updateUBO(UBO_TILE_STATE);
+	}
+	return true;
+}
+
 void CRenderer::render(const CImageEntity& e, const CController& ctrl)
 {
 
+	frameDirty = false;
+	/* the controller shows another image while the current one
+	 * is not ready */
+	if (&e != lastEntity || e.index != lastEntityIndex) {
+		invalidateImageState();
+		lastEntity = &e;
+		lastEntityIndex = e.index;
+	}
 	glUseProgram(program[RENDER_PROGRAM_IMG]);
 	glBindVertexArray(vaoEmpty);
 
 	prepareUBOs(e, ctrl);
-	glBindTextureUnit(0, e.glImage.getTex());
-	glDrawArrays(GL_TRIANGLES, 0, 6);
+	if (timers) {
+		timers->begin(GL_TIMER_IMAGE);
+	}
+	const CGLImage& glImage = getDrawnGLImage(e);
+	for (size_t i=0; i<glImage.getTileCount(); i++) {
+		if (!prepareTile(glImage, i)) {
+			continue;
+		}
+		const TGLImageTile& t = glImage.getTile(i);
+		glBindTextureUnit(0, t.tex[0]);
+		if (glImage.getLayout() == FC_LAYOUT_YCBCR_PLANAR) {
+			glBindTextureUnit(1, t.tex[1]);
+			glBindTextureUnit(2, t.tex[2]);
+		}
+		glDrawArrays(GL_TRIANGLES, 0, 6);
+	}
+	if (timers) {
+		timers->end(GL_TIMER_IMAGE);
+	}
 
 	if (uboCropState.cropSize[0] > 0) {
+		if (timers) {
+			timers->begin(GL_TIMER_CROPLINE);
+		}
 		glUseProgram(program[RENDER_PROGRAM_CROPLINE]);
 		glDrawArrays(GL_LINE_LOOP, 0, 4);
+		if (timers) {
+			timers->end(GL_TIMER_CROPLINE);
+		}
 	}
 }
 
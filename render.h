@@ -2,10 +2,15 @@
 #define FASTCROP_RENDER_H
 
 #include <glad/gl.h>
+#include <stddef.h>
 #include <stdint.h>
 
-struct CImageEntity; // forward controller.h
+#include "glprogram.h"
+
+struct CImageEntity; // forward entity.h
 class CController; // forward controller.h
+class CGLImage; // forward glimage.h
+class CGLTimers; // forward gltimer.h
 
 struct TUBOWindowState {
 	float cropLineColor[4];
@@ -32,6 +37,7 @@ struct TUBODisplayState {
 	int32_t imgDims[2];
 	float scale[2];
 	float offset[2];
+	int32_t imgFormat;	/* TImageLayout of the GL image */
 
 	TUBODisplayState() noexcept
 	{
@@ -46,6 +52,35 @@ struct TUBODisplayState {
 		scale[1] = 1.0f;
 		offset[0] = 0.0f;
 		offset[1] = 0.0f;
+		imgFormat = 0;
+	}
+};
+
+/* the part of the image drawn by one tile of the CGLImage */
+struct TUBOTileState {
+	float tileOffset[2];	/* in the [0,1] image quad */
+	float tileScale[2];
+	float texOffset[2];	/* tile quad to texture coordinates */
+	float texScale[2];
+	float chromaScale[2];
+
+	TUBOTileState() noexcept
+	{
+		reset();
+	}
+
+	void reset() noexcept
+	{
+		tileOffset[0] = 0.0f;
+		tileOffset[1] = 0.0f;
+		tileScale[0] = 1.0f;
+		tileScale[1] = 1.0f;
+		texOffset[0] = 0.0f;
+		texOffset[1] = 0.0f;
+		texScale[0] = 1.0f;
+		texScale[1] = 1.0f;
+		chromaScale[0] = 1.0f;
+		chromaScale[1] = 1.0f;
 	}
 };
 
@@ -79,9 +114,12 @@ class CRenderer {
 			UBO_WINDOW_STATE = 0,
 			UBO_DISPLAY_STATE,
 			UBO_CROP_STATE,
+			UBO_TILE_STATE,
 			UBOS_COUNT // end marker
 		};
 
+		CGLProgramCache programCache;
+		CGLTimers *timers;
 		GLuint program[RENDER_PROGRAMS_COUNT];
 		GLuint ubo[UBOS_COUNT];
 		GLuint vaoEmpty;
@@ -89,9 +127,12 @@ class CRenderer {
 		TUBOWindowState uboWindowState;
 		TUBODisplayState uboDisplayState;
 		TUBOCropState uboCropState;
+		TUBOTileState uboTileState;
 		unsigned int ubosDirty;
+		bool frameDirty;
+		const CImageEntity *lastEntity; /* drawn in the last frame */
+		size_t lastEntityIndex; /* the entity objects are reused */
 		
-		bool loadProgram(TRenderPrograms p);
 		bool loadPrograms();
 		void dropPrograms() noexcept;
 
@@ -100,6 +141,8 @@ class CRenderer {
 		void updateUBOs() noexcept;
 		void dropUBOs() noexcept;
 
+		bool prepareTile(const CGLImage& img, size_t idx);
+
 	public:
 		CRenderer() noexcept;
 		~CRenderer() noexcept;
@@ -115,10 +158,17 @@ class CRenderer {
 		void prepareUBOs(const CImageEntity& e, const CController& ctrl);
 		void render(const CImageEntity& e, const CController& ctrl);
 
+		/* measure the GPU time of the passes (NULL: no measurement) */
+		void setTimers(CGLTimers *t) noexcept {timers = t;}
+
 		void invalidateWindowState() noexcept;
 		void invalidateDisplayState() noexcept;
 		void invalidateCropState() noexcept;
 		void invalidateImageState() noexcept;
+		/* the frame has to be drawn again, without any state change */
+		void invalidateFrame() noexcept {frameDirty = true;}
+		/* true if the next frame differs from the last one drawn */
+		bool isDirty() const noexcept {return frameDirty || (ubosDirty != 0);}
 };
 
 #endif /* !FASTCROP_RENDER_H */
@@ -0,0 +1,249 @@
+#include "scratch.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const size_t scratchDefaultBlockSize = 1024U*1024U;
+static const size_t scratchNoLast = (size_t)-1;
+
+CScratchArena::CScratchArena() noexcept :
+	cur(0),
+	last(scratchNoLast),
+	inUse(0)
+{
+}
+
+CScratchArena::~CScratchArena() noexcept
+{
+	dropBlocks();
+}
+
+bool CScratchArena::addBlock(size_t minSize) noexcept
+{
+	TBlock b;
+	b.size = scratchDefaultBlockSize;
+	if (b.size < stats.capacity) {
+		/* grow geometrically */
+		b.size = stats.capacity;
+	}
+	if (b.size < minSize) {
+		b.size = minSize;
+	}
+	b.used = 0;
+	b.mem = (unsigned char*)malloc(b.size);
+	if (!b.mem) {
+		return false;
+	}
+	try {
+		blocks.push_back(b);
+	} catch(...) {
+		free(b.mem);
+		return false;
+	}
+	stats.fallbackAllocs++;
+	stats.capacity += b.size;
+	return true;
+}
+
+void CScratchArena::dropBlocks() noexcept
+{
+	for (size_t i=0; i<blocks.size(); i++) {
+		free(blocks[i].mem);
+	}
+	blocks.clear();
+	stats.capacity = 0;
+	cur = 0;
+	last = scratchNoLast;
+	inUse = 0;
+}
+
+void CScratchArena::consolidate() noexcept
+{
+	size_t total = stats.capacity;
+	dropBlocks();
+	addBlock(total);
+}
+
+void* CScratchArena::allocate(size_t size, size_t align) noexcept
+{
+	if (!size) {
+		size = 1;
+	}
+	if (!align || (align & (align - 1))) {
+		align = 16;
+	}
+
+	while (true) {
+		if (cur < blocks.size()) {
+			TBlock& b = blocks[cur];
+			uintptr_t base = (uintptr_t)b.mem;
+			uintptr_t p = (base + b.used + (align - 1)) & ~((uintptr_t)align - 1);
+			size_t offset = (size_t)(p - base);
+			if (offset <= b.size && size <= b.size - offset) {
+				last = offset;
+				b.used = offset + size;
+				stats.arenaAllocs++;
+				if (inUse + b.used > stats.highWater) {
+					stats.highWater = inUse + b.used;
+				}
+				return b.mem + offset;
+			}
+			if (cur + 1 < blocks.size()) {
+				/* blocks behind the current one are free */
+				inUse += b.used;
+				cur++;
+				blocks[cur].used = 0;
+				last = scratchNoLast;
+				continue;
+			}
+		}
+		if (!addBlock(size + align)) {
+			return NULL;
+		}
+		if (cur + 1 < blocks.size()) {
+			inUse += blocks[cur].used;
+			cur = blocks.size() - 1;
+		}
+		last = scratchNoLast;
+	}
+}
+
+void* CScratchArena::reallocate(void *ptr, size_t oldSize, size_t newSize) noexcept
+{
+	if (!ptr) {
+		return allocate(newSize);
+	}
+	if (cur < blocks.size() && last != scratchNoLast) {
+		TBlock& b = blocks[cur];
+		if ((unsigned char*)ptr == b.mem + last && newSize <= b.size - last) {
+			/* the last allocation can grow in place */
+			b.used = last + newSize;
+			if (inUse + b.used > stats.highWater) {
+				stats.highWater = inUse + b.used;
+			}
+			return ptr;
+		}
+	}
+	void *p = allocate(newSize);
+	if (p) {
+		memcpy(p, ptr, (oldSize < newSize) ? oldSize : newSize);
+	}
+	return p;
+}
+
+void CScratchArena::release(void *ptr) noexcept
+{
+	if (ptr && cur < blocks.size() && last != scratchNoLast) {
+		TBlock& b = blocks[cur];
+		if ((unsigned char*)ptr == b.mem + last) {
+			b.used = last;
+			last = scratchNoLast;
+		}
+	}
+}
+
+bool CScratchArena::owns(const void *ptr) const noexcept
+{
+	const unsigned char *p = (const unsigned char*)ptr;
+	for (size_t i=0; i<blocks.size(); i++) {
+		if (p >= blocks[i].mem && p < blocks[i].mem + blocks[i].size) {
+			return true;
+		}
+	}
+	return false;
+}
+
+TScratchMark CScratchArena::getMark() const noexcept
+{
+	TScratchMark mark;
+	if (cur < blocks.size()) {
+		mark.block = cur;
+		mark.used = blocks[cur].used;
+	}
+	return mark;
+}
+
+void CScratchArena::rewind(const TScratchMark& mark) noexcept
+{
+	if (mark.block >= blocks.size()) {
+		return;
+	}
+	cur = mark.block;
+	blocks[cur].used = mark.used;
+	last = scratchNoLast;
+	inUse = 0;
+	for (size_t i=0; i<cur; i++) {
+		inUse += blocks[i].used;
+	}
+	if (!cur && !mark.used && blocks.size() > 1) {
+		consolidate();
+	}
+}
+
+void CScratchArena::reset() noexcept
+{
+	rewind(TScratchMark());
+}
+
+extern CScratchArena& getScratchArena() noexcept
+{
+	static thread_local CScratchArena arena;
+	return arena;
+}
+
+extern void* scratchMalloc(size_t size) noexcept
+{
+	CScratchArena& arena = getScratchArena();
+	if (size > scratchMaxTransientSize) {
+		arena.noteFallbackAllocation();
+		return malloc(size);
+	}
+	return arena.allocate(size);
+}
+
+extern void* scratchRealloc(void *ptr, size_t oldSize, size_t newSize) noexcept
+{
+	CScratchArena& arena = getScratchArena();
+	if (ptr && !arena.owns(ptr)) {
+		arena.noteFallbackAllocation();
+		return realloc(ptr, newSize);
+	}
+	if (newSize > scratchMaxTransientSize) {
+		void *p = malloc(newSize);
+		arena.noteFallbackAllocation();
+		if (p && ptr) {
+			memcpy(p, ptr, (oldSize < newSize) ? oldSize : newSize);
+			arena.release(ptr);
+		}
+		return p;
+	}
+	return arena.reallocate(ptr, oldSize, newSize);
+}
+
+extern void scratchFree(void *ptr) noexcept
+{
+	if (!ptr) {
+		return;
+	}
+	CScratchArena& arena = getScratchArena();
+	if (arena.owns(ptr)) {
+		arena.release(ptr);
+	} else {
+		free(ptr);
+	}
+}
+
+extern void* scratchDetach(void *ptr, size_t size) noexcept
+{
+	CScratchArena& arena = getScratchArena();
+	if (!ptr || !arena.owns(ptr)) {
+		return ptr;
+	}
+	void *p = malloc(size);
+	arena.noteFallbackAllocation();
+	if (p) {
+		memcpy(p, ptr, size);
+	}
+	return p;
+}
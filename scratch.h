@@ -0,0 +1,114 @@
+#ifndef FASTCROP_SCRATCH_H
+#define FASTCROP_SCRATCH_H
+
+#include <stddef.h>
+#include <vector>
+
+/* Per-thread bump allocator for temporaries which live only while a single
+ * image is processed. Memory is never returned to the heap individually,
+ * the arena is rewound to a mark instead (see CScratchScope). When it is
+ * rewound completely, all blocks are merged into one block of the high water
+ * mark size, so in steady state, no heap allocations are necessary. */
+
+struct TScratchMark {
+	size_t block;
+	size_t used;
+
+	TScratchMark() noexcept :
+		block(0),
+		used(0)
+	{}
+};
+
+struct TScratchStats {
+	size_t fallbackAllocs;	/* heap allocations of the arena itself: its blocks and the
+				 * large ones it passes on (not other heap traffic) */
+	size_t arenaAllocs;	/* allocations served from the arena */
+	size_t highWater;	/* maximum number of bytes in use */
+	size_t capacity;	/* current size of all blocks */
+
+	TScratchStats() noexcept :
+		fallbackAllocs(0),
+		arenaAllocs(0),
+		highWater(0),
+		capacity(0)
+	{}
+};
+
+class CScratchArena {
+	private:
+		struct TBlock {
+			unsigned char *mem;
+			size_t size;
+			size_t used;
+		};
+
+		std::vector<TBlock> blocks;
+		size_t cur;
+		size_t last;	/* offset of the last allocation in the current block */
+		size_t inUse;	/* bytes used in the blocks before cur */
+		TScratchStats stats;
+
+		bool addBlock(size_t minSize) noexcept;
+		void dropBlocks() noexcept;
+		void consolidate() noexcept;
+
+	public:
+		CScratchArena() noexcept;
+		~CScratchArena() noexcept;
+
+		CScratchArena(const CScratchArena& other) = delete;
+		CScratchArena(CScratchArena&& other) = delete;
+		CScratchArena& operator=(const CScratchArena& other) = delete;
+		CScratchArena& operator=(CScratchArena&& other) = delete;
+
+		void* allocate(size_t size, size_t align=16) noexcept;
+		void* reallocate(void *ptr, size_t oldSize, size_t newSize) noexcept;
+		void release(void *ptr) noexcept; /* only the last allocation is actually reclaimed */
+		bool owns(const void *ptr) const noexcept;
+
+		TScratchMark getMark() const noexcept;
+		void rewind(const TScratchMark& mark) noexcept;
+		void reset() noexcept;
+
+		const TScratchStats& getStats() const noexcept {return stats;}
+		void noteFallbackAllocation() noexcept {stats.fallbackAllocs++;}
+};
+
+/* the arena of the calling thread */
+extern CScratchArena& getScratchArena() noexcept;
+
+/* rewinds the thread's arena when leaving the scope */
+class CScratchScope {
+	private:
+		CScratchArena& arena;
+		TScratchMark mark;
+
+	public:
+		CScratchScope() noexcept :
+			arena(getScratchArena()),
+			mark(arena.getMark())
+		{}
+		~CScratchScope() noexcept
+		{
+			arena.rewind(mark);
+		}
+
+		CScratchScope(const CScratchScope& other) = delete;
+		CScratchScope& operator=(const CScratchScope& other) = delete;
+
+		CScratchArena& getArena() noexcept {return arena;}
+};
+
+/* Allocation hooks for libraries which might pass ownership of an allocation
+ * to us (like stb_image's result buffer): allocations larger than
+ * scratchMaxTransientSize go to the heap, free and realloc handle both
+ * kinds of pointers. Use scratchDetach() on a result to get a heap pointer. */
+const size_t scratchMaxTransientSize = 256U*1024U;
+
+extern void* scratchMalloc(size_t size) noexcept;
+extern void* scratchRealloc(void *ptr, size_t oldSize, size_t newSize) noexcept;
+extern void  scratchFree(void *ptr) noexcept;
+extern void* scratchDetach(void *ptr, size_t size) noexcept;
+
+#endif /* !FASTCROP_SCRATCH_H */
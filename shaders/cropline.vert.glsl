@@ -11,6 +11,7 @@ layout(std140, binding=1) uniform displayStateUBO
 	ivec2 imgDims;
 	vec2 scale;
 	vec2 offset;
+	int format;
 } displayState;
 
 layout(std140, binding=2) uniform cropStateUBO
@@ -1,15 +1,19 @@
 #version 450 core
 
 in vec2 texCoord;
+in vec2 imgCoord;
 
 layout(location = 0) out vec4 color;
 layout(binding = 0) uniform sampler2D tex;
+layout(binding = 1) uniform sampler2D texCb;
+layout(binding = 2) uniform sampler2D texCr;
 
 layout(std140, binding=1) uniform displayStateUBO
 {
 	ivec2 imgDims;
 	vec2 scale;
 	vec2 offset;
+	int format;
 } displayState;
 
 layout(std140, binding=2) uniform cropStateUBO
@@ -18,12 +22,35 @@ layout(std140, binding=2) uniform cropStateUBO
 	ivec2 size;
 } cropState;
 
+layout(std140, binding=3) uniform tileStateUBO
+{
+	vec2 tileOffset;
+	vec2 tileScale;
+	vec2 texOffset;
+	vec2 texScale;
+	vec2 chromaScale;
+} tileState;
+
+vec4 getColor()
+{
+	if (displayState.format == 1) {
+		// planar JFIF YCbCr, full range
+		vec2 chromaCoord = texCoord * tileState.chromaScale;
+		float y = texture(tex, texCoord).r;
+		float cb = texture(texCb, chromaCoord).r - 128.0/255.0;
+		float cr = texture(texCr, chromaCoord).r - 128.0/255.0;
+		return vec4(clamp(vec3(y + 1.402 * cr,
+				       y - 0.344136 * cb - 0.714136 * cr,
+				       y + 1.772 * cb), 0.0, 1.0), 1.0);
+	}
+	return texture(tex, texCoord);
+}
+
 void main()
 {
-	color = texture(tex, texCoord);
+	color = getColor();
 	if (cropState.size.x > 0) {
-		vec2 imgCoord = texCoord * vec2(displayState.imgDims);
-	        ivec2 imgCoordi = ivec2(imgCoord);
+	        ivec2 imgCoordi = ivec2(imgCoord * vec2(displayState.imgDims));
 		if (any(lessThan(imgCoordi, cropState.pos)) || any(greaterThanEqual(imgCoordi,cropState.pos + cropState.size))) {
 			color.rgb = 0.25 * color.rgb;
 		}
@@ -1,21 +1,34 @@
 #version 450 core
 
 out vec2 texCoord;
+out vec2 imgCoord;
 
 layout(std140, binding=1) uniform displayStateUBO
 {
 	ivec2 imgDims;
 	vec2 scale;
 	vec2 offset;
+	int format;
 } displayState;
 
+layout(std140, binding=3) uniform tileStateUBO
+{
+	vec2 tileOffset;
+	vec2 tileScale;
+	vec2 texOffset;
+	vec2 texScale;
+	vec2 chromaScale;
+} tileState;
+
 void main()
 {
 	vec2 quad[6] = vec2[6](
 			vec2(0.0, 0.0), vec2(1.0, 0.0), vec2(0.0, 1.0),
 			vec2(0.0, 1.0), vec2(1.0, 0.0), vec2(1.0, 1.0));
 	vec2 pos = quad[gl_VertexID];
+	vec2 imgPos = tileState.tileOffset + tileState.tileScale * pos;
 
-	texCoord = vec2(pos.x, 1.0 - pos.y);
-	gl_Position = vec4(displayState.scale * pos + displayState.offset, 0.0, 1.0);
+	texCoord = tileState.texOffset + tileState.texScale * vec2(pos.x, 1.0 - pos.y);
+	imgCoord = vec2(imgPos.x, 1.0 - imgPos.y);
+	gl_Position = vec4(displayState.scale * imgPos + displayState.offset, 0.0, 1.0);
 }
@@ -0,0 +1,316 @@
+#include "threadpool.h"
+#include "scratch.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <utility>
+
+/* the worker the current thread is, to queue nested tasks locally */
+static thread_local CThreadPool *currentPool = NULL;
+static thread_local size_t currentWorker = 0;
+
+/****************************************************************************
+ * CANCELLATION TOKENS                                                      *
+ ****************************************************************************/
+
+bool CCancelToken::reset() noexcept
+{
+	try {
+		flag = std::make_shared<std::atomic<bool>>(false);
+	} catch (...) {
+		flag.reset();
+		return false;
+	}
+	return true;
+}
+
+void CCancelToken::cancel() const noexcept
+{
+	if (flag) {
+		flag->store(true, std::memory_order_relaxed);
+	}
+}
+
+/****************************************************************************
+ * THREAD POOL                                                              *
+ ****************************************************************************/
+
+CThreadPool::CThreadPool() noexcept :
+	stopRequested(false)
+{
+	for (int p = 0; p < (int)FC_TASK_PRIORITY_COUNT; p++) {
+		queued[p] = 0;
+	}
+	memset(stats, 0, sizeof(stats));
+}
+
+CThreadPool::~CThreadPool() noexcept
+{
+	stop();
+}
+
+bool CThreadPool::start(unsigned int threadCount) noexcept
+{
+	if (isRunning()) {
+		return false;
+	}
+	if (!threadCount) {
+		threadCount = std::thread::hardware_concurrency();
+		threadCount = (threadCount > 2) ? threadCount - 1 : 2;
+	}
+	stopRequested = false;
+	try {
+		for (unsigned int i = 0; i < threadCount; i++) {
+			TWorker *w = new TWorker;
+			w->reserved = (i == 0 && threadCount > 1);
+			workers.push_back(w);
+		}
+		for (size_t i = 0; i < workers.size(); i++) {
+			workers[i]->thread = std::thread(&CThreadPool::run, this, i);
+		}
+	} catch (...) {
+		util::warn("failed to start the thread pool");
+		stop();
+		return false;
+	}
+	util::info("thread pool: %u threads", threadCount);
+	return true;
+}
+
+void CThreadPool::stop() noexcept
+{
+	if (!isRunning()) {
+		return;
+	}
+	size_t exports = queued[FC_TASK_EXPORT].load();
+	if (exports) {
+		util::info("thread pool: finishing %u exports", (unsigned)exports);
+	}
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stopRequested = true;
+	}
+	sleepCond.notify_all();
+	for (size_t i = 0; i < workers.size(); i++) {
+		if (workers[i]->thread.joinable()) {
+			workers[i]->thread.join();
+		}
+	}
+	for (size_t i = 0; i < workers.size(); i++) {
+		delete workers[i];
+	}
+	workers.clear();
+	for (int p = 0; p < (int)FC_TASK_PRIORITY_COUNT; p++) {
+		inject[p].clear();
+		queued[p] = 0;
+	}
+}
+
+bool CThreadPool::hasWork(const TWorker& w) const noexcept
+{
+	int last = (w.reserved) ? (int)FC_TASK_EXPORT : (int)FC_TASK_PRIORITY_COUNT - 1;
+	for (int p = 0; p <= last; p++) {
+		if (queued[p].load()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* the highest priority task: own deque (newest first), injected tasks,
+ * then steal from the other workers (oldest first) */
+bool CThreadPool::takeTask(size_t idx, TTask& task, TFCTaskPriority& prio, bool exportsOnly) noexcept
+{
+	TWorker& self = *workers[idx];
+	int first = (exportsOnly) ? (int)FC_TASK_EXPORT : 0;
+	int last = (self.reserved || exportsOnly) ? (int)FC_TASK_EXPORT : (int)FC_TASK_PRIORITY_COUNT - 1;
+	for (int p = first; p <= last; p++) {
+		if (!queued[p].load()) {
+			continue;
+		}
+		prio = (TFCTaskPriority)p;
+		{
+			std::lock_guard<std::mutex> lock(self.mutex);
+			if (!self.queue[p].empty()) {
+				task = std::move(self.queue[p].back());
+				self.queue[p].pop_back();
+				queued[p]--;
+				return true;
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(injectMutex);
+			if (!inject[p].empty()) {
+				task = std::move(inject[p].front());
+				inject[p].pop_front();
+				queued[p]--;
+				return true;
+			}
+		}
+		for (size_t i = 1; i < workers.size(); i++) {
+			TWorker& victim = *workers[(idx + i) % workers.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.queue[p].empty()) {
+				task = std::move(victim.queue[p].front());
+				victim.queue[p].pop_front();
+				queued[p]--;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void CThreadPool::runTask(TTask& task, TFCTaskPriority prio) noexcept
+{
+	double start = util::getTime();
+	bool cancelled = task.token.isCancelled();
+	if (!cancelled) {
+		CScratchScope scratch;
+		try {
+			task.func(task.token);
+		} catch (...) {
+			util::warn("thread pool: %s task failed", getPriorityName(prio));
+		}
+	}
+	double end = util::getTime();
+
+	std::lock_guard<std::mutex> lock(statsMutex);
+	TStats& s = stats[prio];
+	if (cancelled) {
+		s.cancelled++;
+	} else {
+		double latency = start - task.submitTime;
+		s.completed++;
+		s.latencySum += latency;
+		if (latency > s.latencyMax) {
+			s.latencyMax = latency;
+		}
+		s.runSum += end - start;
+	}
+}
+
+void CThreadPool::run(size_t idx) noexcept
+{
+	TWorker& self = *workers[idx];
+	currentPool = this;
+	currentWorker = idx;
+
+	while (true) {
+		TTask task;
+		TFCTaskPriority prio;
+		/* when stopping, the exports the user asked for are
+		 * still finished */
+		bool stopping = stopRequested.load();
+		if (takeTask(idx, task, prio, stopping)) {
+			runTask(task, prio);
+			/* drop the closure before sleeping */
+			task.func = nullptr;
+			continue;
+		}
+		if (stopping) {
+			break;
+		}
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		sleepCond.wait(lock, [this, &self]{return stopRequested.load() || hasWork(self);});
+	}
+
+	/* drop what is still queued locally */
+	std::lock_guard<std::mutex> lock(self.mutex);
+	for (int p = 0; p < (int)FC_TASK_PRIORITY_COUNT; p++) {
+		self.queue[p].clear();
+	}
+	currentPool = NULL;
+}
+
+bool CThreadPool::submit(TFCTaskPriority prio, TTaskFunc&& func, const CCancelToken& token) noexcept
+{
+	if (!isRunning() || prio >= FC_TASK_PRIORITY_COUNT || stopRequested) {
+		return false;
+	}
+	/* counted before it is visible to the workers, so the counter
+	 * never drops below the number of queued tasks */
+	bool counted = false;
+	try {
+		TTask task;
+		task.func = std::move(func);
+		task.token = token;
+		task.submitTime = util::getTime();
+		if (currentPool == this) {
+			TWorker& self = *workers[currentWorker];
+			std::lock_guard<std::mutex> lock(self.mutex);
+			queued[prio]++;
+			counted = true;
+			self.queue[prio].push_back(std::move(task));
+		} else {
+			std::lock_guard<std::mutex> lock(injectMutex);
+			queued[prio]++;
+			counted = true;
+			inject[prio].push_back(std::move(task));
+		}
+	} catch (...) {
+		if (counted) {
+			queued[prio]--;
+		}
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> lock(statsMutex);
+		stats[prio].submitted++;
+	}
+	{
+		/* a worker may be between checking for work and waiting */
+		std::lock_guard<std::mutex> lock(sleepMutex);
+	}
+	sleepCond.notify_all();
+	return true;
+}
+
+void CThreadPool::getStats(TFCTaskPriority prio, TThreadPoolStats& s) const noexcept
+{
+	s = TThreadPoolStats();
+	if (prio >= FC_TASK_PRIORITY_COUNT) {
+		return;
+	}
+	s.queued = queued[prio].load();
+	std::lock_guard<std::mutex> lock(statsMutex);
+	const TStats& st = stats[prio];
+	s.submitted = st.submitted;
+	s.completed = st.completed;
+	s.cancelled = st.cancelled;
+	if (st.completed) {
+		s.avgLatencyMS = 1000.0 * st.latencySum / (double)st.completed;
+		s.avgRunMS = 1000.0 * st.runSum / (double)st.completed;
+	}
+	s.maxLatencyMS = 1000.0 * st.latencyMax;
+}
+
+void CThreadPool::logStats() const noexcept
+{
+	for (int p = 0; p < (int)FC_TASK_PRIORITY_COUNT; p++) {
+		TThreadPoolStats s;
+		getStats((TFCTaskPriority)p, s);
+		if (s.submitted) {
+			util::info("thread pool %s: %u submitted, %u completed, %u cancelled, %u queued, latency avg %.2fms max %.2fms, run avg %.2fms",
+				getPriorityName((TFCTaskPriority)p), (unsigned)s.submitted, (unsigned)s.completed, (unsigned)s.cancelled,
+				(unsigned)s.queued, s.avgLatencyMS, s.maxLatencyMS, s.avgRunMS);
+		}
+	}
+}
+
+const char *CThreadPool::getPriorityName(TFCTaskPriority prio) noexcept
+{
+	switch(prio) {
+		case FC_TASK_INTERACTIVE:
+			return "interactive";
+		case FC_TASK_EXPORT:
+			return "export";
+		case FC_TASK_PREFETCH:
+			return "prefetch";
+		case FC_TASK_BACKGROUND:
+			return "background";
+		default:
+			return "unknown";
+	}
+}
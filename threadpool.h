@@ -0,0 +1,138 @@
+#ifndef FASTCROP_THREADPOOL_H
+#define FASTCROP_THREADPOOL_H
+
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Work-stealing executor for the decode, resize and export stages.
+ * Every worker has a deque per priority class. Tasks submitted by a worker
+ * go to the back of its own deque and are taken from there (LIFO), tasks
+ * from other threads go to a shared injection queue. An idle worker takes
+ * the highest priority task it finds: its own, then the injected ones,
+ * then it steals from the front of the other workers' deques.
+ * The first worker is reserved for the interactive and export classes, so
+ * a burst of prefetch work can never delay the current image by more than
+ * the time it takes to start a task.
+ * Each task runs inside a CScratchScope, the per-thread scratch arena is
+ * rewound after it. */
+
+enum TFCTaskPriority {
+	FC_TASK_INTERACTIVE = 0,	/* the current image */
+	FC_TASK_EXPORT,			/* processing requested by the user */
+	FC_TASK_PREFETCH,		/* images which might be shown next */
+	FC_TASK_BACKGROUND,		/* everything else, e.g. indexing */
+	FC_TASK_PRIORITY_COUNT // end marker
+};
+
+/* Shared cancellation flag. Copies refer to the same flag. A default
+ * constructed token can't be cancelled, reset() creates a new flag. */
+class CCancelToken {
+	private:
+		std::shared_ptr<std::atomic<bool>> flag;
+
+	public:
+		bool reset() noexcept;
+		void cancel() const noexcept;
+		bool isCancelled() const noexcept {return flag && flag->load(std::memory_order_relaxed);}
+		bool isValid() const noexcept {return (bool)flag;}
+};
+
+typedef std::function<void(const CCancelToken& token)> TTaskFunc;
+
+struct TThreadPoolStats {
+	size_t queued;		/* tasks currently waiting */
+	size_t submitted;
+	size_t completed;
+	size_t cancelled;	/* cancelled before they started */
+	double avgLatencyMS;	/* from submission to start */
+	double maxLatencyMS;
+	double avgRunMS;
+
+	TThreadPoolStats() noexcept :
+		queued(0),
+		submitted(0),
+		completed(0),
+		cancelled(0),
+		avgLatencyMS(0.0),
+		maxLatencyMS(0.0),
+		avgRunMS(0.0)
+	{}
+};
+
+class CThreadPool {
+	private:
+		struct TTask {
+			TTaskFunc func;
+			CCancelToken token;
+			double submitTime;
+		};
+
+		struct TWorker {
+			std::mutex mutex;
+			std::deque<TTask> queue[FC_TASK_PRIORITY_COUNT];
+			std::thread thread;
+			bool reserved;	/* only runs interactive and export tasks */
+		};
+
+		struct TStats {
+			size_t submitted;
+			size_t completed;
+			size_t cancelled;
+			double latencySum;
+			double latencyMax;
+			double runSum;
+		};
+
+		std::vector<TWorker*> workers;
+		std::mutex injectMutex;
+		std::deque<TTask> inject[FC_TASK_PRIORITY_COUNT];
+		std::atomic<size_t> queued[FC_TASK_PRIORITY_COUNT];
+
+		std::mutex sleepMutex;
+		std::condition_variable sleepCond;
+		std::atomic<bool> stopRequested;
+
+		mutable std::mutex statsMutex;
+		TStats stats[FC_TASK_PRIORITY_COUNT];
+
+		void run(size_t idx) noexcept;
+		bool hasWork(const TWorker& w) const noexcept;
+		bool takeTask(size_t idx, TTask& task, TFCTaskPriority& prio, bool exportsOnly) noexcept;
+		void runTask(TTask& task, TFCTaskPriority prio) noexcept;
+
+	public:
+		CThreadPool() noexcept;
+		~CThreadPool() noexcept;
+
+		CThreadPool(const CThreadPool& other) = delete;
+		CThreadPool(CThreadPool&& other) = delete;
+		CThreadPool& operator=(const CThreadPool& other) = delete;
+		CThreadPool& operator=(CThreadPool&& other) = delete;
+
+		/* threadCount 0: one less than the number of cores, at least 2 */
+		bool start(unsigned int threadCount=0) noexcept;
+		/* waits for the running tasks and finishes the queued exports,
+		 * the other queued tasks are dropped */
+		void stop() noexcept;
+		bool isRunning() const noexcept {return !workers.empty();}
+		size_t getThreadCount() const noexcept {return workers.size();}
+
+		/* the task is skipped if the token is cancelled before it starts,
+		 * returns false if the task could not be queued */
+		bool submit(TFCTaskPriority prio, TTaskFunc&& func, const CCancelToken& token=CCancelToken()) noexcept;
+
+		void getStats(TFCTaskPriority prio, TThreadPoolStats& s) const noexcept;
+		void logStats() const noexcept;
+
+		static const char *getPriorityName(TFCTaskPriority prio) noexcept;
+};
+
+#endif /* !FASTCROP_THREADPOOL_H */
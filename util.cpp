@@ -6,8 +6,21 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <chrono>
+
 #ifdef WIN32
 #include <Windows.h>
+#include <sys/stat.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
 #endif
 
 namespace util {
@@ -463,6 +476,12 @@ GLsizei roundNextMultiple(GLsizei value, GLsizei base)
 	return value;
 }
 
+/* monotonic time in seconds, with an arbitrary origin */
+extern double getTime()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 /* get file extension, points into filename */
 extern const char *getExt(const char *filename)
 {
@@ -512,6 +531,33 @@ extern const char *getBasename(const char *filename)
 	return filename;
 }
 
+extern size_t getPhysicalMemory()
+{
+#ifdef WIN32
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+	if (GlobalMemoryStatusEx(&status)) {
+		return (size_t)status.ullTotalPhys;
+	}
+	return 0;
+#else
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pageSize = sysconf(_SC_PAGE_SIZE);
+	if (pages < 1 || pageSize < 1) {
+		return 0;
+	}
+	return (size_t)pages * (size_t)pageSize;
+#endif
+}
+
+extern void releaseFreeMemory()
+{
+#ifdef __GLIBC__
+	/* also returns the free pages inside the heap (via madvise) */
+	malloc_trim(0);
+#endif
+}
+
 #ifdef WIN32
 /****************************************************************************
  * WINDOWS WIDE STRING <-> UTF8                                             *
@@ -558,4 +604,125 @@ extern FILE* fopen_wrapper(const char *filename, const char *mode)
 	return file;
 }
 
+extern bool statFile(const char *filename, TFileStat& st)
+{
+#ifdef WIN32
+	struct _stat64 s;
+	std::wstring filename_wide = util::utf8ToWide(std::string(filename));
+	if (_wstat64(filename_wide.c_str(), &s)) {
+		return false;
+	}
+	st.inode = 0;
+#else
+	struct stat s;
+	if (stat(filename, &s)) {
+		return false;
+	}
+	st.inode = (uint64_t)s.st_ino;
+#endif
+	st.size = (uint64_t)s.st_size;
+	st.mtime = (int64_t)s.st_mtime;
+	return true;
+}
+
+extern bool touchFile(const char *filename)
+{
+#ifdef WIN32
+	std::wstring filename_wide = util::utf8ToWide(std::string(filename));
+	return (_wutime(filename_wide.c_str(), NULL) == 0);
+#else
+	return (utime(filename, NULL) == 0);
+#endif
+}
+
+extern bool listDir(const char *dir, std::vector<std::string>& names)
+{
+	bool success = true;
+#ifdef WIN32
+	WIN32_FIND_DATAW data;
+	HANDLE h = INVALID_HANDLE_VALUE;
+	try {
+		std::wstring pattern = util::utf8ToWide(std::string(dir) + "\\*");
+		h = FindFirstFileW(pattern.c_str(), &data);
+	} catch (...) {
+		return false;
+	}
+	if (h == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	do {
+		if (!(data.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_HIDDEN))) {
+			try {
+				names.push_back(util::wideToUtf8(std::wstring(data.cFileName)));
+			} catch (...) {
+				success = false;
+			}
+		}
+	} while (success && FindNextFileW(h, &data));
+	FindClose(h);
+#else
+	DIR *d = opendir(dir);
+	if (!d) {
+		return false;
+	}
+	struct dirent *e;
+	while (success && (e = readdir(d))) {
+		if (e->d_name[0] != '.') {
+			try {
+				names.push_back(std::string(e->d_name));
+			} catch (...) {
+				success = false;
+			}
+		}
+	}
+	closedir(d);
+#endif
+	return success;
+}
+
+/* create a directory, succeeds if it already exists */
+static bool makeDir(const char *path)
+{
+#ifdef WIN32
+	std::wstring path_wide = util::utf8ToWide(std::string(path));
+	return (CreateDirectoryW(path_wide.c_str(), NULL) || GetLastError() == ERROR_ALREADY_EXISTS);
+#else
+	return (mkdir(path, 0755) == 0 || errno == EEXIST);
+#endif
+}
+
+extern bool getCacheDir(char *buf, size_t size, const char *subdir)
+{
+	const char *suffix = "";
+#ifdef WIN32
+	const wchar_t *base_wide = _wgetenv(L"LOCALAPPDATA");
+	std::string base_utf8 = base_wide ? util::wideToUtf8(std::wstring(base_wide)) : std::string();
+	const char *base = base_utf8.c_str();
+#else
+	const char *base = getenv("XDG_CACHE_HOME");
+	if (!base || !base[0]) {
+		base = getenv("HOME");
+		suffix = "/.cache";
+	}
+#endif
+	if (!base || !base[0]) {
+		return false;
+	}
+	int len = mysnprintf(buf, size, "%s%s", base, suffix);
+	if (len < 0 || (size_t)len >= size || !makeDir(buf)) {
+		return false;
+	}
+	len = mysnprintf(buf, size, "%s%s/fastcrop", base, suffix);
+	if (len < 0 || (size_t)len >= size || !makeDir(buf)) {
+		return false;
+	}
+	if (subdir) {
+		len = mysnprintf(buf, size, "%s%s/fastcrop/%s", base, suffix, subdir);
+		if (len < 0 || (size_t)len >= size || !makeDir(buf)) {
+			return false;
+		}
+	}
+	return true;
+}
+
 } // namespace util
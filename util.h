@@ -3,8 +3,12 @@
 
 #include <glad/gl.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#include <string>
+#include <vector>
+
 /* define mysnprintf to be either snprintf (POSIX) or sprintf_s (MS Windows) */
 #ifdef WIN32
 #include <string>
@@ -169,12 +173,22 @@ class CInternalIDGenerator {
 /* round GLsizei to next multiple of base */
 extern GLsizei roundNextMultiple(GLsizei value, GLsizei base);
 
+/* monotonic time in seconds, with an arbitrary origin */
+extern double getTime();
+
 /* get file extension, points into filename */
 extern const char *getExt(const char *filename);
 
 /* get base name of file without path, points into filename) */
 extern const char *getBasename(const char *filename);
 
+/* size of the physical memory in bytes, 0 if unknown */
+extern size_t getPhysicalMemory();
+
+/* hand the memory the allocator still keeps after free() back to the
+ * system, where the C library supports that */
+extern void releaseFreeMemory();
+
 #ifdef WIN32
 #define strcasecmp(a,b) _stricmp((a),(b))
 #endif
@@ -191,5 +205,25 @@ extern std::wstring utf8ToWide(const std::string& data);
 // on windows, we use UTF8 strings, but window's wide char APIs
 extern FILE* fopen_wrapper(const char *filename, const char *mode);
 
+/* what identifies the version of a file on disk */
+struct TFileStat {
+	uint64_t size;
+	int64_t mtime;		/* seconds since the epoch */
+	uint64_t inode;		/* 0 where the system has none (windows) */
+};
+
+extern bool statFile(const char *filename, TFileStat& st);
+
+/* set the modification time to now */
+extern bool touchFile(const char *filename);
+
+/* append the names of the files in dir to names, without the hidden ones */
+extern bool listDir(const char *dir, std::vector<std::string>& names);
+
+/* Get the directory for cached data: $XDG_CACHE_HOME/fastcrop, defaulting
+ * to ~/.cache/fastcrop (%LOCALAPPDATA%\fastcrop on windows), optionally with
+ * a sub directory. The directories are created if necessary. */
+extern bool getCacheDir(char *buf, size_t size, const char *subdir=NULL);
+
 } // namespace util
 #endif // FASTCROP_UTIL_H